@@ -1,6 +1,10 @@
 QT += widgets
 CONFIG += c++17
 
+# Count allocations made through NEW per type (alloc_tracking.h); off in
+# release builds, where NEW is plain std::make_shared.
+CONFIG(debug, debug|release): DEFINES += MSD_TRACK_ALLOCATIONS
+
 TARGET = Assignment1QT
 TEMPLATE = app
 
@@ -10,7 +14,26 @@ HEADERS += \
     val.h \
     env.h \
     parse.hpp \
-    pointer.h
+    pointer.h \
+    alloc_tracking.h \
+    profiler.h \
+    serialize.h \
+    incremental.h \
+    eval_context.h \
+    eval_status.h \
+    evalworker.h \
+    typecheck.h \
+    cse.h \
+    lazy.h \
+    ast_pool.h \
+    symbol.h \
+    native.h \
+    engine.h \
+    machine.h \
+    scheduler.h \
+    selftest.h \
+    batch.h \
+    server.h
 
 SOURCES += \
     main.cpp \
@@ -18,4 +41,23 @@ SOURCES += \
     expr.cpp \
     val.cpp \
     env.cpp \
-    parse.cpp
+    parse.cpp \
+    serialize.cpp \
+    incremental.cpp \
+    eval_context.cpp \
+    eval_status.cpp \
+    evalworker.cpp \
+    typecheck.cpp \
+    cse.cpp \
+    lazy.cpp \
+    ast_pool.cpp \
+    alloc_tracking.cpp \
+    profiler.cpp \
+    symbol.cpp \
+    native.cpp \
+    engine.cpp \
+    machine.cpp \
+    scheduler.cpp \
+    selftest.cpp \
+    batch.cpp \
+    server.cpp
@@ -0,0 +1,109 @@
+#include "alloc_tracking.h"
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#ifdef __GNUG__
+#include <cstdlib>
+#include <cxxabi.h>
+#endif
+
+namespace {
+
+std::mutex registry_mutex;
+AllocationCounter *registry = nullptr;
+
+std::atomic<uint64_t> total_live{0};
+std::atomic<uint64_t> peak_live{0};
+
+std::string type_name(const std::type_info &type) {
+#ifdef __GNUG__
+    int status = 0;
+    char *demangled = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+    if (status == 0 && demangled) {
+        std::string name(demangled);
+        std::free(demangled);
+        return name;
+    }
+#endif
+    return type.name();
+}
+
+bool by_bytes(const AllocationStats &a, const AllocationStats &b) {
+    return a.bytes > b.bytes;
+}
+
+} // namespace
+
+AllocationCounter::AllocationCounter(const std::type_info &type) : type(type) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    next = registry;
+    registry = this;
+}
+
+void AllocationCounter::allocated(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    bytes.fetch_add(size, std::memory_order_relaxed);
+    live_objects.fetch_add(1, std::memory_order_relaxed);
+    live_bytes.fetch_add(size, std::memory_order_relaxed);
+
+    uint64_t live = total_live.fetch_add(size, std::memory_order_relaxed) + size;
+    uint64_t peak = peak_live.load(std::memory_order_relaxed);
+    while (live > peak && !peak_live.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
+}
+
+void AllocationCounter::freed(size_t size) {
+    live_objects.fetch_sub(1, std::memory_order_relaxed);
+    live_bytes.fetch_sub(size, std::memory_order_relaxed);
+    total_live.fetch_sub(size, std::memory_order_relaxed);
+}
+
+AllocationStats AllocationCounter::stats() const {
+    AllocationStats s;
+    s.type = type_name(type);
+    s.allocations = allocations.load(std::memory_order_relaxed);
+    s.bytes = bytes.load(std::memory_order_relaxed);
+    s.live_objects = live_objects.load(std::memory_order_relaxed);
+    s.live_bytes = live_bytes.load(std::memory_order_relaxed);
+    return s;
+}
+
+std::vector<AllocationStats> allocation_stats() {
+    std::vector<AllocationStats> result;
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        for (AllocationCounter *c = registry; c; c = c->next) result.push_back(c->stats());
+    }
+    std::sort(result.begin(), result.end(), by_bytes);
+    return result;
+}
+
+uint64_t live_allocated_bytes() {
+    return total_live.load(std::memory_order_relaxed);
+}
+
+AllocationWatch::AllocationWatch()
+    : baseline(total_live.load(std::memory_order_relaxed)), start(allocation_stats()) {
+    peak_live.store(baseline, std::memory_order_relaxed);
+}
+
+uint64_t AllocationWatch::peak_bytes() const {
+    uint64_t peak = peak_live.load(std::memory_order_relaxed);
+    return peak > baseline ? peak - baseline : 0;
+}
+
+std::vector<AllocationStats> AllocationWatch::stats() const {
+    std::unordered_map<std::string, const AllocationStats*> before;
+    for (const AllocationStats &s : start) before[s.type] = &s;
+
+    std::vector<AllocationStats> result;
+    for (AllocationStats s : allocation_stats()) {
+        auto it = before.find(s.type);
+        if (it != before.end()) {
+            s.allocations -= it->second->allocations;
+            s.bytes -= it->second->bytes;
+        }
+        if (s.allocations > 0) result.push_back(s);
+    }
+    std::sort(result.begin(), result.end(), by_bytes);
+    return result;
+}
@@ -0,0 +1,141 @@
+#ifndef ALLOC_TRACKING_H
+#define ALLOC_TRACKING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+/**
+ * @file alloc_tracking.h
+ * @brief Per-type allocation counts for objects created with NEW.
+ *
+ * When built with MSD_TRACK_ALLOCATIONS defined, pointer.h's NEW(T)
+ * allocates through a counting allocator. For each type, it counts
+ * allocations, bytes, live objects and live bytes, and it also tracks
+ * the peak of live bytes over all types. Byte counts include the
+ * shared_ptr control block that shares the allocation. Without the
+ * define, NEW stays std::make_shared and nothing here is used. Builds
+ * with plain pointers are not tracked.
+ *
+ * The counters are process-wide, and any thread may update them.
+ */
+
+struct AllocationStats {
+    std::string type;
+    uint64_t allocations = 0;
+    uint64_t bytes = 0;
+    uint64_t live_objects = 0;
+    uint64_t live_bytes = 0;
+};
+
+/**
+ * @brief The counters of one type; registered on first use.
+ */
+class AllocationCounter {
+public:
+    explicit AllocationCounter(const std::type_info &type);
+    AllocationCounter(const AllocationCounter&) = delete;
+    AllocationCounter& operator=(const AllocationCounter&) = delete;
+
+    void allocated(size_t size);
+    void freed(size_t size);
+    AllocationStats stats() const;
+
+    const std::type_info &type;
+    AllocationCounter *next = nullptr;
+
+private:
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> live_objects{0};
+    std::atomic<uint64_t> live_bytes{0};
+};
+
+template <class T>
+AllocationCounter &allocation_counter() {
+    static AllocationCounter counter(typeid(T));
+    return counter;
+}
+
+/**
+ * @brief Allocator that charges every block it hands out to type T.
+ *
+ * allocate_shared rebinds it to its control block type, so the rebound
+ * allocator keeps T as the type to charge.
+ */
+template <class U, class T>
+class TrackingAllocator {
+public:
+    typedef U value_type;
+
+    template <class V>
+    struct rebind {
+        typedef TrackingAllocator<V, T> other;
+    };
+
+    TrackingAllocator() = default;
+    template <class V>
+    TrackingAllocator(const TrackingAllocator<V, T>&) {}
+
+    U *allocate(size_t n) {
+        U *p = std::allocator<U>().allocate(n);
+        allocation_counter<T>().allocated(n * sizeof(U));
+        return p;
+    }
+
+    void deallocate(U *p, size_t n) {
+        allocation_counter<T>().freed(n * sizeof(U));
+        std::allocator<U>().deallocate(p, n);
+    }
+
+    template <class V>
+    bool operator==(const TrackingAllocator<V, T>&) const { return true; }
+    template <class V>
+    bool operator!=(const TrackingAllocator<V, T>&) const { return false; }
+};
+
+/** @brief What NEW(T)(args...) expands to when tracking is on. */
+template <class T, class... Args>
+std::shared_ptr<T> make_tracked(Args&&... args) {
+    return std::allocate_shared<T>(TrackingAllocator<T, T>(), std::forward<Args>(args)...);
+}
+
+/** @brief Counters of every type allocated so far, by bytes allocated, largest first. */
+std::vector<AllocationStats> allocation_stats();
+
+/** @brief Bytes of all tracked objects that are still alive. */
+uint64_t live_allocated_bytes();
+
+/**
+ * @brief Measures the allocations of one run, such as a top-level evaluation.
+ *
+ * The constructor resets the process-wide peak, so only one watch should
+ * be active at a time. Allocations made on other threads meanwhile are
+ * counted too.
+ */
+class AllocationWatch {
+public:
+    AllocationWatch();
+
+    /** @brief Highest live bytes since construction, above the live bytes at construction. */
+    uint64_t peak_bytes() const;
+
+    /**
+     * @brief Allocations and bytes per type since construction, largest first.
+     *
+     * Live objects and bytes are the current totals. Types that allocated
+     * nothing meanwhile are left out.
+     */
+    std::vector<AllocationStats> stats() const;
+
+private:
+    uint64_t baseline;
+    std::vector<AllocationStats> start;
+};
+
+#endif // ALLOC_TRACKING_H
@@ -0,0 +1,560 @@
+#include "ast_pool.h"
+#include "env.h"
+#include "eval_context.h"
+#include "profiler.h"
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+// Binds the parameters of a multi-parameter pool closure in one frame,
+// like FrameEnv; the names are read from the pool. Only closures of the
+// same pool can capture the frame, and they keep the pool alive.
+class PoolFrameEnv : public Env {
+public:
+    const AstPool *pool;
+    NodeId fun;
+    std::vector<PTR(Val)> vals;
+    PTR(Env) rest;
+
+    PoolFrameEnv(const AstPool *pool, NodeId fun, std::vector<PTR(Val)> vals, PTR(Env) rest)
+        : pool(pool), fun(fun), vals(std::move(vals)), rest(rest) {}
+
+    PTR(Val) find(Symbol find_name) override {
+        const Symbol *params = &pool->symbols[pool->a[fun]];
+        for (size_t i = vals.size(); i-- > 0;) {
+            if (params[i] == find_name) return vals[i];
+        }
+        return rest->find(find_name);
+    }
+};
+
+// Frame of a pool _letrec; caches its closure weakly for the same reason
+// as RecEnv.
+class PoolRecEnv : public Env {
+public:
+    std::shared_ptr<const AstPool> pool;
+    Symbol var;
+    NodeId fun;
+    WEAK(Val) closure;
+    PTR(Env) rest;
+
+    PoolRecEnv(std::shared_ptr<const AstPool> pool, Symbol var, NodeId fun, PTR(Env) rest)
+        : pool(std::move(pool)), var(var), fun(fun), closure(), rest(rest) {}
+
+    PTR(Val) find(Symbol find_name) override {
+        if (find_name != var) return rest->find(find_name);
+        PTR(Val) self = LOCK(closure);
+        if (!self) {
+            eval_allocated(sizeof(PoolFunVal));
+            self = NEW(PoolFunVal)(pool, fun, THIS);
+            closure = self;
+        }
+        return self;
+    }
+};
+
+void print_params(std::ostream &os, const Symbol *params, size_t count, const char *separator) {
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0) os << separator;
+        os << params[i];
+    }
+}
+
+} // namespace
+
+AstPool::~AstPool() {
+    delete[] labels.load();
+}
+
+// ==================== Conversion ====================
+NodeId AstPool::push(pool_kind_t kind, uint32_t op_a, uint32_t op_b, uint32_t op_c, SourceSpan span) {
+    // A pool is not evaluated while it grows, so no caller can hold the table.
+    if (labels.load(std::memory_order_relaxed)) delete[] labels.exchange(nullptr);
+    kinds.push_back(kind);
+    a.push_back(op_a);
+    b.push_back(op_b);
+    c.push_back(op_c);
+    spans.push_back(span);
+    return static_cast<NodeId>(kinds.size() - 1);
+}
+
+NodeId AstPool::add(PTR(Expr) e) {
+    if (PTR(NumExpr) n = CAST(NumExpr)(e)) {
+        literals.push_back(n->val);
+        return push(pool_num, static_cast<uint32_t>(literals.size() - 1), 0, 0, e->span);
+    }
+    if (PTR(BoolExpr) bool_e = CAST(BoolExpr)(e)) return push(pool_bool, bool_e->val ? 1 : 0, 0, 0, e->span);
+    if (PTR(VarExpr) var = CAST(VarExpr)(e)) {
+        symbols.push_back(var->name);
+        return push(pool_var, static_cast<uint32_t>(symbols.size() - 1), 0, 0, e->span);
+    }
+    if (PTR(AddExpr) add_e = CAST(AddExpr)(e)) {
+        NodeId lhs = add(add_e->lhs);
+        return push(pool_add, lhs, add(add_e->rhs), 0, e->span);
+    }
+    if (PTR(MultExpr) mult = CAST(MultExpr)(e)) {
+        NodeId lhs = add(mult->lhs);
+        return push(pool_mult, lhs, add(mult->rhs), 0, e->span);
+    }
+    if (PTR(EqualExpr) eq = CAST(EqualExpr)(e)) {
+        NodeId lhs = add(eq->lhs);
+        return push(pool_equal, lhs, add(eq->rhs), 0, e->span);
+    }
+    if (PTR(IfExpr) i = CAST(IfExpr)(e)) {
+        NodeId condition = add(i->condition);
+        NodeId then_branch = add(i->then_branch);
+        return push(pool_if, condition, then_branch, add(i->else_branch), e->span);
+    }
+    if (PTR(LetExpr) let = CAST(LetExpr)(e)) {
+        NodeId rhs = add(let->rhs);
+        NodeId body = add(let->body);
+        symbols.push_back(let->var);
+        return push(pool_let, static_cast<uint32_t>(symbols.size() - 1), rhs, body, e->span);
+    }
+    if (PTR(LetRecExpr) rec = CAST(LetRecExpr)(e)) {
+        NodeId rhs = add(rec->rhs);
+        NodeId body = add(rec->body);
+        symbols.push_back(rec->var);
+        return push(pool_letrec, static_cast<uint32_t>(symbols.size() - 1), rhs, body, e->span);
+    }
+    if (PTR(FunExpr) f = CAST(FunExpr)(e)) {
+        NodeId body = add(f->body);
+        uint32_t first = static_cast<uint32_t>(symbols.size());
+        symbols.insert(symbols.end(), f->params.begin(), f->params.end());
+        symbols.push_back(f->name);
+        return push(pool_fun, first, static_cast<uint32_t>(f->params.size()), body, e->span);
+    }
+    if (PTR(CallExpr) call = CAST(CallExpr)(e)) {
+        NodeId func = add(call->func);
+        std::vector<NodeId> arg_ids;
+        arg_ids.reserve(call->args.size());
+        for (size_t i = 0; i < call->args.size(); i++) arg_ids.push_back(add(call->args[i]));
+        uint32_t first = static_cast<uint32_t>(args.size());
+        args.insert(args.end(), arg_ids.begin(), arg_ids.end());
+        return push(pool_call, func, first, static_cast<uint32_t>(arg_ids.size()), e->span);
+    }
+    throw std::runtime_error("Cannot add expression to pool");
+}
+
+PTR(Expr) AstPool::to_expr(NodeId n) const {
+    PTR(Expr) e;
+    switch (kinds[n]) {
+        case pool_num: e = NEW(NumExpr)(literals[a[n]]); break;
+        case pool_bool: e = NEW(BoolExpr)(a[n] != 0); break;
+        case pool_var: e = NEW(VarExpr)(symbols[a[n]]); break;
+        case pool_add: e = NEW(AddExpr)(to_expr(a[n]), to_expr(b[n])); break;
+        case pool_mult: e = NEW(MultExpr)(to_expr(a[n]), to_expr(b[n])); break;
+        case pool_equal: e = NEW(EqualExpr)(to_expr(a[n]), to_expr(b[n])); break;
+        case pool_if: e = NEW(IfExpr)(to_expr(a[n]), to_expr(b[n]), to_expr(c[n])); break;
+        case pool_let: e = NEW(LetExpr)(symbols[a[n]], to_expr(b[n]), to_expr(c[n])); break;
+        case pool_letrec:
+            e = NEW(LetRecExpr)(symbols[a[n]], STATIC_CAST(FunExpr)(to_expr(b[n])), to_expr(c[n]));
+            break;
+        case pool_fun:
+            e = NEW(FunExpr)(std::vector<Symbol>(symbols.begin() + a[n], symbols.begin() + a[n] + b[n]), to_expr(c[n]));
+            break;
+        case pool_call: {
+            std::vector<PTR(Expr)> arg_exprs;
+            arg_exprs.reserve(c[n]);
+            for (uint32_t i = 0; i < c[n]; i++) arg_exprs.push_back(to_expr(args[b[n] + i]));
+            e = NEW(CallExpr)(to_expr(a[n]), std::move(arg_exprs));
+            break;
+        }
+    }
+    e->span = spans[n];
+    return e;
+}
+
+size_t AstPool::bytes() const {
+    return kinds.capacity() * sizeof(pool_kind_t) +
+           (a.capacity() + b.capacity() + c.capacity()) * sizeof(uint32_t) +
+           spans.capacity() * sizeof(SourceSpan) +
+           literals.capacity() * sizeof(int64_t) +
+           symbols.capacity() * sizeof(Symbol) +
+           args.capacity() * sizeof(NodeId);
+}
+
+// ==================== Evaluation ====================
+PTR(Val) AstPool::fail_at(EvalStatus &status, NodeId n) const {
+    status.locate(spans[n]);
+    return nullptr;
+}
+
+PTR(Val) AstPool::eval(NodeId n, PTR(Env) env, EvalStatus &status) const {
+    return eval(n, env, status, pin());
+}
+
+PTR(Val) AstPool::eval(NodeId n, PTR(Env) env, EvalStatus &status, const std::shared_ptr<const AstPool> &owner) const {
+    switch (kinds[n]) {
+        case pool_num:
+            return NEW(NumVal)(literals[a[n]]);
+        case pool_bool:
+            return NEW(BoolVal)(a[n] != 0);
+        case pool_var: {
+            PTR(Val) v = env->find(symbols[a[n]]);
+            if (v) return v;
+            status.fail_free_variable(symbols[a[n]]);
+            return fail_at(status, n);
+        }
+        case pool_add:
+        case pool_mult:
+        case pool_equal: {
+            PTR(Val) lhs_val = eval(a[n], env, status, owner);
+            if (!lhs_val) return nullptr;
+            PTR(Val) rhs_val = eval(b[n], env, status, owner);
+            if (!rhs_val) return nullptr;
+            if (kinds[n] == pool_equal) return NEW(BoolVal)(lhs_val->equals(rhs_val));
+            PTR(Val) v = kinds[n] == pool_add ? lhs_val->try_add_to(rhs_val, status)
+                                              : lhs_val->try_mult_with(rhs_val, status);
+            return v ? v : fail_at(status, n);
+        }
+        case pool_if: {
+            PTR(Val) cond_val = eval(a[n], env, status, owner);
+            if (!cond_val) return nullptr;
+            PTR(BoolVal) bool_cond = CAST(BoolVal)(cond_val);
+            if (!bool_cond) {
+                status.fail(eval_type_error, "Condition must be boolean");
+                return fail_at(status, n);
+            }
+            return eval(bool_cond->val ? b[n] : c[n], env, status, owner);
+        }
+        case pool_let: {
+            PTR(Val) rhs_val = eval(b[n], env, status, owner);
+            if (!rhs_val) return nullptr;
+            eval_step();
+            eval_allocated(sizeof(ExtendedEnv));
+            PTR(Env) new_env = NEW(ExtendedEnv)(symbols[a[n]], rhs_val, env);
+            return eval(c[n], new_env, status, owner);
+        }
+        case pool_letrec:
+            eval_step();
+            return eval(c[n], bind_rec(n, env, owner), status, owner);
+        case pool_fun:
+            eval_allocated(sizeof(PoolFunVal));
+            return NEW(PoolFunVal)(owner, n, env);
+        case pool_call:
+            return eval_call(n, env, status, owner);
+    }
+    return nullptr;
+}
+
+// Closures of any pool, Expr closures and natives are all callable; a
+// native is checked before its arguments are evaluated, as in CallExpr.
+PTR(Val) AstPool::eval_call(NodeId n, PTR(Env) env, EvalStatus &status, const std::shared_ptr<const AstPool> &owner) const {
+    PTR(Val) callee = eval(a[n], env, status, owner);
+    if (!callee) return nullptr;
+    PTR(PoolFunVal) pool_fun = CAST(PoolFunVal)(callee);
+    PTR(FunVal) fun = pool_fun ? nullptr : CAST(FunVal)(callee);
+    PTR(NativeFunVal) native = pool_fun || fun ? nullptr : CAST(NativeFunVal)(callee);
+    if (!pool_fun && !fun && !native) {
+        status.fail(eval_not_function, "Cannot call non-function value");
+        return fail_at(status, n);
+    }
+
+    std::vector<PTR(Val)> arg_vals;
+    arg_vals.reserve(c[n]);
+    for (uint32_t i = 0; i < c[n]; i++) {
+        PTR(Val) v = eval(args[b[n] + i], env, status, owner);
+        if (!v) return nullptr;
+        arg_vals.push_back(v);
+    }
+
+    PTR(Val) v;
+    if (pool_fun) v = pool_fun->call(std::move(arg_vals), status);
+    else if (fun) v = fun->call(std::move(arg_vals), status);
+    else v = native->call(arg_vals, status);
+    return v ? v : fail_at(status, n);
+}
+
+PTR(Env) AstPool::bind_rec(NodeId n, PTR(Env) env, const std::shared_ptr<const AstPool> &owner) const {
+    eval_allocated(sizeof(PoolRecEnv));
+    return NEW(PoolRecEnv)(owner, symbols[a[n]], b[n], env);
+}
+
+// The handle aliases a control block that holds one reference to the
+// pool's own, so copies of it never touch the count other threads share.
+std::shared_ptr<const AstPool> AstPool::pin() const {
+    std::shared_ptr<const AstPool> shared = weak_from_this().lock();
+    if (!shared) return std::shared_ptr<const AstPool>(std::shared_ptr<const AstPool>(), this);
+    std::shared_ptr<std::shared_ptr<const AstPool>> holder = std::make_shared<std::shared_ptr<const AstPool>>(std::move(shared));
+    return std::shared_ptr<const AstPool>(holder, this);
+}
+
+PTR(Val) AstPool::interp(NodeId n, PTR(Env) env) const {
+    EvalStatus status;
+    PTR(Val) v = eval(n, env, status);
+    if (!v) status.raise();
+    return v;
+}
+
+// ==================== Equality ====================
+bool AstPool::equals(NodeId n, const AstPool &other, NodeId m) const {
+    if (this == &other && n == m) return true;
+    if (kinds[n] != other.kinds[m]) return false;
+    switch (kinds[n]) {
+        case pool_num:
+            return literals[a[n]] == other.literals[other.a[m]];
+        case pool_bool:
+            return a[n] == other.a[m];
+        case pool_var:
+            return symbols[a[n]] == other.symbols[other.a[m]];
+        case pool_add:
+        case pool_mult:
+        case pool_equal:
+            return equals(a[n], other, other.a[m]) && equals(b[n], other, other.b[m]);
+        case pool_if:
+            return equals(a[n], other, other.a[m]) && equals(b[n], other, other.b[m]) &&
+                   equals(c[n], other, other.c[m]);
+        case pool_let:
+        case pool_letrec:
+            return symbols[a[n]] == other.symbols[other.a[m]] &&
+                   equals(b[n], other, other.b[m]) && equals(c[n], other, other.c[m]);
+        case pool_fun:
+            if (b[n] != other.b[m]) return false;
+            for (uint32_t i = 0; i < b[n]; i++) {
+                if (symbols[a[n] + i] != other.symbols[other.a[m] + i]) return false;
+            }
+            return equals(c[n], other, other.c[m]);
+        case pool_call:
+            if (c[n] != other.c[m] || !equals(a[n], other, other.a[m])) return false;
+            for (uint32_t i = 0; i < c[n]; i++) {
+                if (!equals(args[b[n] + i], other, other.args[other.b[m] + i])) return false;
+            }
+            return true;
+    }
+    return false;
+}
+
+// ==================== Profiling ====================
+uint32_t AstPool::profile_label(NodeId n) const {
+    std::atomic<uint32_t> *table = labels.load(std::memory_order_acquire);
+    if (!table) {
+        std::atomic<uint32_t> *fresh = new std::atomic<uint32_t>[kinds.size()]();
+        if (labels.compare_exchange_strong(table, fresh, std::memory_order_acq_rel)) table = fresh;
+        else delete[] fresh;
+    }
+    uint32_t l = table[n].load(std::memory_order_relaxed);
+    if (l == 0) {
+        Symbol name = symbols[a[n] + b[n]];
+        std::string text = name == Symbol() ? "_fun" : name.name();
+        if (!spans[n].empty()) text += "@" + std::to_string(spans[n].begin) + "-" + std::to_string(spans[n].end);
+        l = intern_profile_label(text);
+        table[n].store(l, std::memory_order_relaxed);
+    }
+    return l;
+}
+
+// ==================== Printing ====================
+void AstPool::print(NodeId n, std::ostream &os) const {
+    switch (kinds[n]) {
+        case pool_num: os << literals[a[n]]; break;
+        case pool_bool: os << (a[n] ? "_true" : "_false"); break;
+        case pool_var: os << symbols[a[n]]; break;
+        case pool_add:
+        case pool_mult:
+        case pool_equal:
+            os << "(";
+            print(a[n], os);
+            os << (kinds[n] == pool_add ? "+" : kinds[n] == pool_mult ? "*" : "==");
+            print(b[n], os);
+            os << ")";
+            break;
+        case pool_if:
+            os << "(_if ";
+            print(a[n], os);
+            os << " _then ";
+            print(b[n], os);
+            os << " _else ";
+            print(c[n], os);
+            os << ")";
+            break;
+        case pool_let:
+        case pool_letrec:
+            os << (kinds[n] == pool_let ? "(_let " : "(_letrec ") << symbols[a[n]] << "=";
+            print(b[n], os);
+            os << " _in ";
+            print(c[n], os);
+            os << ")";
+            break;
+        case pool_fun:
+            os << "(_fun (";
+            print_params(os, &symbols[a[n]], b[n], ",");
+            os << ") ";
+            print(c[n], os);
+            os << ")";
+            break;
+        case pool_call:
+            print(a[n], os);
+            os << "(";
+            for (uint32_t i = 0; i < c[n]; i++) {
+                if (i > 0) os << ",";
+                print(args[b[n] + i], os);
+            }
+            os << ")";
+            break;
+    }
+}
+
+std::string AstPool::to_string(NodeId n) const {
+    std::stringstream ss;
+    print(n, ss);
+    return ss.str();
+}
+
+bool AstPool::is_simple(NodeId n) const {
+    pool_kind_t kind = kinds[n];
+    return kind == pool_num || kind == pool_add || kind == pool_mult || kind == pool_call;
+}
+
+void AstPool::pretty_print(NodeId n, std::ostream &os, precedence_t prec, std::streampos &lastIndent) const {
+    switch (kinds[n]) {
+        case pool_num:
+        case pool_bool:
+        case pool_var:
+            print(n, os);
+            break;
+        case pool_add: {
+            bool needs_paren = prec >= prec_add;
+            if (needs_paren) os << "(";
+            pretty_print(a[n], os, prec_add, lastIndent);
+            os << " + ";
+            pretty_print(b[n], os, prec_none, lastIndent);
+            if (needs_paren) os << ")";
+            break;
+        }
+        case pool_mult: {
+            bool needs_paren = prec >= prec_mult;
+            if (needs_paren) os << "(";
+            pretty_print(a[n], os, prec_mult, lastIndent);
+            os << " * ";
+            pretty_print(b[n], os, prec_mult, lastIndent);
+            if (needs_paren) os << ")";
+            break;
+        }
+        case pool_equal: {
+            bool needs_paren = prec > prec_none;
+            if (needs_paren) os << "(";
+            pretty_print(a[n], os, prec_add, lastIndent);
+            os << " == ";
+            pretty_print(b[n], os, prec_add, lastIndent);
+            if (needs_paren) os << ")";
+            break;
+        }
+        case pool_if: {
+            bool needs_paren = prec != prec_none;
+            if (needs_paren) os << "(";
+            std::streampos if_start = os.tellp();
+            os << "_if ";
+            pretty_print(a[n], os, prec_none, lastIndent);
+            os << "\n";
+            size_t indent = if_start - lastIndent + 2;
+            std::streampos new_indent_pos = if_start + std::streamoff(indent);
+            os << std::string(indent, ' ') << "_then ";
+            pretty_print(b[n], os, prec_none, new_indent_pos);
+            os << "\n" << std::string(indent, ' ') << "_else ";
+            pretty_print(c[n], os, prec_none, new_indent_pos);
+            if (needs_paren) os << ")";
+            break;
+        }
+        case pool_let:
+        case pool_letrec: {
+            bool needs_paren = prec != prec_none;
+            if (needs_paren) os << "(";
+            std::streampos let_start = os.tellp();
+            os << (kinds[n] == pool_let ? "_let " : "_letrec ") << symbols[a[n]] << " = ";
+            pretty_print(b[n], os, prec_none, lastIndent);
+            os << "\n";
+            size_t indent = let_start - lastIndent;
+            os << std::string(indent, ' ') << "_in ";
+            std::streampos in_start = os.tellp();
+            pretty_print(c[n], os, prec_none, in_start);
+            if (needs_paren) os << ")";
+            break;
+        }
+        case pool_fun: {
+            bool needs_paren = prec != prec_none;
+            if (needs_paren) os << "(";
+            os << "_fun (";
+            print_params(os, &symbols[a[n]], b[n], ", ");
+            os << ")";
+            if (is_simple(c[n])) {
+                os << " ";
+                pretty_print(c[n], os, prec_none, lastIndent);
+            } else {
+                os << "\n  ";
+                std::streampos body_start = os.tellp();
+                pretty_print(c[n], os, prec_none, body_start);
+            }
+            if (needs_paren) os << ")";
+            break;
+        }
+        case pool_call:
+            pretty_print(a[n], os, prec_none, lastIndent);
+            os << "(";
+            for (uint32_t i = 0; i < c[n]; i++) {
+                if (i > 0) os << ", ";
+                pretty_print(args[b[n] + i], os, prec_none, lastIndent);
+            }
+            os << ")";
+            break;
+    }
+}
+
+std::string AstPool::to_pretty_string(NodeId n) const {
+    std::stringstream ss;
+    std::streampos initial_pos = ss.tellp();
+    pretty_print(n, ss, prec_none, initial_pos);
+    return ss.str();
+}
+
+// ==================== PoolFunVal ====================
+PoolFunVal::PoolFunVal(std::shared_ptr<const AstPool> pool, NodeId fun, PTR(Env) env)
+    : pool(std::move(pool)), fun(fun), env(env) {}
+
+PTR(Val) PoolFunVal::call(std::vector<PTR(Val)> arg_vals, EvalStatus &status) {
+    PTR(Env) new_env = bind(std::move(arg_vals), status);
+    if (!new_env) return nullptr;
+    eval_step();
+    EvalCallGuard depth;
+    ProfileFrame profile(this);
+    return pool->eval(pool->c[fun], new_env, status, pool);
+}
+
+PTR(Env) PoolFunVal::bind(std::vector<PTR(Val)> arg_vals, EvalStatus &status) {
+    size_t count = pool->b[fun];
+    if (arg_vals.size() != count) {
+        status.fail_arity(count, arg_vals.size());
+        return nullptr;
+    }
+    if (count == 0) return env;
+    if (count == 1) {
+        eval_allocated(sizeof(ExtendedEnv));
+        return NEW(ExtendedEnv)(pool->symbols[pool->a[fun]], arg_vals[0], env);
+    }
+    eval_allocated(sizeof(PoolFrameEnv) + count * sizeof(PTR(Val)));
+    return NEW(PoolFrameEnv)(pool.get(), fun, std::move(arg_vals), env);
+}
+
+PTR(Val) PoolFunVal::try_add_to(PTR(Val), EvalStatus &status) {
+    status.fail(eval_type_error, "Cannot add functions");
+    return nullptr;
+}
+
+PTR(Val) PoolFunVal::try_mult_with(PTR(Val), EvalStatus &status) {
+    status.fail(eval_type_error, "Cannot multiply functions");
+    return nullptr;
+}
+
+bool PoolFunVal::equals(PTR(Val) other) {
+    PTR(PoolFunVal) f = CAST(PoolFunVal)(other);
+    return f && pool->equals(fun, *f->pool, f->fun) && env == f->env;
+}
+
+PTR(Expr) PoolFunVal::to_expr() {
+    return pool->to_expr(fun);
+}
+
+std::string PoolFunVal::to_string() {
+    return "[function]";
+}
@@ -0,0 +1,170 @@
+#ifndef AST_POOL_H
+#define AST_POOL_H
+
+#include "expr.h"
+#include "val.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+ * @file ast_pool.h
+ * @brief Expression trees stored as parallel arrays.
+ *
+ * A pool keeps every node as an entry in contiguous arrays: a kind byte,
+ * three 32-bit operands and a source span. Literals, names and call
+ * argument lists live in their own arrays, which the operands index. A
+ * node takes 21 bytes plus its literal or names, against a heap object
+ * with a vtable and 16-byte shared_ptr children behind a control block.
+ * Children are appended before their parent, so a tree occupies one
+ * contiguous run of entries and a walk over it stays within a few cache
+ * lines.
+ *
+ * Trees are converted from and to Expr, and can be evaluated, printed and
+ * compared without converting them back. Evaluation gives the same
+ * results, errors and spans as Expr::eval, but it does not use the inline
+ * caches, quickening or type specializations of the Expr nodes.
+ */
+
+typedef uint32_t NodeId;
+
+typedef enum : uint8_t {
+    pool_num,
+    pool_bool,
+    pool_var,
+    pool_add,
+    pool_mult,
+    pool_equal,
+    pool_if,
+    pool_let,
+    pool_letrec,
+    pool_fun,
+    pool_call
+} pool_kind_t;
+
+class AstPool : public std::enable_shared_from_this<AstPool> {
+public:
+    AstPool() = default;
+    ~AstPool();
+
+    // One entry per node. The operands by kind:
+    //   num:               a = index in literals
+    //   bool:              a = 0 or 1
+    //   var:               a = index in symbols
+    //   add, mult, equal:  a, b = operands
+    //   if:                a = condition, b = then branch, c = else branch
+    //   let, letrec:       a = index in symbols, b = right-hand side, c = body
+    //   fun:               a = first parameter in symbols, b = parameter count, c = body;
+    //                      the parameters are followed by the name the _fun is profiled under
+    //   call:              a = function, b = first argument in args, c = argument count
+    std::vector<pool_kind_t> kinds;
+    std::vector<uint32_t> a;
+    std::vector<uint32_t> b;
+    std::vector<uint32_t> c;
+    std::vector<SourceSpan> spans;
+
+    std::vector<int64_t> literals;
+    std::vector<Symbol> symbols;
+    std::vector<NodeId> args;
+
+    /**
+     * @brief Appends a tree to the pool.
+     * @param e The expression; lazy and specialized nodes are stored as their generic kind.
+     * @return The id of its root.
+     * @throws std::runtime_error If the tree contains a node the pool cannot represent.
+     */
+    NodeId add(PTR(Expr) e);
+
+    /** @brief Builds Expr nodes for the tree rooted at n. */
+    PTR(Expr) to_expr(NodeId n) const;
+
+    size_t size() const { return kinds.size(); }
+
+    /** @brief Bytes held by the arrays, including unused capacity. */
+    size_t bytes() const;
+
+    /**
+     * @brief Evaluates the tree rooted at n like Expr::eval.
+     *
+     * Closures keep the pool alive when a shared_ptr owns it, as one owns
+     * the pool of a Program; any other pool must outlive its closures.
+     */
+    PTR(Val) eval(NodeId n, PTR(Env) env, EvalStatus &status) const;
+
+    /** @brief Like eval, but closures hold owner, a handle from pin(). */
+    PTR(Val) eval(NodeId n, PTR(Env) env, EvalStatus &status, const std::shared_ptr<const AstPool> &owner) const;
+
+    /** @brief Like eval, but throws an EvalError. */
+    PTR(Val) interp(NodeId n, PTR(Env) env) const;
+
+    /** @brief Structural equality with the tree rooted at m in other, like Expr::equals. */
+    bool equals(NodeId n, const AstPool &other, NodeId m) const;
+
+    /**
+     * @brief A handle on the pool with a reference count of its own.
+     *
+     * It owns the pool if a shared_ptr does, and is a plain pointer
+     * otherwise. Closures copy the handle they were made under, so a
+     * thread that pins the pool once counts its closures in memory no
+     * other thread writes.
+     */
+    std::shared_ptr<const AstPool> pin() const;
+
+    /** @brief The frame the _letrec node n evaluates its body in; its closure holds owner. */
+    PTR(Env) bind_rec(NodeId n, PTR(Env) env, const std::shared_ptr<const AstPool> &owner) const;
+
+    /**
+     * @brief Names the _fun node n in profiles like FunExpr::profile_label.
+     *
+     * Labels are made on first use and kept per node, so closures made
+     * from one node share one label; safe to call from any thread.
+     */
+    uint32_t profile_label(NodeId n) const;
+
+    /** @brief Prints the tree rooted at n like Expr::printExp. */
+    void print(NodeId n, std::ostream &os) const;
+    std::string to_string(NodeId n) const;
+    std::string to_pretty_string(NodeId n) const;
+
+private:
+    NodeId push(pool_kind_t kind, uint32_t a, uint32_t b, uint32_t c, SourceSpan span);
+    PTR(Val) fail_at(EvalStatus &status, NodeId n) const;
+    PTR(Val) eval_call(NodeId n, PTR(Env) env, EvalStatus &status, const std::shared_ptr<const AstPool> &owner) const;
+    bool is_simple(NodeId n) const;
+    void pretty_print(NodeId n, std::ostream &os, precedence_t prec, std::streampos &lastIndent) const;
+
+    // Profile labels by node, 0 until made; allocated by the first
+    // profile_label() call and dropped whenever the pool grows.
+    mutable std::atomic<std::atomic<uint32_t>*> labels{nullptr};
+};
+
+/**
+ * @brief A closure over a _fun node of an AstPool.
+ *
+ * Calls from the pool also accept FunVal and NativeFunVal callees, so
+ * hosts can bind natives and Expr closures as usual.
+ */
+class PoolFunVal : public Val {
+public:
+    std::shared_ptr<const AstPool> pool;  ///< The handle the closure was made under (AstPool::pin).
+    NodeId fun;
+    PTR(Env) env;
+
+    PoolFunVal(std::shared_ptr<const AstPool> pool, NodeId fun, PTR(Env) env);
+    PTR(Val) call(std::vector<PTR(Val)> arg_vals, EvalStatus &status);
+    // The frame the body runs in, or nullptr with status set if the
+    // argument count is wrong.
+    PTR(Env) bind(std::vector<PTR(Val)> arg_vals, EvalStatus &status);
+    PTR(Val) try_add_to(PTR(Val) other_val, EvalStatus &status) override;
+    PTR(Val) try_mult_with(PTR(Val) other_val, EvalStatus &status) override;
+    bool equals(PTR(Val) other_val) override;
+    PTR(Expr) to_expr() override;
+    std::string to_string() override;
+    uint32_t profile_label() { return pool->profile_label(fun); }
+};
+
+#endif // AST_POOL_H
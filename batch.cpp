@@ -0,0 +1,335 @@
+#include "batch.h"
+#include "eval_context.h"
+#include "val.h"
+#include <algorithm>
+#include <typeinfo>
+#include <utility>
+
+namespace {
+
+// Rows processed per node at a time; large enough to amortize dispatch,
+// small enough that a node's block stays in cache for its parent.
+const size_t BLOCK = 1024;
+const size_t NO_SLOT = SIZE_MAX;
+
+typedef enum {
+    kind_int,
+    kind_bool,
+    kind_fail   // Every row fails; the value is meaningless.
+} column_kind_t;
+
+typedef enum {
+    op_const,
+    op_column,
+    op_add,
+    op_mult,
+    op_equal,
+    op_never_equal,  // == on a number and a boolean
+    op_select,
+    op_sequence,     // _let: the body's value, unless the right-hand side failed
+    op_fail          // type error, unless an operand already failed
+} op_t;
+
+// One node of the compiled program, writing block dst from blocks a, b
+// and c. Children get their slots first, so running the ops in order
+// computes every operand before its use.
+struct Op {
+    op_t op;
+    size_t dst;
+    size_t a;
+    size_t b;
+    size_t c;
+    int64_t constant;
+    const int64_t *column;
+};
+
+struct Block {
+    alignas(64) int64_t val[BLOCK];
+    alignas(64) uint8_t err[BLOCK];
+};
+
+class Compiler {
+public:
+    std::vector<Op> ops;
+
+    explicit Compiler(const std::vector<BatchColumn> &columns) : columns(columns) {}
+
+    // Returns false if e is outside the vectorizable subset.
+    bool compile(PTR(Expr) e, size_t &slot, column_kind_t &kind) {
+        if (PTR(NumExpr) n = CAST(NumExpr)(e)) {
+            kind = kind_int;
+            slot = emit(op_const, NO_SLOT, NO_SLOT, NO_SLOT);
+            ops.back().constant = n->val;
+            return true;
+        }
+        if (PTR(BoolExpr) b = CAST(BoolExpr)(e)) {
+            kind = kind_bool;
+            slot = emit(op_const, NO_SLOT, NO_SLOT, NO_SLOT);
+            ops.back().constant = b->val ? 1 : 0;
+            return true;
+        }
+        if (PTR(VarExpr) v = CAST(VarExpr)(e)) return compile_var(v->name, slot, kind);
+        if (PTR(AddExpr) add = CAST(AddExpr)(e)) return compile_arith(op_add, add->lhs, add->rhs, slot, kind);
+        if (PTR(MultExpr) mult = CAST(MultExpr)(e)) return compile_arith(op_mult, mult->lhs, mult->rhs, slot, kind);
+        if (PTR(EqualExpr) eq = CAST(EqualExpr)(e)) {
+            size_t a, b;
+            column_kind_t ka, kb;
+            if (!compile(eq->lhs, a, ka) || !compile(eq->rhs, b, kb)) return false;
+            kind = (ka == kind_fail || kb == kind_fail) ? kind_fail : kind_bool;
+            slot = emit(ka == kb ? op_equal : op_never_equal, a, b, NO_SLOT);
+            return true;
+        }
+        if (PTR(IfExpr) i = CAST(IfExpr)(e)) {
+            size_t c, t, f;
+            column_kind_t kc, kt, kf;
+            if (!compile(i->condition, c, kc)) return false;
+            if (kc != kind_bool) {
+                kind = kind_fail;
+                slot = emit(op_fail, c, NO_SLOT, NO_SLOT);
+                return true;
+            }
+            if (!compile(i->then_branch, t, kt) || !compile(i->else_branch, f, kf)) return false;
+            if (kt == kind_fail) kind = kf;
+            else if (kf == kind_fail || kt == kf) kind = kt;
+            else return false;
+            slot = emit(op_select, c, t, f);
+            return true;
+        }
+        if (PTR(LetExpr) let = CAST(LetExpr)(e)) {
+            // A lazy _let (lazy.h) drops the errors of a binding it never
+            // uses, which op_sequence would keep.
+            if (typeid(*let) != typeid(LetExpr)) return false;
+            size_t rhs, body;
+            column_kind_t krhs, kbody;
+            if (!compile(let->rhs, rhs, krhs)) return false;
+            scope.push_back({let->var, {rhs, krhs}});
+            bool ok = compile(let->body, body, kbody);
+            scope.pop_back();
+            if (!ok) return false;
+            kind = krhs == kind_fail ? kind_fail : kbody;
+            slot = emit(op_sequence, rhs, body, NO_SLOT);
+            return true;
+        }
+        return false;
+    }
+
+private:
+    const std::vector<BatchColumn> &columns;
+    std::vector<std::pair<Symbol, std::pair<size_t, column_kind_t>>> scope;
+
+    size_t emit(op_t op, size_t a, size_t b, size_t c) {
+        Op o = {op, ops.size(), a, b, c, 0, nullptr};
+        ops.push_back(o);
+        return o.dst;
+    }
+
+    bool compile_var(Symbol name, size_t &slot, column_kind_t &kind) {
+        for (auto it = scope.rbegin(); it != scope.rend(); ++it) {
+            if (it->first == name) {
+                slot = it->second.first;
+                kind = it->second.second;
+                return true;
+            }
+        }
+        for (const BatchColumn &column : columns) {
+            if (column.name == name) {
+                kind = kind_int;
+                slot = emit(op_column, NO_SLOT, NO_SLOT, NO_SLOT);
+                ops.back().column = column.values;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool compile_arith(op_t op, PTR(Expr) lhs, PTR(Expr) rhs, size_t &slot, column_kind_t &kind) {
+        size_t a, b;
+        column_kind_t ka, kb;
+        if (!compile(lhs, a, ka) || !compile(rhs, b, kb)) return false;
+        bool typed = ka == kind_int && kb == kind_int;
+        kind = typed ? kind_int : kind_fail;
+        slot = emit(typed ? op : op_fail, a, b, NO_SLOT);
+        return true;
+    }
+};
+
+// The kernels below are plain loops over restrict-qualified blocks with
+// no calls or early exits, so the compiler can vectorize them. A row's
+// error is the first one in scalar evaluation order: left operand, right
+// operand, then the operation itself.
+
+inline uint8_t first_error(uint8_t a, uint8_t b, uint8_t own) {
+    return a ? a : (b ? b : own);
+}
+
+void kernel_add(size_t n, const Block &x, const Block &y, Block &out) {
+    const int64_t *__restrict a = x.val;
+    const int64_t *__restrict b = y.val;
+    int64_t *__restrict r = out.val;
+    const uint8_t *__restrict ea = x.err;
+    const uint8_t *__restrict eb = y.err;
+    uint8_t *__restrict e = out.err;
+    for (size_t i = 0; i < n; i++) {
+        int64_t sum = static_cast<int64_t>(static_cast<uint64_t>(a[i]) + static_cast<uint64_t>(b[i]));
+        bool overflow = ((a[i] ^ sum) & (b[i] ^ sum)) < 0;
+        r[i] = sum;
+        e[i] = first_error(ea[i], eb[i], overflow ? batch_overflow : batch_ok);
+    }
+}
+
+void kernel_mult(size_t n, const Block &x, const Block &y, Block &out) {
+    const int64_t *__restrict a = x.val;
+    const int64_t *__restrict b = y.val;
+    int64_t *__restrict r = out.val;
+    const uint8_t *__restrict ea = x.err;
+    const uint8_t *__restrict eb = y.err;
+    uint8_t *__restrict e = out.err;
+    for (size_t i = 0; i < n; i++) {
+        bool overflow = __builtin_mul_overflow(a[i], b[i], &r[i]);
+        e[i] = first_error(ea[i], eb[i], overflow ? batch_overflow : batch_ok);
+    }
+}
+
+void kernel_equal(size_t n, const Block &x, const Block &y, Block &out, bool never) {
+    const int64_t *__restrict a = x.val;
+    const int64_t *__restrict b = y.val;
+    int64_t *__restrict r = out.val;
+    const uint8_t *__restrict ea = x.err;
+    const uint8_t *__restrict eb = y.err;
+    uint8_t *__restrict e = out.err;
+    for (size_t i = 0; i < n; i++) {
+        r[i] = !never && a[i] == b[i];
+        e[i] = first_error(ea[i], eb[i], batch_ok);
+    }
+}
+
+void kernel_select(size_t n, const Block &cond, const Block &x, const Block &y, Block &out) {
+    const int64_t *__restrict c = cond.val;
+    const int64_t *__restrict a = x.val;
+    const int64_t *__restrict b = y.val;
+    int64_t *__restrict r = out.val;
+    const uint8_t *__restrict ec = cond.err;
+    const uint8_t *__restrict ea = x.err;
+    const uint8_t *__restrict eb = y.err;
+    uint8_t *__restrict e = out.err;
+    for (size_t i = 0; i < n; i++) {
+        r[i] = c[i] ? a[i] : b[i];
+        e[i] = ec[i] ? ec[i] : (c[i] ? ea[i] : eb[i]);
+    }
+}
+
+void kernel_sequence(size_t n, const Block &first, const Block &second, Block &out) {
+    const uint8_t *__restrict ea = first.err;
+    const uint8_t *__restrict eb = second.err;
+    uint8_t *__restrict e = out.err;
+    std::copy(second.val, second.val + n, out.val);
+    for (size_t i = 0; i < n; i++) e[i] = first_error(ea[i], eb[i], batch_ok);
+}
+
+void kernel_fail(size_t n, const Block &x, const Block *y, Block &out) {
+    for (size_t i = 0; i < n; i++) {
+        out.err[i] = first_error(x.err[i], y ? y->err[i] : static_cast<uint8_t>(batch_ok), batch_type_error);
+    }
+}
+
+void run_block(const std::vector<Op> &ops, std::vector<Block> &blocks, size_t base, size_t n) {
+    for (const Op &op : ops) {
+        Block &out = blocks[op.dst];
+        switch (op.op) {
+            case op_const:
+                std::fill(out.val, out.val + n, op.constant);
+                std::fill(out.err, out.err + n, batch_ok);
+                break;
+            case op_column:
+                std::copy(op.column + base, op.column + base + n, out.val);
+                std::fill(out.err, out.err + n, batch_ok);
+                break;
+            case op_add:
+                kernel_add(n, blocks[op.a], blocks[op.b], out);
+                break;
+            case op_mult:
+                kernel_mult(n, blocks[op.a], blocks[op.b], out);
+                break;
+            case op_equal:
+            case op_never_equal:
+                kernel_equal(n, blocks[op.a], blocks[op.b], out, op.op == op_never_equal);
+                break;
+            case op_select:
+                kernel_select(n, blocks[op.a], blocks[op.b], blocks[op.c], out);
+                break;
+            case op_sequence:
+                kernel_sequence(n, blocks[op.a], blocks[op.b], out);
+                break;
+            case op_fail:
+                kernel_fail(n, blocks[op.a], op.b == NO_SLOT ? nullptr : &blocks[op.b], out);
+                break;
+        }
+    }
+}
+
+// The vectorized path reports overflows and type errors by status alone;
+// the scalar path does the same, so a row's result does not depend on
+// which one ran.
+uint8_t row_status(eval_error_t code) {
+    switch (code) {
+        case eval_overflow:
+            return batch_overflow;
+        case eval_type_error:
+            return batch_type_error;
+        default:
+            return batch_failed;
+    }
+}
+
+void eval_rows(PTR(Expr) e, const std::vector<BatchColumn> &columns, size_t rows, PTR(Env) env, BatchResult &result) {
+    for (size_t row = 0; row < rows; row++) {
+        PTR(Env) row_env = env;
+        for (const BatchColumn &column : columns) {
+            row_env = NEW(ExtendedEnv)(column.name, NEW(NumVal)(column.values[row]), row_env);
+        }
+        EvalStatus status;
+        PTR(Val) v = e->eval(row_env, status);
+        if (PTR(NumVal) num = CAST(NumVal)(v)) {
+            result.values[row] = num->val;
+        } else if (PTR(BoolVal) b = CAST(BoolVal)(v)) {
+            result.values[row] = b->val ? 1 : 0;
+            result.is_bool[row] = 1;
+        } else if (v) {
+            result.status[row] = batch_failed;
+            result.messages[row] = "Result is not a number or boolean";
+        } else {
+            result.status[row] = row_status(status.code);
+            if (result.status[row] == batch_failed) result.messages[row] = status.message();
+        }
+    }
+}
+
+} // namespace
+
+BatchResult eval_batch(PTR(Expr) e, const std::vector<BatchColumn> &columns, size_t rows, PTR(Env) env) {
+    BatchResult result;
+    result.values.assign(rows, 0);
+    result.is_bool.assign(rows, 0);
+    result.status.assign(rows, batch_ok);
+
+    Compiler compiler(columns);
+    size_t root;
+    column_kind_t kind;
+    if (!compiler.compile(e, root, kind)) {
+        eval_rows(e, columns, rows, env, result);
+        return result;
+    }
+
+    result.vectorized = true;
+    if (kind == kind_bool) result.is_bool.assign(rows, 1);
+    std::vector<Block> blocks(compiler.ops.size());
+    for (size_t base = 0; base < rows; base += BLOCK) {
+        size_t n = std::min(BLOCK, rows - base);
+        run_block(compiler.ops, blocks, base, n);
+        eval_step();
+        const Block &out = blocks[root];
+        std::copy(out.val, out.val + n, result.values.begin() + base);
+        std::copy(out.err, out.err + n, result.status.begin() + base);
+    }
+    return result;
+}
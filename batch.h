@@ -0,0 +1,59 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "expr.h"
+#include "env.h"
+#include "symbol.h"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @file batch.h
+ * @brief Evaluation of one expression over columns of inputs.
+ *
+ * Free variables are bound to int64 columns and the expression is evaluated
+ * for every row. Numbers, booleans, +, *, ==, _if and _let over columns are
+ * compiled to loops that process a block of rows per node instead of
+ * interpreting the tree once per row; _if becomes a select that evaluates
+ * both branches and keeps the errors of the taken one. Anything else (for
+ * example functions, or an _if whose branches have different types) is
+ * evaluated row by row by the scalar interpreter.
+ */
+
+typedef enum {
+    batch_ok,
+    batch_overflow,     ///< Addition or multiplication overflowed.
+    batch_type_error,   ///< An operand had the wrong type.
+    batch_failed        ///< Any other error from the scalar interpreter; see BatchResult::messages.
+} batch_status_t;
+
+/**
+ * @brief An input column: every row binds name to the row's value.
+ */
+struct BatchColumn {
+    Symbol name;
+    const int64_t *values;
+};
+
+struct BatchResult {
+    std::vector<int64_t> values;    ///< Number per row, or 0/1 for a boolean.
+    std::vector<uint8_t> is_bool;   ///< Whether the row's value is a boolean.
+    std::vector<uint8_t> status;    ///< A batch_status_t per row.
+    std::unordered_map<size_t, std::string> messages;  ///< Error text of batch_failed rows.
+    bool vectorized = false;        ///< False if the rows went through the scalar interpreter.
+};
+
+/**
+ * @brief Evaluates an expression once per row of the input columns.
+ * @param e The expression.
+ * @param columns Bindings of its free variables; each column has at least rows values.
+ * @param rows Number of rows.
+ * @param env Environment for names that are not columns (used by the scalar fallback).
+ * @return Values and per-row status; a failing row does not affect the others.
+ * @throws EvalCancelled, EvalLimitExceeded If the thread's EvalContext stops the evaluation.
+ */
+BatchResult eval_batch(PTR(Expr) e, const std::vector<BatchColumn> &columns, size_t rows, PTR(Env) env = Env::empty);
+
+#endif // BATCH_H
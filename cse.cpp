@@ -0,0 +1,367 @@
+#include "cse.h"
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// A hoist must save at least this many evaluated operations to pay for
+// the _let frame that holds the shared value.
+const size_t MIN_SAVED_OPS = 2;
+
+// Free variables of a subtree with the node that binds each of them;
+// nullptr for names bound outside the tree. Sorted and without duplicates.
+typedef std::vector<std::pair<Symbol, Expr*>> FreeVars;
+
+uint64_t mix(uint64_t h, uint64_t v) {
+    h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    return h;
+}
+
+// Children in evaluation order. A _letrec's _fun comes first although only
+// the closure is created.
+std::vector<PTR(Expr)> children(PTR(Expr) e) {
+    if (PTR(AddExpr) add = CAST(AddExpr)(e)) return {add->lhs, add->rhs};
+    if (PTR(MultExpr) mult = CAST(MultExpr)(e)) return {mult->lhs, mult->rhs};
+    if (PTR(EqualExpr) eq = CAST(EqualExpr)(e)) return {eq->lhs, eq->rhs};
+    if (PTR(IfExpr) i = CAST(IfExpr)(e)) return {i->condition, i->then_branch, i->else_branch};
+    if (PTR(LetExpr) let = CAST(LetExpr)(e)) return {let->rhs, let->body};
+    if (PTR(LetRecExpr) rec = CAST(LetRecExpr)(e)) return {rec->rhs, rec->body};
+    if (PTR(FunExpr) f = CAST(FunExpr)(e)) return {f->body};
+    if (PTR(CallExpr) call = CAST(CallExpr)(e)) {
+        std::vector<PTR(Expr)> kids{call->func};
+        kids.insert(kids.end(), call->args.begin(), call->args.end());
+        return kids;
+    }
+    return {};
+}
+
+// A generic node of e's kind with new children, in the order of children().
+PTR(Expr) with_children(PTR(Expr) e, const std::vector<PTR(Expr)> &kids) {
+    PTR(Expr) copy;
+    if (CAST(AddExpr)(e)) copy = NEW(AddExpr)(kids[0], kids[1]);
+    else if (CAST(MultExpr)(e)) copy = NEW(MultExpr)(kids[0], kids[1]);
+    else if (CAST(EqualExpr)(e)) copy = NEW(EqualExpr)(kids[0], kids[1]);
+    else if (CAST(IfExpr)(e)) copy = NEW(IfExpr)(kids[0], kids[1], kids[2]);
+    else if (PTR(LetExpr) let = CAST(LetExpr)(e)) copy = NEW(LetExpr)(let->var, kids[0], kids[1]);
+    else if (PTR(LetRecExpr) rec = CAST(LetRecExpr)(e)) copy = NEW(LetRecExpr)(rec->var, STATIC_CAST(FunExpr)(kids[0]), kids[1]);
+    else if (PTR(FunExpr) f = CAST(FunExpr)(e)) copy = NEW(FunExpr)(f->params, kids[0]);
+    else if (CAST(CallExpr)(e)) copy = NEW(CallExpr)(kids[0], std::vector<PTR(Expr)>(kids.begin() + 1, kids.end()));
+    copy->span = e->span;
+    return copy;
+}
+
+// Hash of a node's own kind and fields, without its children.
+uint64_t node_hash(PTR(Expr) e) {
+    if (PTR(NumExpr) n = CAST(NumExpr)(e)) return mix(1, static_cast<uint64_t>(n->val));
+    if (PTR(BoolExpr) b = CAST(BoolExpr)(e)) return mix(2, b->val);
+    if (PTR(VarExpr) v = CAST(VarExpr)(e)) return mix(3, v->name.id());
+    if (CAST(AddExpr)(e)) return 4;
+    if (CAST(MultExpr)(e)) return 5;
+    if (CAST(EqualExpr)(e)) return 6;
+    if (CAST(IfExpr)(e)) return 7;
+    if (PTR(LetExpr) let = CAST(LetExpr)(e)) return mix(8, let->var.id());
+    if (PTR(LetRecExpr) rec = CAST(LetRecExpr)(e)) return mix(9, rec->var.id());
+    if (PTR(FunExpr) f = CAST(FunExpr)(e)) {
+        uint64_t h = mix(10, f->params.size());
+        for (Symbol param : f->params) h = mix(h, param.id());
+        return h;
+    }
+    if (PTR(CallExpr) call = CAST(CallExpr)(e)) return mix(11, call->args.size());
+    return mix(12, reinterpret_cast<uintptr_t>(RAW(e)));
+}
+
+bool is_operation(PTR(Expr) e) {
+    return CAST(AddExpr)(e) || CAST(MultExpr)(e) || CAST(EqualExpr)(e) || CAST(IfExpr)(e) || CAST(CallExpr)(e);
+}
+
+bool is_candidate(PTR(Expr) e) {
+    return is_operation(e) || CAST(LetExpr)(e) || CAST(LetRecExpr)(e);
+}
+
+struct NodeInfo {
+    PTR(Expr) node;
+    Expr *parent = nullptr;
+    size_t depth = 0;
+    uint64_t hash = 0;
+    size_t ops = 0;           // Operation nodes in the subtree.
+    FreeVars free;
+    Expr *binder = nullptr;   // Of a VarExpr.
+};
+
+class Analysis {
+public:
+    std::unordered_map<Expr*, NodeInfo> info;
+    std::vector<Expr*> preorder;
+    bool shared = false;      // Some node occurs at two places of the tree.
+
+    explicit Analysis(PTR(Expr) root) {
+        FreeVars scope;
+        visit(root, nullptr, 0, scope);
+    }
+
+    const NodeInfo &at(Expr *e) const { return info.at(e); }
+
+private:
+    void visit(PTR(Expr) e, Expr *parent, size_t depth, FreeVars &scope) {
+        if (shared || info.count(RAW(e))) {
+            shared = true;
+            return;
+        }
+        NodeInfo &self = info[RAW(e)];
+        self.node = e;
+        self.parent = parent;
+        self.depth = depth;
+        preorder.push_back(RAW(e));
+
+        size_t scope_size = scope.size();
+        std::vector<PTR(Expr)> kids = children(e);
+        if (PTR(VarExpr) v = CAST(VarExpr)(e)) {
+            for (auto it = scope.rbegin(); it != scope.rend(); ++it) {
+                if (it->first == v->name) {
+                    self.binder = it->second;
+                    break;
+                }
+            }
+        } else if (PTR(LetExpr) let = CAST(LetExpr)(e)) {
+            visit(let->rhs, RAW(e), depth + 1, scope);
+            scope.emplace_back(let->var, RAW(e));
+            kids.erase(kids.begin());
+        } else if (PTR(LetRecExpr) rec = CAST(LetRecExpr)(e)) {
+            scope.emplace_back(rec->var, RAW(e));
+        } else if (PTR(FunExpr) f = CAST(FunExpr)(e)) {
+            for (Symbol param : f->params) scope.emplace_back(param, RAW(e));
+        }
+        for (PTR(Expr) kid : kids) visit(kid, RAW(e), depth + 1, scope);
+        scope.resize(scope_size);
+        if (shared) return;
+
+        // info may have rehashed while visiting the children.
+        NodeInfo &done = info[RAW(e)];
+        done.hash = node_hash(e);
+        done.ops = is_operation(e) ? 1 : 0;
+        if (PTR(VarExpr) v = CAST(VarExpr)(e)) done.free.emplace_back(v->name, done.binder);
+        for (PTR(Expr) kid : children(e)) {
+            const NodeInfo &k = info[RAW(kid)];
+            done.hash = mix(done.hash, k.hash);
+            done.ops += k.ops;
+            for (const auto &var : k.free) {
+                if (var.second != RAW(e)) done.free.push_back(var);
+            }
+        }
+        std::sort(done.free.begin(), done.free.end(), [](const std::pair<Symbol, Expr*> &a, const std::pair<Symbol, Expr*> &b) {
+            return a.first < b.first || (a.first == b.first && a.second < b.second);
+        });
+        done.free.erase(std::unique(done.free.begin(), done.free.end()), done.free.end());
+    }
+};
+
+typedef enum {
+    walk_done,      // Evaluated completely without anything that can fail.
+    walk_found,     // Reached a target first.
+    walk_blocked    // Something that can fail, loop or not run comes first.
+} walk_t;
+
+// True if e is a _fun, or a variable bound to one by a _let or _letrec;
+// calling it cannot fail before its arguments are evaluated.
+bool is_known_fun(PTR(Expr) e, const Analysis &analysis) {
+    if (CAST(FunExpr)(e)) return true;
+    if (!CAST(VarExpr)(e)) return false;
+    Expr *binder = analysis.at(RAW(e)).binder;
+    if (dynamic_cast<LetRecExpr*>(binder)) return true;
+    LetExpr *let = dynamic_cast<LetExpr*>(binder);
+    return let && CAST(FunExpr)(let->rhs);
+}
+
+// Walks e in evaluation order up to the first step that may fail, loop or
+// be skipped, and reports whether a target is evaluated before it.
+walk_t first_evaluated(PTR(Expr) e, const std::unordered_set<Expr*> &targets, const Analysis &analysis, Expr *&found) {
+    if (targets.count(RAW(e))) {
+        found = RAW(e);
+        return walk_found;
+    }
+    if (CAST(NumExpr)(e) || CAST(BoolExpr)(e) || CAST(FunExpr)(e)) return walk_done;
+    if (CAST(VarExpr)(e)) return analysis.at(RAW(e)).binder ? walk_done : walk_blocked;
+
+    std::vector<PTR(Expr)> kids;
+    if (PTR(IfExpr) i = CAST(IfExpr)(e)) {
+        kids = {i->condition};
+    } else if (PTR(LetRecExpr) rec = CAST(LetRecExpr)(e)) {
+        kids = {rec->body};
+    } else if (PTR(CallExpr) call = CAST(CallExpr)(e)) {
+        // A callee that is not a function fails before any argument runs.
+        walk_t w = first_evaluated(call->func, targets, analysis, found);
+        if (w != walk_done) return w;
+        if (!is_known_fun(call->func, analysis)) return walk_blocked;
+        kids = call->args;
+    } else {
+        kids = children(e);
+    }
+    for (PTR(Expr) kid : kids) {
+        walk_t w = first_evaluated(kid, targets, analysis, found);
+        if (w != walk_done) return w;
+    }
+    // Comparing and binding cannot fail; arithmetic, tests and calls can.
+    return CAST(EqualExpr)(e) || CAST(LetExpr)(e) || CAST(LetRecExpr)(e) ? walk_done : walk_blocked;
+}
+
+Expr *common_ancestor(const Analysis &analysis, Expr *a, Expr *b) {
+    while (analysis.at(a).depth > analysis.at(b).depth) a = analysis.at(a).parent;
+    while (analysis.at(b).depth > analysis.at(a).depth) b = analysis.at(b).parent;
+    while (a != b) {
+        a = analysis.at(a).parent;
+        b = analysis.at(b).parent;
+    }
+    return a;
+}
+
+struct Hoist {
+    Expr *at;                 // Subtree wrapped in the new _let.
+    PTR(Expr) value;          // First occurrence, which becomes the right-hand side.
+    std::vector<Expr*> occurrences;
+};
+
+// Finds the repeated subexpression that saves the most work and can be
+// hoisted without changing what the tree evaluates first.
+bool find_hoist(const Analysis &analysis, Hoist &hoist) {
+    std::unordered_map<uint64_t, std::vector<std::vector<Expr*>>> buckets;
+    for (Expr *e : analysis.preorder) {
+        const NodeInfo &node = analysis.at(e);
+        if (!is_candidate(node.node)) continue;
+        std::vector<std::vector<Expr*>> &bucket = buckets[node.hash];
+        bool placed = false;
+        for (std::vector<Expr*> &group : bucket) {
+            const NodeInfo &first = analysis.at(group[0]);
+            if (first.free == node.free && first.node->equals(node.node)) {
+                group.push_back(e);
+                placed = true;
+                break;
+            }
+        }
+        if (!placed) bucket.push_back({e});
+    }
+
+    std::vector<const std::vector<Expr*>*> groups;
+    for (const auto &bucket : buckets) {
+        for (const std::vector<Expr*> &group : bucket.second) {
+            if ((group.size() - 1) * analysis.at(group[0]).ops >= MIN_SAVED_OPS) groups.push_back(&group);
+        }
+    }
+    std::sort(groups.begin(), groups.end(), [&analysis](const std::vector<Expr*> *a, const std::vector<Expr*> *b) {
+        size_t saved_a = (a->size() - 1) * analysis.at((*a)[0]).ops;
+        size_t saved_b = (b->size() - 1) * analysis.at((*b)[0]).ops;
+        if (saved_a != saved_b) return saved_a > saved_b;
+        return analysis.at((*a)[0]).depth < analysis.at((*b)[0]).depth;
+    });
+
+    for (const std::vector<Expr*> *group : groups) {
+        Expr *at = (*group)[0];
+        for (Expr *e : *group) at = common_ancestor(analysis, at, e);
+
+        // The new variable can only see bindings made above the wrapped subtree.
+        bool in_scope = true;
+        for (const auto &var : analysis.at((*group)[0]).free) {
+            if (var.second == at) in_scope = false;
+        }
+        if (!in_scope) continue;
+
+        std::unordered_set<Expr*> targets(group->begin(), group->end());
+        Expr *found = nullptr;
+        if (first_evaluated(analysis.at(at).node, targets, analysis, found) != walk_found) continue;
+
+        hoist.at = at;
+        hoist.value = analysis.at(found).node;
+        hoist.occurrences = *group;
+        return true;
+    }
+    return false;
+}
+
+class Rewriter {
+public:
+    Rewriter(const Hoist &hoist, Symbol name) : hoist(hoist), name(name) {
+        for (Expr *e : hoist.occurrences) occurrences.insert(e);
+    }
+
+    PTR(Expr) rebuild(PTR(Expr) e) {
+        PTR(Expr) result = e;
+        if (occurrences.count(RAW(e))) {
+            result = NEW(VarExpr)(name);
+            result->span = e->span;
+        } else {
+            std::vector<PTR(Expr)> kids = children(e);
+            bool changed = false;
+            for (PTR(Expr) &kid : kids) {
+                PTR(Expr) rebuilt = rebuild(kid);
+                changed = changed || rebuilt != kid;
+                kid = rebuilt;
+            }
+            if (changed) result = with_children(e, kids);
+        }
+        if (RAW(e) != hoist.at) return result;
+
+        PTR(Expr) let = NEW(LetExpr)(name, hoist.value, result);
+        let->span = e->span;
+        return let;
+    }
+
+private:
+    const Hoist &hoist;
+    Symbol name;
+    std::unordered_set<Expr*> occurrences;
+};
+
+size_t count_nodes(PTR(Expr) e) {
+    size_t count = 0;
+    visit_nodes(e, [&count](PTR(Expr)) { count++; });
+    return count;
+}
+
+// Every name the tree binds or refers to; fresh names must avoid them all.
+std::unordered_set<Symbol> used_names(PTR(Expr) e) {
+    std::unordered_set<Symbol> names;
+    visit_nodes(e, [&names](PTR(Expr) node) {
+        if (PTR(VarExpr) v = CAST(VarExpr)(node)) names.insert(v->name);
+        else if (PTR(LetExpr) let = CAST(LetExpr)(node)) names.insert(let->var);
+        else if (PTR(LetRecExpr) rec = CAST(LetRecExpr)(node)) names.insert(rec->var);
+        else if (PTR(FunExpr) f = CAST(FunExpr)(node)) names.insert(f->params.begin(), f->params.end());
+    });
+    return names;
+}
+
+} // namespace
+
+uint64_t structural_hash(PTR(Expr) e) {
+    uint64_t h = node_hash(e);
+    for (PTR(Expr) kid : children(e)) h = mix(h, structural_hash(kid));
+    return h;
+}
+
+CseResult eliminate_common_subexpressions(PTR(Expr) e) {
+    CseResult result;
+    result.expr = e;
+    result.nodes_before = count_nodes(e);
+
+    std::unordered_set<Symbol> names = used_names(e);
+    size_t next_name = 1;
+    while (true) {
+        Analysis analysis(result.expr);
+        Hoist hoist;
+        if (analysis.shared || !find_hoist(analysis, hoist)) break;
+
+        Symbol name;
+        do {
+            name = Symbol("cse" + std::to_string(next_name++));
+        } while (names.count(name));
+        names.insert(name);
+
+        Rewriter rewriter(hoist, name);
+        result.expr = rewriter.rebuild(result.expr);
+        result.bindings++;
+    }
+    result.nodes_after = count_nodes(result.expr);
+    return result;
+}
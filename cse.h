@@ -0,0 +1,43 @@
+#ifndef CSE_H
+#define CSE_H
+
+#include "expr.h"
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @file cse.h
+ * @brief Common subexpression elimination.
+ *
+ * Repeated subtrees that are structurally identical and whose free
+ * variables refer to the same bindings are computed once: the smallest
+ * subtree containing all occurrences is wrapped in a _let of a fresh
+ * variable, and every occurrence is replaced by that variable. A
+ * repetition is only hoisted when its first occurrence is the first thing
+ * the wrapped subtree evaluates that can fail or loop, so the result, the
+ * error and the order in which errors surface are unchanged; an occurrence
+ * that runs only under an _if or inside a _fun body is never evaluated
+ * earlier than before. Run this before specialize_types(): rebuilt nodes
+ * are of the generic kinds.
+ */
+
+struct CseResult {
+    PTR(Expr) expr;           ///< The rewritten tree, or the input if nothing was shared.
+    size_t nodes_before = 0;
+    size_t nodes_after = 0;
+    size_t bindings = 0;      ///< _let bindings introduced.
+};
+
+/**
+ * @brief Hash of a tree's structure, consistent with Expr::equals.
+ */
+uint64_t structural_hash(PTR(Expr) e);
+
+/**
+ * @brief Hoists repeated subexpressions into _let bindings.
+ * @param e The expression; it is not modified, unchanged subtrees are shared.
+ * @return The rewritten expression and node counts before and after.
+ */
+CseResult eliminate_common_subexpressions(PTR(Expr) e);
+
+#endif // CSE_H
@@ -0,0 +1,109 @@
+#include "engine.h"
+#include "cse.h"
+#include "parse.h"
+#include "serialize.h"
+#include "expr.h"
+#include "env.h"
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_set>
+
+namespace {
+
+// Appends the free variables of the tree rooted at n that are not bound
+// in scope, each once.
+void collect_free(const AstPool &pool, NodeId n, std::vector<Symbol> &scope,
+                  std::unordered_set<Symbol> &seen, std::vector<Symbol> &free) {
+    switch (pool.kinds[n]) {
+        case pool_num:
+        case pool_bool:
+            return;
+        case pool_var: {
+            Symbol name = pool.symbols[pool.a[n]];
+            if (std::find(scope.begin(), scope.end(), name) == scope.end() && seen.insert(name).second) {
+                free.push_back(name);
+            }
+            return;
+        }
+        case pool_add:
+        case pool_mult:
+        case pool_equal:
+            collect_free(pool, pool.a[n], scope, seen, free);
+            collect_free(pool, pool.b[n], scope, seen, free);
+            return;
+        case pool_if:
+            collect_free(pool, pool.a[n], scope, seen, free);
+            collect_free(pool, pool.b[n], scope, seen, free);
+            collect_free(pool, pool.c[n], scope, seen, free);
+            return;
+        case pool_let:
+            collect_free(pool, pool.b[n], scope, seen, free);
+            scope.push_back(pool.symbols[pool.a[n]]);
+            collect_free(pool, pool.c[n], scope, seen, free);
+            scope.pop_back();
+            return;
+        case pool_letrec:
+            scope.push_back(pool.symbols[pool.a[n]]);
+            collect_free(pool, pool.b[n], scope, seen, free);
+            collect_free(pool, pool.c[n], scope, seen, free);
+            scope.pop_back();
+            return;
+        case pool_fun:
+            for (uint32_t i = 0; i < pool.b[n]; i++) scope.push_back(pool.symbols[pool.a[n] + i]);
+            collect_free(pool, pool.c[n], scope, seen, free);
+            scope.resize(scope.size() - pool.b[n]);
+            return;
+        case pool_call:
+            collect_free(pool, pool.a[n], scope, seen, free);
+            for (uint32_t i = 0; i < pool.c[n]; i++) collect_free(pool, pool.args[pool.b[n] + i], scope, seen, free);
+            return;
+    }
+}
+
+} // namespace
+
+Engine::Engine() : natives(NativeRegistry::with_builtins()) {}
+
+Program Engine::compile(const std::string &source) const {
+    std::shared_ptr<Program::Data> data = std::make_shared<Program::Data>();
+    data->source = source;
+    PTR(Expr) e = parse_cache_dir.empty() ? parse_str(source) : parse_str_cached(source, parse_cache_dir);
+    if (share_subexpressions) e = eliminate_common_subexpressions(e).expr;
+    std::shared_ptr<AstPool> pool = std::make_shared<AstPool>();
+    data->root = pool->add(e);
+    data->pool = pool;
+
+    std::vector<Symbol> scope;
+    std::unordered_set<Symbol> seen;
+    std::vector<Symbol> free;
+    collect_free(*data->pool, data->root, scope, seen, free);
+    for (Symbol name : free) {
+        if (!natives.defines(name)) data->free.push_back(name);
+    }
+    return Program(data);
+}
+
+Context::Context(const Engine &engine)
+    : owner(std::this_thread::get_id()),
+      globals(engine.natives.private_environment(NEW(EmptyEnv)())) {}
+
+PTR(Val) Context::eval(const Program &program, const Bindings &bindings) {
+    EvalStatus status;
+    PTR(Val) v = eval(program, bindings, status);
+    if (!v) status.raise();
+    return v;
+}
+
+PTR(Val) Context::eval(const Program &program, const Bindings &bindings, EvalStatus &status) {
+    if (std::this_thread::get_id() != owner) throw std::logic_error("Context used from another thread");
+
+    PTR(Env) env = globals;
+    for (const auto &binding : bindings) env = NEW(ExtendedEnv)(binding.first, binding.second, env);
+
+    context.limits = limits;
+    context.reset();
+    EvalContext::Scope scope(context);
+    Profiler::Scope sampling(profiler ? profiler : Profiler::current());
+    if (pinned.get() != program.data->pool.get()) pinned = program.data->pool->pin();
+    return pinned->eval(program.data->root, env, status, pinned);
+}
@@ -0,0 +1,157 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "ast_pool.h"
+#include "eval_context.h"
+#include "eval_status.h"
+#include "native.h"
+#include "profiler.h"
+#include "symbol.h"
+#include "val.h"
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * @file engine.h
+ * @brief Embedding API for hosts that run scripts on many threads.
+ *
+ * An Engine holds the native functions scripts may call and compiles
+ * scripts into Programs. A Program is parsed and prepared once and is
+ * immutable. It stores its tree in an AstPool, and evaluating a pool writes
+ * nothing to it but the profile label of each function, once, so any
+ * number of threads can run one Program at the same time.
+ *
+ * Each thread evaluates through its own Context. A Context owns copies of
+ * the natives and its own empty environment, so its evaluations share no
+ * reference counts with other threads; the Program is only read.
+ *
+ *     Engine engine;
+ *     Program p = engine.compile("x * x + y");
+ *     // on each worker thread:
+ *     Context ctx(engine);
+ *     ctx.eval(p, {{"x", NEW(NumVal)(3)}, {"y", NEW(NumVal)(4)}});  // 13
+ */
+
+class Engine;
+class Context;
+
+/**
+ * @brief A compiled script; copies share the same immutable tree.
+ */
+class Program {
+public:
+    /** @brief The text the program was compiled from. */
+    const std::string &source() const { return data->source; }
+
+    /**
+     * @brief Names the script uses without binding them and that are not
+     * natives of the engine, in order of first use.
+     *
+     * These are the bindings Context::eval must be given.
+     */
+    const std::vector<Symbol> &free_variables() const { return data->free; }
+
+    /** @brief Prints the program like Expr::to_string. */
+    std::string to_string() const { return data->pool->to_string(data->root); }
+
+    /** @brief The tree, rooted at root(); read-only and safe to share. */
+    const AstPool &pool() const { return *data->pool; }
+    NodeId root() const { return data->root; }
+
+private:
+    friend class Engine;
+    friend class Context;
+
+    struct Data {
+        std::string source;
+        // Owned on its own so that closures can keep it alive.
+        std::shared_ptr<const AstPool> pool;
+        NodeId root = 0;
+        std::vector<Symbol> free;
+    };
+
+    explicit Program(std::shared_ptr<const Data> data) : data(std::move(data)) {}
+
+    std::shared_ptr<const Data> data;
+};
+
+class Engine {
+public:
+    /** @brief An engine whose scripts can call the built-in natives. */
+    Engine();
+
+    /**
+     * @brief Natives available to scripts; define them before creating
+     * contexts, which copy them.
+     */
+    NativeRegistry natives;
+
+    /**
+     * @brief If set, compile() parses through parse_str_cached (serialize.h)
+     * and keeps the images in this directory, so a host that restarts with
+     * the same scripts loads them instead of parsing them again.
+     */
+    std::string parse_cache_dir;
+
+    /** @brief If set, compile() computes repeated subexpressions once (cse.h). */
+    bool share_subexpressions = false;
+
+    /**
+     * @brief Parses and prepares a script.
+     * @param source The script text.
+     * @throws std::runtime_error If the script does not parse.
+     */
+    Program compile(const std::string &source) const;
+};
+
+/**
+ * @brief Evaluates programs on the thread that created it.
+ *
+ * Values returned by eval belong to this thread. Function values keep the
+ * tree of their Program alive, and so does the Context until it evaluates
+ * another Program.
+ */
+class Context {
+public:
+    typedef std::vector<std::pair<Symbol, PTR(Val)>> Bindings;
+
+    explicit Context(const Engine &engine);
+    Context(const Context&) = delete;
+    Context& operator=(const Context&) = delete;
+
+    /** @brief Limits applied to each evaluation; none by default. */
+    EvalLimits limits;
+
+    /** @brief Bound to the thread during each evaluation, if set; otherwise the thread's own is used. */
+    Profiler *profiler = nullptr;
+
+    /**
+     * @brief Evaluates a program with the given bindings for its free variables.
+     * @throws EvalError If evaluation fails.
+     * @throws EvalCancelled, EvalLimitExceeded As Expr::interp under an EvalContext.
+     * @throws std::logic_error If called from a thread other than the creator.
+     */
+    PTR(Val) eval(const Program &program, const Bindings &bindings = Bindings());
+
+    /** @brief Like eval, but reports script errors in status and returns nullptr. */
+    PTR(Val) eval(const Program &program, const Bindings &bindings, EvalStatus &status);
+
+    /** @brief Cancels the running evaluation; safe to call from any thread. */
+    void cancel() { context.cancel(); }
+
+    /** @brief Reductions made by the last or running evaluation; safe to read from any thread. */
+    uint64_t steps() const { return context.steps(); }
+
+private:
+    std::thread::id owner;
+    PTR(Env) globals;
+    EvalContext context;
+    // The pool of the last program evaluated, pinned so that the closures
+    // of this thread count their references apart from other threads.
+    std::shared_ptr<const AstPool> pinned;
+};
+
+#endif // ENGINE_H
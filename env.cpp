@@ -1,20 +1,66 @@
 #include "env.h"
 #include "val.h"
+#include "expr.h"
+#include "eval_context.h"
 
 PTR(Env) Env::empty = NEW(EmptyEnv)();
 
+PTR(Val) Env::lookup(Symbol find_name) {
+    PTR(Val) v = find(find_name);
+    if (!v) {
+        EvalStatus status;
+        status.fail_free_variable(find_name);
+        status.raise();
+    }
+    return v;
+}
+
 EmptyEnv::EmptyEnv() {}
-PTR(Val) EmptyEnv::lookup(std::string find_name) {
-    throw std::runtime_error("Free variable: " + find_name);
+PTR(Val) EmptyEnv::find(Symbol) {
+    return nullptr;
 }
 
-ExtendedEnv::ExtendedEnv(std::string var, PTR(Val) val, PTR(Env) rest)
+ExtendedEnv::ExtendedEnv(Symbol var, PTR(Val) val, PTR(Env) rest)
     : var(var), val(val), rest(rest) {}
 
-PTR(Val) ExtendedEnv::lookup(std::string find_name) {
+PTR(Val) ExtendedEnv::find(Symbol find_name) {
     if (find_name == var) {
         return val;
     } else {
-        return rest->lookup(find_name);
+        return rest->find(find_name);
+    }
+}
+
+FrameEnv::FrameEnv(PTR(FunExpr) fun, std::vector<PTR(Val)> vals, PTR(Env) rest)
+    : fun(fun), vals(std::move(vals)), rest(rest) {}
+
+PTR(Val) FrameEnv::find(Symbol find_name) {
+    // Searched from the end so a repeated parameter name binds its last argument.
+    for (size_t i = vals.size(); i-- > 0;) {
+        if (fun->params[i] == find_name) return vals[i];
+    }
+    return rest->find(find_name);
+}
+
+GlobalEnv::GlobalEnv(std::unordered_map<Symbol, PTR(Val)> bindings, PTR(Env) rest)
+    : bindings(std::move(bindings)), rest(rest) {}
+
+PTR(Val) GlobalEnv::find(Symbol find_name) {
+    auto it = bindings.find(find_name);
+    if (it != bindings.end()) return it->second;
+    return rest->find(find_name);
+}
+
+RecEnv::RecEnv(Symbol var, PTR(FunExpr) fun, PTR(Env) rest)
+    : var(var), fun(fun), closure(), rest(rest) {}
+
+PTR(Val) RecEnv::find(Symbol find_name) {
+    if (find_name != var) return rest->find(find_name);
+    PTR(Val) self = LOCK(closure);
+    if (!self) {
+        eval_allocated(sizeof(FunVal));
+        self = NEW(FunVal)(fun, THIS);
+        closure = self;
     }
+    return self;
 }
@@ -6,30 +6,76 @@
 #define ENV_H
 #include "val.h"
 #include "expr.h"
+#include "symbol.h"
+#include <unordered_map>
+#include <vector>
 
 class Val;
+class FunExpr;
 
 CLASS(Env) {
 public:
     static PTR(Env) empty;
     virtual ~Env() = default;
-    virtual PTR(Val) lookup(std::string find_name) = 0;
+    // The bound value, or nullptr if the name is free.
+    virtual PTR(Val) find(Symbol find_name) = 0;
+    // Like find, but throws for a free variable.
+    PTR(Val) lookup(Symbol find_name);
 };
 
 class EmptyEnv : public Env {
 public:
     EmptyEnv();
-    PTR(Val) lookup(std::string find_name) override;
+    PTR(Val) find(Symbol find_name) override;
 };
 
 class ExtendedEnv : public Env {
 public:
-    std::string var;
+    Symbol var;
     PTR(Val) val;
     PTR(Env) rest;
 
-    ExtendedEnv(std::string var, PTR(Val) val, PTR(Env) rest);
-    PTR(Val) lookup(std::string find_name) override;
+    ExtendedEnv(Symbol var, PTR(Val) val, PTR(Env) rest);
+    PTR(Val) find(Symbol find_name) override;
+};
+
+// Binds all parameters of a multi-parameter call in one frame. The names
+// are the FunExpr's, which the frame keeps alive.
+class FrameEnv : public Env {
+public:
+    PTR(FunExpr) fun;
+    std::vector<PTR(Val)> vals;
+    PTR(Env) rest;
+
+    FrameEnv(PTR(FunExpr) fun, std::vector<PTR(Val)> vals, PTR(Env) rest);
+    PTR(Val) find(Symbol find_name) override;
+};
+
+// Bottom frame holding the bindings a host provides, such as native
+// functions; a hash lookup instead of one frame per binding.
+class GlobalEnv : public Env {
+public:
+    std::unordered_map<Symbol, PTR(Val)> bindings;
+    PTR(Env) rest;
+
+    GlobalEnv(std::unordered_map<Symbol, PTR(Val)> bindings, PTR(Env) rest);
+    PTR(Val) find(Symbol find_name) override;
+};
+
+// Frame of a _letrec. The closure it binds has this frame as its
+// environment, so holding the closure strongly here would form a cycle
+// that reference counting never frees. The frame keeps the _fun instead and
+// caches the closure weakly: while any caller holds it, every lookup
+// returns the same FunVal, and once none does both can be reclaimed.
+class RecEnv : public Env {
+public:
+    Symbol var;
+    PTR(FunExpr) fun;
+    WEAK(Val) closure;
+    PTR(Env) rest;
+
+    RecEnv(Symbol var, PTR(FunExpr) fun, PTR(Env) rest);
+    PTR(Val) find(Symbol find_name) override;
 };
 
 #endif //ENV_H
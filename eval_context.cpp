@@ -0,0 +1,51 @@
+#include "eval_context.h"
+
+// The clock is read only every this many steps to keep step() cheap.
+static const uint64_t TIME_CHECK_INTERVAL = 1024;
+
+thread_local EvalContext *EvalContext::bound = nullptr;
+
+EvalContext::Scope::Scope(EvalContext &ctx) : saved(bound) {
+    bound = &ctx;
+}
+
+EvalContext::Scope::~Scope() {
+    bound = saved;
+}
+
+void EvalContext::reset() {
+    cancelled.store(false, std::memory_order_relaxed);
+    step_count.store(0, std::memory_order_relaxed);
+    byte_count = 0;
+    depth = 0;
+    next_check = 0;
+    started = std::chrono::steady_clock::now();
+}
+
+// Slow path of step(): runs on cancellation and whenever the step count
+// reaches next_check, then schedules the next check.
+void EvalContext::check(uint64_t n) {
+    if (cancelled.load(std::memory_order_relaxed)) throw EvalCancelled();
+    if (limits.max_steps != 0 && n > limits.max_steps) exceeded(EvalLimitExceeded::limit_steps);
+    if (limits.max_millis != 0) {
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+        if (static_cast<uint64_t>(ms.count()) > limits.max_millis) exceeded(EvalLimitExceeded::limit_time);
+    }
+
+    next_check = n + TIME_CHECK_INTERVAL;
+    if (limits.max_steps != 0 && limits.max_steps + 1 < next_check) next_check = limits.max_steps + 1;
+}
+
+void EvalContext::exceeded(EvalLimitExceeded::limit_t limit) {
+    switch (limit) {
+        case EvalLimitExceeded::limit_steps:
+            throw EvalLimitExceeded(limit, "Step limit exceeded (" + std::to_string(limits.max_steps) + " steps)");
+        case EvalLimitExceeded::limit_memory:
+            throw EvalLimitExceeded(limit, "Memory limit exceeded (" + std::to_string(limits.max_bytes) + " bytes)");
+        case EvalLimitExceeded::limit_time:
+            throw EvalLimitExceeded(limit, "Time limit exceeded (" + std::to_string(limits.max_millis) + " ms)");
+        case EvalLimitExceeded::limit_depth:
+            throw EvalLimitExceeded(limit, "Call depth limit exceeded (" + std::to_string(limits.max_depth) + " calls)");
+    }
+    throw EvalLimitExceeded(limit, "Evaluation limit exceeded");
+}
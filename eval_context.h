@@ -0,0 +1,172 @@
+#ifndef EVAL_CONTEXT_H
+#define EVAL_CONTEXT_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+/**
+ * @file eval_context.h
+ * @brief Per-evaluation state that the interpreter checks while it runs.
+ *
+ * A context is bound to the evaluating thread with EvalContext::Scope for
+ * the duration of an interp call, so the Expr::interp signature stays the
+ * same. Reductions (function calls and _let bindings) report to the bound
+ * context, which enforces cancellation and the configured limits; without
+ * a context each check is a single thread-local load.
+ */
+
+/**
+ * @brief Thrown when an evaluation is cancelled from another thread.
+ */
+class EvalCancelled : public std::runtime_error {
+public:
+    EvalCancelled() : std::runtime_error("Evaluation cancelled") {}
+};
+
+/**
+ * @brief Thrown when an evaluation runs past one of its EvalLimits.
+ */
+class EvalLimitExceeded : public std::runtime_error {
+public:
+    typedef enum {
+        limit_steps,
+        limit_memory,
+        limit_time,
+        limit_depth
+    } limit_t;
+
+    limit_t limit;
+
+    EvalLimitExceeded(limit_t limit, const std::string &message)
+        : std::runtime_error(message), limit(limit) {}
+};
+
+/**
+ * @brief Resource limits for one evaluation; 0 means unlimited.
+ */
+struct EvalLimits {
+    uint64_t max_steps = 0;   ///< Function calls plus _let bindings.
+    uint64_t max_bytes = 0;   ///< Bytes allocated for environments and closures.
+    uint64_t max_millis = 0;  ///< Wall-clock time since reset().
+    uint32_t max_depth = 0;   ///< Nested function calls.
+};
+
+class EvalContext {
+public:
+    /**
+     * @brief Binds a context to the current thread until the scope ends.
+     */
+    class Scope {
+    public:
+        explicit Scope(EvalContext &ctx);
+        ~Scope();
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    private:
+        EvalContext *saved;
+    };
+
+    EvalLimits limits;
+
+    EvalContext() { reset(); }
+
+    /** @brief The context bound to the calling thread, or nullptr. */
+    static EvalContext *current() { return bound; }
+
+    /** @brief Requests cancellation; safe to call from any thread. */
+    void cancel() { cancelled.store(true, std::memory_order_relaxed); }
+
+    /** @brief Clears cancellation and counters and restarts the clock before a new run. */
+    void reset();
+
+    /** @brief Reductions made so far; safe to read from any thread. */
+    uint64_t steps() const { return step_count.load(std::memory_order_relaxed); }
+
+    /** @brief Bytes charged so far for environments and closures. */
+    uint64_t bytes() const { return byte_count; }
+
+    /**
+     * @brief Accounts for one reduction.
+     * @throws EvalCancelled If cancel() was called.
+     * @throws EvalLimitExceeded If the step or time limit is exceeded.
+     */
+    void step() {
+        // Only the evaluating thread writes the counter, so a plain
+        // load/store pair is enough for readers to see progress.
+        uint64_t n = step_count.load(std::memory_order_relaxed) + 1;
+        step_count.store(n, std::memory_order_relaxed);
+        if (n >= next_check || cancelled.load(std::memory_order_relaxed)) check(n);
+    }
+
+    /**
+     * @brief Charges an allocation against the memory limit.
+     * @throws EvalLimitExceeded If the memory limit is exceeded.
+     */
+    void allocated(size_t size) {
+        byte_count += size;
+        if (limits.max_bytes != 0 && byte_count > limits.max_bytes) exceeded(EvalLimitExceeded::limit_memory);
+    }
+
+    /**
+     * @brief Enters a nested function call.
+     * @throws EvalLimitExceeded If the depth limit is exceeded.
+     */
+    void enter_call() {
+        if (++depth > limits.max_depth && limits.max_depth != 0) {
+            depth--;
+            exceeded(EvalLimitExceeded::limit_depth);
+        }
+    }
+
+    void leave_call() { depth--; }
+
+private:
+    static thread_local EvalContext *bound;
+
+    void check(uint64_t n);
+    [[noreturn]] void exceeded(EvalLimitExceeded::limit_t limit);
+
+    std::atomic<bool> cancelled{false};
+    std::atomic<uint64_t> step_count{0};
+    uint64_t byte_count = 0;
+    uint32_t depth = 0;
+    uint64_t next_check = 0;
+    std::chrono::steady_clock::time_point started;
+};
+
+/**
+ * @brief Reports one reduction to the thread's context, if any.
+ */
+inline void eval_step() {
+    if (EvalContext *ctx = EvalContext::current()) ctx->step();
+}
+
+/**
+ * @brief Charges an allocation to the thread's context, if any.
+ */
+inline void eval_allocated(size_t size) {
+    if (EvalContext *ctx = EvalContext::current()) ctx->allocated(size);
+}
+
+/**
+ * @brief Tracks call depth in the thread's context, if any, for one call.
+ */
+class EvalCallGuard {
+public:
+    EvalCallGuard() : ctx(EvalContext::current()) {
+        if (ctx) ctx->enter_call();
+    }
+    ~EvalCallGuard() {
+        if (ctx) ctx->leave_call();
+    }
+    EvalCallGuard(const EvalCallGuard&) = delete;
+    EvalCallGuard& operator=(const EvalCallGuard&) = delete;
+private:
+    EvalContext *ctx;
+};
+
+#endif // EVAL_CONTEXT_H
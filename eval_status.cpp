@@ -0,0 +1,65 @@
+#include "eval_status.h"
+
+void EvalStatus::reset(eval_error_t error) {
+    code = error;
+    span = SourceSpan();
+    located = false;
+    detail = nullptr;
+    name = Symbol();
+    expected = 0;
+    got = 0;
+    text.clear();
+}
+
+void EvalStatus::fail(eval_error_t error, const char *message) {
+    reset(error);
+    detail = message;
+}
+
+void EvalStatus::fail_free_variable(Symbol var) {
+    reset(eval_free_variable);
+    name = var;
+}
+
+void EvalStatus::fail_arity(size_t expected_count, size_t got_count) {
+    reset(eval_arity_mismatch);
+    expected = expected_count;
+    got = got_count;
+}
+
+void EvalStatus::fail_native_argument(Symbol native, size_t index, const char *kind) {
+    reset(eval_type_error);
+    name = native;
+    expected = index;
+    detail = kind;
+}
+
+void EvalStatus::fail_native(std::string message) {
+    reset(eval_native_error);
+    text = std::move(message);
+}
+
+std::string EvalStatus::message() const {
+    switch (code) {
+        case eval_ok:
+            return std::string();
+        case eval_free_variable:
+            return "Free variable: " + name.name();
+        case eval_arity_mismatch:
+            return "Arity mismatch: expected " + std::to_string(expected) +
+                   (expected == 1 ? " argument, got " : " arguments, got ") + std::to_string(got);
+        case eval_native_error:
+            return text;
+        case eval_type_error:
+            if (name != Symbol()) {
+                return name.name() + ": argument " + std::to_string(expected) + " must be " + detail;
+            }
+            return detail;
+        default:
+            return detail;
+    }
+}
+
+void EvalStatus::raise() const {
+    throw EvalError(code, span, message());
+}
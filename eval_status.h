@@ -0,0 +1,97 @@
+#ifndef EVAL_STATUS_H
+#define EVAL_STATUS_H
+
+#include "symbol.h"
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+/**
+ * @file eval_status.h
+ * @brief Errors reported by the non-throwing evaluation path.
+ *
+ * Expr::eval reports a script error (a type error, an overflow, a free
+ * variable, ...) by returning nullptr and filling in an EvalStatus, so
+ * callers that expect many failures do not pay for unwinding the stack.
+ * The status holds only a code, the source span of the failing node and
+ * the arguments of the message, which is formatted when asked for.
+ * Cancellation and EvalLimits still throw: they end the whole evaluation
+ * rather than produce a result.
+ */
+
+typedef enum {
+    eval_ok,
+    eval_type_error,      ///< An operand, condition or native argument had the wrong type.
+    eval_overflow,        ///< Integer addition or multiplication overflowed.
+    eval_free_variable,
+    eval_not_function,    ///< A call of a value that is not a function.
+    eval_arity_mismatch,
+    eval_native_error     ///< A native function failed.
+} eval_error_t;
+
+/**
+ * @brief Half-open range of character offsets in the parsed source.
+ *
+ * Nodes that did not come from the parser have an empty span.
+ */
+struct SourceSpan {
+    uint32_t begin = 0;
+    uint32_t end = 0;
+
+    bool empty() const { return end <= begin; }
+};
+
+class EvalStatus {
+public:
+    eval_error_t code = eval_ok;
+    SourceSpan span;  ///< Of the innermost node that failed.
+
+    bool ok() const { return code == eval_ok; }
+
+    /** @brief Records an error; detail must be a string literal. */
+    void fail(eval_error_t error, const char *detail);
+    void fail_free_variable(Symbol name);
+    void fail_arity(size_t expected, size_t got);
+    /** @brief A native argument of the wrong type; kind is "a number" or "a boolean". */
+    void fail_native_argument(Symbol native, size_t index, const char *kind);
+    void fail_native(std::string message);
+
+    /** @brief Attributes the error to a node, unless a node inside it already failed. */
+    void locate(SourceSpan node_span) {
+        if (!located) {
+            span = node_span;
+            located = true;
+        }
+    }
+
+    /** @brief The error message, formatted on each call; empty when ok(). */
+    std::string message() const;
+
+    /** @brief Throws the error as an EvalError. */
+    [[noreturn]] void raise() const;
+
+private:
+    bool located = false;
+    const char *detail = nullptr;
+    Symbol name;
+    size_t expected = 0;
+    size_t got = 0;
+    std::string text;
+
+    void reset(eval_error_t error);
+};
+
+/**
+ * @brief What Expr::interp throws for an error that Expr::eval reports.
+ */
+class EvalError : public std::runtime_error {
+public:
+    eval_error_t code;
+    SourceSpan span;
+
+    EvalError(eval_error_t code, SourceSpan span, const std::string &message)
+        : std::runtime_error(message), code(code), span(span) {}
+};
+
+#endif // EVAL_STATUS_H
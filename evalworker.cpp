@@ -0,0 +1,113 @@
+#include "evalworker.h"
+#include "expr.h"
+#include "val.h"
+#include "native.h"
+#include "profiler.h"
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#ifdef MSD_TRACK_ALLOCATIONS
+#include "alloc_tracking.h"
+#endif
+
+// Keeps runaway recursion from overflowing the worker's stack; see
+// WORKER_STACK_SIZE in mainwidget.cpp.
+static const uint32_t MAX_CALL_DEPTH = 100000;
+
+#ifdef MSD_TRACK_ALLOCATIONS
+// Types listed in the details of a run, largest first.
+static const size_t REPORTED_TYPES = 12;
+
+static QString formatBytes(uint64_t bytes) {
+    if (bytes < 1024) return QString("%1 B").arg(bytes);
+    if (bytes < 1024 * 1024) return QString("%1 KB").arg(bytes / 1024.0, 0, 'f', 1);
+    return QString("%1 MB").arg(bytes / (1024.0 * 1024.0), 0, 'f', 1);
+}
+#endif
+
+EvalWorker::EvalWorker(QObject *parent) : QObject(parent) {
+    context.limits.max_depth = MAX_CALL_DEPTH;
+    session.globals = NativeRegistry::with_builtins().environment();
+}
+
+void EvalWorker::cancel(quint64 id) {
+    quint64 prev = cancelledThrough.load();
+    while (prev < id && !cancelledThrough.compare_exchange_weak(prev, id)) {}
+    quint64 running = runningId.load();
+    if (running != 0 && running <= id) context.cancel();
+}
+
+quint64 EvalWorker::steps() const {
+    return context.steps();
+}
+
+void EvalWorker::evaluate(quint64 id, const QString &source, bool prettyPrint, bool profile) {
+    // Publish the id before clearing the flag and re-check afterwards, so a
+    // cancel() racing with the start of this request is never lost.
+    runningId.store(id);
+    context.reset();
+    if (id <= cancelledThrough.load()) {
+        runningId.store(0);
+        emit cancelled(id);
+        return;
+    }
+
+#ifdef MSD_TRACK_ALLOCATIONS
+    AllocationWatch watch;
+#endif
+    std::unique_ptr<Profiler> profiler;
+    if (profile && !prettyPrint) profiler.reset(new Profiler);
+    try {
+        std::string result;
+        if (prettyPrint) {
+            PTR(Expr) e = session.parse(source.toStdString());
+            std::stringstream ss;
+            std::streampos dummyIndent = 0;
+            e->pretty_print(ss, prec_none, dummyIndent);
+            result = ss.str();
+        } else {
+            EvalContext::Scope scope(context);
+            Profiler::Scope sampling(profiler.get());
+            result = session.interp(source.toStdString())->to_string();
+        }
+        runningId.store(0);
+        emit finished(id, QString::fromStdString(result));
+    } catch (EvalCancelled &) {
+        runningId.store(0);
+        emit cancelled(id);
+    } catch (EvalError &err) {
+        runningId.store(0);
+        std::string message = err.what();
+        if (!err.span.empty()) {
+            message += " (at " + std::to_string(err.span.begin) + "-" + std::to_string(err.span.end) + ")";
+        }
+        emit failed(id, QString::fromStdString(message));
+    } catch (std::exception &err) {
+        runningId.store(0);
+        emit failed(id, QString::fromUtf8(err.what()));
+    }
+    if (profiler) {
+        profiler->stop();
+        emit profiled(id, QString::fromStdString(profiler->collapsed()), profiler->samples());
+    }
+#ifdef MSD_TRACK_ALLOCATIONS
+    std::vector<AllocationStats> stats = watch.stats();
+    uint64_t allocations = 0;
+    QString details;
+    for (size_t i = 0; i < stats.size(); i++) {
+        allocations += stats[i].allocations;
+        if (i >= REPORTED_TYPES) continue;
+        details += QString("%1: %2 allocations, %3, %4 live\n")
+                   .arg(QString::fromStdString(stats[i].type))
+                   .arg(stats[i].allocations)
+                   .arg(formatBytes(stats[i].bytes))
+                   .arg(stats[i].live_objects);
+    }
+    emit allocationsMeasured(id, QString("peak %1, %2 allocations").arg(formatBytes(watch.peak_bytes())).arg(allocations),
+                             details.trimmed());
+#endif
+}
+
+void EvalWorker::reset() {
+    session.reset();
+}
@@ -0,0 +1,57 @@
+#ifndef EVALWORKER_H
+#define EVALWORKER_H
+
+#include <QObject>
+#include <QString>
+#include <atomic>
+#include "eval_context.h"
+#include "incremental.h"
+
+/**
+ * @brief Parses and evaluates scripts on a worker thread.
+ *
+ * Lives on its own QThread; evaluate() is invoked through a queued signal
+ * and outcomes come back through finished(), failed() or cancelled(). cancel() and
+ * steps() may be called from the UI thread while an evaluation runs.
+ */
+class EvalWorker : public QObject {
+    Q_OBJECT
+
+public:
+    explicit EvalWorker(QObject *parent = nullptr);
+
+    /** @brief Cancels the request with the given id and every earlier one. */
+    void cancel(quint64 id);
+
+    /** @brief Reductions made so far by the running evaluation. */
+    quint64 steps() const;
+
+public slots:
+    void evaluate(quint64 id, const QString &source, bool prettyPrint, bool profile);
+    void reset();
+
+signals:
+    void finished(quint64 id, const QString &result);
+    void failed(quint64 id, const QString &message);
+    void cancelled(quint64 id);
+    /**
+     * @brief Peak live bytes and allocations per type of a finished run.
+     *
+     * Emitted after the outcome, only in builds with MSD_TRACK_ALLOCATIONS.
+     */
+    void allocationsMeasured(quint64 id, const QString &summary, const QString &details);
+    /**
+     * @brief Collapsed stacks of a profiled run, for flamegraph tools.
+     *
+     * Emitted after the outcome, including for failed and cancelled runs.
+     */
+    void profiled(quint64 id, const QString &collapsed, quint64 samples);
+
+private:
+    IncrementalSession session;
+    EvalContext context;
+    std::atomic<quint64> runningId{0};
+    std::atomic<quint64> cancelledThrough{0};
+};
+
+#endif // EVALWORKER_H
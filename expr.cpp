@@ -1,19 +1,105 @@
 #include "val.h"
 #include "expr.h"
 #include "env.h"
+#include "eval_context.h"
+#include "profiler.h"
 #include <sstream>
 #include <string>
 #include <stdexcept>
 
+// ==================== Quickening ====================
+static void quicken(QuickState &quick, PTR(Expr) lhs, PTR(Expr) rhs) {
+    PTR(VarExpr) lhs_var = CAST(VarExpr)(lhs);
+    PTR(VarExpr) rhs_var = CAST(VarExpr)(rhs);
+    PTR(NumExpr) lhs_num = CAST(NumExpr)(lhs);
+    PTR(NumExpr) rhs_num = CAST(NumExpr)(rhs);
+
+    if (lhs_var && rhs_num) {
+        quick.kind = quick_var_const;
+        quick.lhs_var = RAW(lhs_var);
+        quick.constant = rhs_num->val;
+    } else if (lhs_num && rhs_var) {
+        quick.kind = quick_const_var;
+        quick.rhs_var = RAW(rhs_var);
+        quick.constant = lhs_num->val;
+    } else if (lhs_var && rhs_var) {
+        quick.kind = quick_var_var;
+        quick.lhs_var = RAW(lhs_var);
+        quick.rhs_var = RAW(rhs_var);
+    } else {
+        quick.kind = quick_generic;
+    }
+}
+
+static bool lookup_num(PTR(Env) env, VarExpr *var, int64_t &out) {
+    PTR(Val) v = env->find(var->name);
+    NumVal *num = dynamic_cast<NumVal*>(RAW(v));
+    if (!num) return false;
+    out = num->val;
+    return true;
+}
+
+// Fetches both operands of a quickened node in the generic evaluation
+// order. Returns false if either is not a number or is unbound, after which
+// the node is deoptimized and re-evaluated generically to produce the usual
+// result or error; variable lookups have no side effects, so repeating them
+// is safe.
+static bool quick_operands(QuickState &quick, PTR(Env) env, int64_t &l, int64_t &r) {
+    switch (quick.kind) {
+        case quick_var_const:
+            r = quick.constant;
+            return lookup_num(env, quick.lhs_var, l);
+        case quick_const_var:
+            l = quick.constant;
+            return lookup_num(env, quick.rhs_var, r);
+        case quick_var_var:
+            return lookup_num(env, quick.lhs_var, l) && lookup_num(env, quick.rhs_var, r);
+        default:
+            return false;
+    }
+}
+
+// Runs the quickened path if the node has one. Returns false when the
+// caller must take the generic path.
+static bool quick_path(QuickState &quick, PTR(Expr) lhs, PTR(Expr) rhs, PTR(Env) env, int64_t &l, int64_t &r) {
+    if (quick.kind == quick_uninit) {
+        quicken(quick, lhs, rhs);
+        return false;
+    }
+    if (quick.kind == quick_generic) return false;
+    if (quick_operands(quick, env, l, r)) {
+        quick.hits++;
+        return true;
+    }
+    quick.deoptimized = quick.kind;
+    quick.kind = quick_generic;
+    quick.lhs_var = nullptr;
+    quick.rhs_var = nullptr;
+    return false;
+}
+
+// Attributes an error that a value or environment just reported to node.
+static PTR(Val) fail_at(EvalStatus &status, Expr *node) {
+    status.locate(node->span);
+    return nullptr;
+}
+
+static PTR(Val) fail_at(EvalStatus &status, Expr *node, eval_error_t code, const char *detail) {
+    status.fail(code, detail);
+    return fail_at(status, node);
+}
+
 // ==================== NumExpr ====================
-NumExpr::NumExpr(int64_t val) : val(val) {}
+NumExpr::NumExpr(int64_t val) : val(val) {
+    may_capture_env = false;
+}
 
 bool NumExpr::equals(PTR(Expr) e) {
     PTR(NumExpr) num = CAST(NumExpr)(e);
     return num && this->val == num->val;
 }
 
-PTR(Val) NumExpr::interp(PTR(Env) env) {
+PTR(Val) NumExpr::eval(PTR(Env), EvalStatus&) {
     return NEW(NumVal)(val);
 }
 
@@ -26,15 +112,27 @@ void NumExpr::pretty_print(std::ostream &os, precedence_t, std::streampos&) {
 }
 
 // ==================== AddExpr ====================
-AddExpr::AddExpr(PTR(Expr) lhs, PTR(Expr) rhs) : lhs(lhs), rhs(rhs) {}
+AddExpr::AddExpr(PTR(Expr) lhs, PTR(Expr) rhs) : lhs(lhs), rhs(rhs) {
+    may_capture_env = lhs->may_capture_env || rhs->may_capture_env;
+}
 
 bool AddExpr::equals(PTR(Expr) e) {
     PTR(AddExpr) add = CAST(AddExpr)(e);
     return add && lhs->equals(add->lhs) && rhs->equals(add->rhs);
 }
 
-PTR(Val) AddExpr::interp(PTR(Env) env) {
-    return lhs->interp(env)->add_to(rhs->interp(env));
+PTR(Val) AddExpr::eval(PTR(Env) env, EvalStatus &status) {
+    int64_t l, r, sum;
+    if (quick_path(quick, lhs, rhs, env, l, r)) {
+        if (!NumVal::try_add(l, r, sum)) return fail_at(status, this, eval_overflow, "Addition overflow");
+        return NEW(NumVal)(sum);
+    }
+    PTR(Val) lhs_val = lhs->eval(env, status);
+    if (!lhs_val) return nullptr;
+    PTR(Val) rhs_val = rhs->eval(env, status);
+    if (!rhs_val) return nullptr;
+    PTR(Val) v = lhs_val->try_add_to(rhs_val, status);
+    return v ? v : fail_at(status, this);
 }
 
 void AddExpr::printExp(std::ostream &os) {
@@ -51,15 +149,27 @@ void AddExpr::pretty_print(std::ostream &os, precedence_t prec, std::streampos &
 }
 
 // ==================== MultExpr ====================
-MultExpr::MultExpr(PTR(Expr) lhs, PTR(Expr) rhs) : lhs(lhs), rhs(rhs) {}
+MultExpr::MultExpr(PTR(Expr) lhs, PTR(Expr) rhs) : lhs(lhs), rhs(rhs) {
+    may_capture_env = lhs->may_capture_env || rhs->may_capture_env;
+}
 
 bool MultExpr::equals(PTR(Expr) e) {
     PTR(MultExpr) mult = CAST(MultExpr)(e);
     return mult && lhs->equals(mult->lhs) && rhs->equals(mult->rhs);
 }
 
-PTR(Val) MultExpr::interp(PTR(Env) env) {
-    return lhs->interp(env)->mult_with(rhs->interp(env));
+PTR(Val) MultExpr::eval(PTR(Env) env, EvalStatus &status) {
+    int64_t l, r, product;
+    if (quick_path(quick, lhs, rhs, env, l, r)) {
+        if (!NumVal::try_mult(l, r, product)) return fail_at(status, this, eval_overflow, "Multiplication overflow");
+        return NEW(NumVal)(product);
+    }
+    PTR(Val) lhs_val = lhs->eval(env, status);
+    if (!lhs_val) return nullptr;
+    PTR(Val) rhs_val = rhs->eval(env, status);
+    if (!rhs_val) return nullptr;
+    PTR(Val) v = lhs_val->try_mult_with(rhs_val, status);
+    return v ? v : fail_at(status, this);
 }
 
 void MultExpr::printExp(std::ostream &os) {
@@ -76,15 +186,20 @@ void MultExpr::pretty_print(std::ostream &os, precedence_t prec, std::streampos
 }
 
 // ==================== VarExpr ====================
-VarExpr::VarExpr(const std::string &name) : name(name) {}
+VarExpr::VarExpr(Symbol name) : name(name) {
+    may_capture_env = false;
+}
 
 bool VarExpr::equals(PTR(Expr) e) {
     PTR(VarExpr) var = CAST(VarExpr)(e);
     return var && name == var->name;
 }
 
-PTR(Val) VarExpr::interp(PTR(Env) env) {
-    return env->lookup(name);
+PTR(Val) VarExpr::eval(PTR(Env) env, EvalStatus &status) {
+    PTR(Val) v = env->find(name);
+    if (v) return v;
+    status.fail_free_variable(name);
+    return fail_at(status, this);
 }
 
 void VarExpr::printExp(std::ostream &os) {
@@ -96,8 +211,61 @@ void VarExpr::pretty_print(std::ostream &os, precedence_t, std::streampos&) {
 }
 
 // ==================== LetExpr ====================
-LetExpr::LetExpr(const std::string &var, PTR(Expr) rhs, PTR(Expr) body)
-    : var(var), rhs(rhs), body(body) {}
+// Names a bound _fun, and the _funs curried directly in its body, after
+// the variable, unless an earlier binding of the same node named it.
+static void name_functions(PTR(Expr) rhs, Symbol var) {
+    for (PTR(FunExpr) fun = CAST(FunExpr)(rhs); fun && fun->name == Symbol(); fun = CAST(FunExpr)(fun->body)) {
+        fun->name = var;
+    }
+}
+
+// True if every occurrence of var in e that refers to the enclosing
+// binding is the callee of a call. Unknown node kinds count as other uses.
+static bool only_called(PTR(Expr) e, Symbol var) {
+    if (PTR(VarExpr) v = CAST(VarExpr)(e)) return v->name != var;
+    if (CAST(NumExpr)(e) || CAST(BoolExpr)(e)) return true;
+    if (PTR(AddExpr) add = CAST(AddExpr)(e)) return only_called(add->lhs, var) && only_called(add->rhs, var);
+    if (PTR(MultExpr) mult = CAST(MultExpr)(e)) return only_called(mult->lhs, var) && only_called(mult->rhs, var);
+    if (PTR(EqualExpr) eq = CAST(EqualExpr)(e)) return only_called(eq->lhs, var) && only_called(eq->rhs, var);
+    if (PTR(IfExpr) i = CAST(IfExpr)(e)) {
+        return only_called(i->condition, var) && only_called(i->then_branch, var) &&
+               only_called(i->else_branch, var);
+    }
+    if (PTR(CallExpr) call = CAST(CallExpr)(e)) {
+        PTR(VarExpr) callee = CAST(VarExpr)(call->func);
+        if (!(callee && callee->name == var) && !only_called(call->func, var)) return false;
+        for (PTR(Expr) arg : call->args) {
+            if (!only_called(arg, var)) return false;
+        }
+        return true;
+    }
+    if (PTR(LetExpr) let = CAST(LetExpr)(e)) {
+        return only_called(let->rhs, var) && (let->var == var || only_called(let->body, var));
+    }
+    if (PTR(LetRecExpr) rec = CAST(LetRecExpr)(e)) {
+        return rec->var == var || (only_called(rec->rhs, var) && only_called(rec->body, var));
+    }
+    if (PTR(FunExpr) f = CAST(FunExpr)(e)) {
+        for (Symbol param : f->params) {
+            if (param == var) return true;
+        }
+        return only_called(f->body, var);
+    }
+    return false;
+}
+
+// Escape analysis: values only hold an environment when they are closures
+// or thunks, so a frame whose body creates neither dies when the body
+// returns. A _fun that the body only calls, and that creates neither
+// itself, cannot leak the frame it closes over either.
+LetExpr::LetExpr(Symbol var, PTR(Expr) rhs, PTR(Expr) body)
+    : var(var), rhs(rhs), body(body) {
+    name_functions(rhs, var);
+    stack_frame = !body->may_capture_env;
+    FunExpr *fun = dynamic_cast<FunExpr*>(RAW(rhs));
+    local_fun = stack_frame && fun && !fun->body->may_capture_env && only_called(body, var);
+    may_capture_env = (rhs->may_capture_env && !local_fun) || body->may_capture_env;
+}
 
 bool LetExpr::equals(PTR(Expr) e) {
     PTR(LetExpr) let = CAST(LetExpr)(e);
@@ -106,10 +274,23 @@ bool LetExpr::equals(PTR(Expr) e) {
            body->equals(let->body);
 }
 
-PTR(Val) LetExpr::interp(PTR(Env) env) {
-    PTR(Val) rhs_val = rhs->interp(env);
+PTR(Val) LetExpr::eval(PTR(Env) env, EvalStatus &status) {
+    if (local_fun) {
+        eval_step();
+        FunVal closure(STATIC_CAST(FunExpr)(rhs), env);
+        ExtendedEnv frame(var, UNOWNED(Val)(&closure), env);
+        return body->eval(UNOWNED(Env)(&frame), status);
+    }
+    PTR(Val) rhs_val = rhs->eval(env, status);
+    if (!rhs_val) return nullptr;
+    eval_step();
+    if (stack_frame) {
+        ExtendedEnv frame(var, rhs_val, env);
+        return body->eval(UNOWNED(Env)(&frame), status);
+    }
+    eval_allocated(sizeof(ExtendedEnv));
     PTR(Env) new_env = NEW(ExtendedEnv)(var, rhs_val, env);
-    return body->interp(new_env);
+    return body->eval(new_env, status);
 }
 
 void LetExpr::printExp(std::ostream &os) {
@@ -136,14 +317,16 @@ void LetExpr::pretty_print(std::ostream &os, precedence_t prec, std::streampos &
 }
 
 // ==================== BoolExpr ====================
-BoolExpr::BoolExpr(bool val) : val(val) {}
+BoolExpr::BoolExpr(bool val) : val(val) {
+    may_capture_env = false;
+}
 
 bool BoolExpr::equals(PTR(Expr) e) {
     PTR(BoolExpr) b = CAST(BoolExpr)(e);
     return b && val == b->val;
 }
 
-PTR(Val) BoolExpr::interp(PTR(Env) env) {
+PTR(Val) BoolExpr::eval(PTR(Env), EvalStatus&) {
     return NEW(BoolVal)(val);
 }
 
@@ -157,15 +340,23 @@ void BoolExpr::pretty_print(std::ostream &os, precedence_t, std::streampos&) {
 
 // ==================== EqualExpr ====================
 EqualExpr::EqualExpr(PTR(Expr) lhs, PTR(Expr) rhs)
-    : lhs(lhs), rhs(rhs) {}
+    : lhs(lhs), rhs(rhs) {
+    may_capture_env = lhs->may_capture_env || rhs->may_capture_env;
+}
 
 bool EqualExpr::equals(PTR(Expr) e) {
     PTR(EqualExpr) eq = CAST(EqualExpr)(e);
     return eq && lhs->equals(eq->lhs) && rhs->equals(eq->rhs);
 }
 
-PTR(Val) EqualExpr::interp(PTR(Env) env) {
-    return NEW(BoolVal)(lhs->interp(env)->equals(rhs->interp(env)));
+PTR(Val) EqualExpr::eval(PTR(Env) env, EvalStatus &status) {
+    int64_t l, r;
+    if (quick_path(quick, lhs, rhs, env, l, r)) return NEW(BoolVal)(l == r);
+    PTR(Val) lhs_val = lhs->eval(env, status);
+    if (!lhs_val) return nullptr;
+    PTR(Val) rhs_val = rhs->eval(env, status);
+    if (!rhs_val) return nullptr;
+    return NEW(BoolVal)(lhs_val->equals(rhs_val));
 }
 
 void EqualExpr::printExp(std::ostream &os) {
@@ -183,7 +374,9 @@ void EqualExpr::pretty_print(std::ostream &os, precedence_t prec, std::streampos
 
 // ==================== IfExpr ====================
 IfExpr::IfExpr(PTR(Expr) condition, PTR(Expr) then_branch, PTR(Expr) else_branch)
-    : condition(condition), then_branch(then_branch), else_branch(else_branch) {}
+    : condition(condition), then_branch(then_branch), else_branch(else_branch) {
+    may_capture_env = condition->may_capture_env || then_branch->may_capture_env || else_branch->may_capture_env;
+}
 
 bool IfExpr::equals(PTR(Expr) e) {
     PTR(IfExpr) i = CAST(IfExpr)(e);
@@ -192,11 +385,12 @@ bool IfExpr::equals(PTR(Expr) e) {
            else_branch->equals(i->else_branch);
 }
 
-PTR(Val) IfExpr::interp(PTR(Env) env) {
-    PTR(Val) cond_val = condition->interp(env);
+PTR(Val) IfExpr::eval(PTR(Env) env, EvalStatus &status) {
+    PTR(Val) cond_val = condition->eval(env, status);
+    if (!cond_val) return nullptr;
     PTR(BoolVal) bool_cond = CAST(BoolVal)(cond_val);
-    if (!bool_cond) throw std::runtime_error("Condition must be boolean");
-    return bool_cond->val ? then_branch->interp(env) : else_branch->interp(env);
+    if (!bool_cond) return fail_at(status, this, eval_type_error, "Condition must be boolean");
+    return bool_cond->val ? then_branch->eval(env, status) : else_branch->eval(env, status);
 }
 
 void IfExpr::printExp(std::ostream &os) {
@@ -227,27 +421,55 @@ void IfExpr::pretty_print(std::ostream &os, precedence_t prec, std::streampos &l
 }
 
 // ==================== FunExpr ====================
-FunExpr::FunExpr(const std::string &var, PTR(Expr) body)
-    : var(var), body(body) {}
+FunExpr::FunExpr(Symbol var, PTR(Expr) body)
+    : FunExpr(std::vector<Symbol>{var}, body) {}
+
+FunExpr::FunExpr(std::vector<Symbol> params, PTR(Expr) body)
+    : params(std::move(params)), body(body) {
+    stack_frame = !body->may_capture_env;
+}
+
+uint32_t FunExpr::profile_label() {
+    uint32_t l = label.load(std::memory_order_relaxed);
+    if (l == 0) {
+        std::string text = name == Symbol() ? "_fun" : name.name();
+        if (!span.empty()) text += "@" + std::to_string(span.begin) + "-" + std::to_string(span.end);
+        l = intern_profile_label(text);
+        label.store(l, std::memory_order_relaxed);
+    }
+    return l;
+}
 
 bool FunExpr::equals(PTR(Expr) e) {
     PTR(FunExpr) f = CAST(FunExpr)(e);
-    return f && var == f->var && body->equals(f->body);
+    return f && params == f->params && body->equals(f->body);
 }
 
-PTR(Val) FunExpr::interp(PTR(Env) env) {
-    return NEW(FunVal)(var, body, env);
+PTR(Val) FunExpr::eval(PTR(Env) env, EvalStatus&) {
+    eval_allocated(sizeof(FunVal));
+    return NEW(FunVal)(STATIC_CAST(FunExpr)(THIS), env);
+}
+
+static void print_params(std::ostream &os, const std::vector<Symbol> &params, const char *separator) {
+    for (size_t i = 0; i < params.size(); i++) {
+        if (i > 0) os << separator;
+        os << params[i];
+    }
 }
 
 void FunExpr::printExp(std::ostream &os) {
-    os << "(_fun (" << var << ") " << body->to_string() << ")";
+    os << "(_fun (";
+    print_params(os, params, ",");
+    os << ") " << body->to_string() << ")";
 }
 
 void FunExpr::pretty_print(std::ostream &os, precedence_t prec, std::streampos &lastIndent) {
     bool needs_paren = prec != prec_none;
     if (needs_paren) os << "(";
 
-    os << "_fun (" << var << ")";
+    os << "_fun (";
+    print_params(os, params, ", ");
+    os << ")";
     if (body->is_simple()) {
         os << " ";
         body->pretty_print(os, prec_none, lastIndent);
@@ -260,37 +482,269 @@ void FunExpr::pretty_print(std::ostream &os, precedence_t prec, std::streampos &
     if (needs_paren) os << ")";
 }
 
+// ==================== LetRecExpr ====================
+LetRecExpr::LetRecExpr(Symbol var, PTR(FunExpr) rhs, PTR(Expr) body)
+    : var(var), rhs(rhs), body(body) {
+    name_functions(rhs, var);
+}
+
+bool LetRecExpr::equals(PTR(Expr) e) {
+    PTR(LetRecExpr) let = CAST(LetRecExpr)(e);
+    return let && var == let->var &&
+           rhs->equals(let->rhs) &&
+           body->equals(let->body);
+}
+
+PTR(Val) LetRecExpr::eval(PTR(Env) env, EvalStatus &status) {
+    eval_step();
+    eval_allocated(sizeof(RecEnv));
+    PTR(Env) new_env = NEW(RecEnv)(var, rhs, env);
+    return body->eval(new_env, status);
+}
+
+void LetRecExpr::printExp(std::ostream &os) {
+    os << "(_letrec " << var << "=" << rhs->to_string()
+    << " _in " << body->to_string() << ")";
+}
+
+void LetRecExpr::pretty_print(std::ostream &os, precedence_t prec, std::streampos &lastIndent) {
+    bool needs_paren = prec != prec_none;
+    if (needs_paren) os << "(";
+
+    std::streampos let_start = os.tellp();
+    os << "_letrec " << var << " = ";
+    rhs->pretty_print(os, prec_none, lastIndent);
+
+    os << "\n";
+    size_t indent = let_start - lastIndent;
+    os << std::string(indent, ' ') << "_in ";
+
+    std::streampos in_start = os.tellp();
+    body->pretty_print(os, prec_none, in_start);
+
+    if (needs_paren) os << ")";
+}
+
 // ==================== CallExpr ====================
+// Longest f(a)(b)... chain evaluated in one go; longer chains are split.
+static const size_t MAX_CALL_CHAIN = 8;
+
 CallExpr::CallExpr(PTR(Expr) func, PTR(Expr) arg)
-    : func(func), arg(arg) {}
+    : CallExpr(func, std::vector<PTR(Expr)>{arg}) {}
+
+CallExpr::CallExpr(PTR(Expr) func, std::vector<PTR(Expr)> args)
+    : func(func), args(std::move(args)) {
+    may_capture_env = func->may_capture_env;
+    for (PTR(Expr) arg : this->args) may_capture_env = may_capture_env || arg->may_capture_env;
+    CallExpr *inner = dynamic_cast<CallExpr*>(RAW(func));
+    if (inner && inner->chain_length < MAX_CALL_CHAIN) {
+        inner_call = inner;
+        chain_length = inner->chain_length + 1;
+    }
+}
 
 bool CallExpr::equals(PTR(Expr) e) {
     PTR(CallExpr) c = CAST(CallExpr)(e);
-    return c && func->equals(c->func) && arg->equals(c->arg);
+    if (!c || !func->equals(c->func) || args.size() != c->args.size()) return false;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (!args[i]->equals(c->args[i])) return false;
+    }
+    return true;
+}
+
+// Evaluates the arguments left to right into arg_vals. Returns false if one
+// of them fails.
+static bool eval_args(const std::vector<PTR(Expr)> &args, PTR(Env) env, EvalStatus &status,
+                      std::vector<PTR(Val)> &arg_vals) {
+    arg_vals.reserve(args.size());
+    for (size_t i = 0; i < args.size(); i++) {
+        PTR(Val) v = args[i]->eval(env, status);
+        if (!v) return false;
+        arg_vals.push_back(v);
+    }
+    return true;
 }
 
-PTR(Val) CallExpr::interp(PTR(Env) env) {
-    PTR(Val) func_val = func->interp(env);
-    PTR(FunVal) fun = CAST(FunVal)(func_val);
-    if (!fun) throw std::runtime_error("Cannot call non-function value");
+// Evaluates the arguments and calls fun; the caller keeps fun alive. An
+// arity mismatch is attributed to site.
+static PTR(Val) apply_args(FunVal *fun, CallExpr *site, PTR(Env) env, EvalStatus &status) {
+    PTR(Val) v;
+    if (site->args.size() == 1) {
+        PTR(Val) arg_val = site->args[0]->eval(env, status);
+        if (!arg_val) return nullptr;
+        v = fun->call(arg_val, status);
+    } else {
+        std::vector<PTR(Val)> arg_vals;
+        if (!eval_args(site->args, env, status, arg_vals)) return nullptr;
+        v = fun->call(std::move(arg_vals), status);
+    }
+    return v ? v : fail_at(status, site);
+}
+
+// Calls a value that is not a closure: a native function, whose
+// arguments are checked at this boundary, or else an error.
+static PTR(Val) call_native(PTR(Val) callee, CallExpr *site, PTR(Env) env, EvalStatus &status) {
+    PTR(NativeFunVal) native = CAST(NativeFunVal)(callee);
+    if (!native) return fail_at(status, site, eval_not_function, "Cannot call non-function value");
+    std::vector<PTR(Val)> arg_vals;
+    if (!eval_args(site->args, env, status, arg_vals)) return nullptr;
+    PTR(Val) v = native->call(arg_vals, status);
+    return v ? v : fail_at(status, site);
+}
+
+// True if fun's parameters, and those of the _funs directly nested in its
+// body, take exactly the argument lists of the given calls.
+static bool curried_arity_matches(FunExpr *fun, CallExpr **calls, size_t count) {
+    for (size_t i = 0;; i++) {
+        if (fun->params.size() != calls[i]->args.size()) return false;
+        if (i + 1 == count) return true;
+        fun = dynamic_cast<FunExpr*>(RAW(fun->body));
+        if (!fun) return false;
+    }
+}
 
-    PTR(Val) arg_val = arg->interp(env);
-    PTR(Env) new_env = NEW(ExtendedEnv)(fun->var, arg_val, fun->env);
-    return fun->body->interp(new_env);
+// Applies a curried closure to several argument lists at once. Applying a
+// _fun whose body is another _fun only creates that closure, so each level
+// binds its frame directly on top of the previous one instead.
+static PTR(Val) call_curried(PTR(FunVal) closure, CallExpr **calls, size_t count, PTR(Env) env, EvalStatus &status) {
+    PTR(FunExpr) fun = closure->fun;
+    PTR(Env) frame = closure->env;
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0) fun = STATIC_CAST(FunExpr)(fun->body);
+        std::vector<PTR(Val)> arg_vals;
+        if (!eval_args(calls[i]->args, env, status, arg_vals)) return nullptr;
+        eval_step();
+        frame = FunVal::bind(fun, std::move(arg_vals), frame, status);
+        if (!frame) return fail_at(status, calls[i]);
+    }
+    EvalCallGuard depth;
+    ProfileFrame profile(RAW(fun));
+    return fun->body->eval(frame, status);
+}
+
+PTR(Val) CallExpr::eval(PTR(Env) env, EvalStatus &status) {
+    if (inner_call) return eval_chain(env, status);
+
+    PTR(Val) func_val = func->eval(env, status);
+    if (!func_val) return nullptr;
+    FunVal *fun;
+    if (RAW(func_val) == ic_callee && !EXPIRED(ic_callee_ref)) {
+        fun = ic_callee;
+        ic_hits++;
+    } else {
+        PTR(FunVal) checked = CAST(FunVal)(func_val);
+        if (!checked) return call_native(func_val, this, env, status);
+        fun = RAW(checked);
+        ic_callee = fun;
+        ic_callee_ref = func_val;
+        ic_misses++;
+    }
+    return apply_args(fun, this, env, status);
+}
+
+PTR(Val) CallExpr::eval_chain(PTR(Env) env, EvalStatus &status) {
+    CallExpr *calls[MAX_CALL_CHAIN];
+    CallExpr *c = this;
+    for (size_t i = chain_length; i-- > 0; c = c->inner_call) calls[i] = c;
+
+    PTR(Val) callee = calls[0]->func->eval(env, status);
+    for (size_t i = 0; callee && i < chain_length; i++) {
+        PTR(FunVal) fun = CAST(FunVal)(callee);
+        if (!fun) {
+            callee = call_native(callee, calls[i], env, status);
+            continue;
+        }
+        if (i + 1 < chain_length && curried_arity_matches(RAW(fun->fun), calls + i, chain_length - i)) {
+            return call_curried(fun, calls + i, chain_length - i, env, status);
+        }
+        callee = apply_args(RAW(fun), calls[i], env, status);
+    }
+    return callee;
 }
 
 void CallExpr::printExp(std::ostream &os) {
-    os << func->to_string() << "(" << arg->to_string() << ")";
+    os << func->to_string() << "(";
+    for (size_t i = 0; i < args.size(); i++) {
+        if (i > 0) os << ",";
+        os << args[i]->to_string();
+    }
+    os << ")";
 }
 
 void CallExpr::pretty_print(std::ostream &os, precedence_t, std::streampos &lastIndent) {
     func->pretty_print(os, prec_none, lastIndent);
     os << "(";
-    arg->pretty_print(os, prec_none, lastIndent);
+    for (size_t i = 0; i < args.size(); i++) {
+        if (i > 0) os << ", ";
+        args[i]->pretty_print(os, prec_none, lastIndent);
+    }
     os << ")";
 }
 
+// ==================== Type-specialized nodes ====================
+// Inference guarantees the operand types, so the static_casts are safe.
+
+PTR(Val) AddIntExpr::eval(PTR(Env) env, EvalStatus &status) {
+    PTR(Val) l = lhs->eval(env, status);
+    if (!l) return nullptr;
+    PTR(Val) r = rhs->eval(env, status);
+    if (!r) return nullptr;
+    int64_t sum;
+    if (!NumVal::try_add(static_cast<NumVal*>(RAW(l))->val, static_cast<NumVal*>(RAW(r))->val, sum)) {
+        return fail_at(status, this, eval_overflow, "Addition overflow");
+    }
+    return NEW(NumVal)(sum);
+}
+
+PTR(Val) MultIntExpr::eval(PTR(Env) env, EvalStatus &status) {
+    PTR(Val) l = lhs->eval(env, status);
+    if (!l) return nullptr;
+    PTR(Val) r = rhs->eval(env, status);
+    if (!r) return nullptr;
+    int64_t product;
+    if (!NumVal::try_mult(static_cast<NumVal*>(RAW(l))->val, static_cast<NumVal*>(RAW(r))->val, product)) {
+        return fail_at(status, this, eval_overflow, "Multiplication overflow");
+    }
+    return NEW(NumVal)(product);
+}
+
+PTR(Val) EqualIntExpr::eval(PTR(Env) env, EvalStatus &status) {
+    PTR(Val) l = lhs->eval(env, status);
+    if (!l) return nullptr;
+    PTR(Val) r = rhs->eval(env, status);
+    if (!r) return nullptr;
+    return NEW(BoolVal)(static_cast<NumVal*>(RAW(l))->val == static_cast<NumVal*>(RAW(r))->val);
+}
+
+PTR(Val) EqualBoolExpr::eval(PTR(Env) env, EvalStatus &status) {
+    PTR(Val) l = lhs->eval(env, status);
+    if (!l) return nullptr;
+    PTR(Val) r = rhs->eval(env, status);
+    if (!r) return nullptr;
+    return NEW(BoolVal)(static_cast<BoolVal*>(RAW(l))->val == static_cast<BoolVal*>(RAW(r))->val);
+}
+
+PTR(Val) IfBoolExpr::eval(PTR(Env) env, EvalStatus &status) {
+    PTR(Val) cond_val = condition->eval(env, status);
+    if (!cond_val) return nullptr;
+    return static_cast<BoolVal*>(RAW(cond_val))->val ? then_branch->eval(env, status) : else_branch->eval(env, status);
+}
+
+PTR(Val) CallFunExpr::eval(PTR(Env) env, EvalStatus &status) {
+    if (inner_call) return eval_chain(env, status);
+    PTR(Val) func_val = func->eval(env, status);
+    if (!func_val) return nullptr;
+    return apply_args(static_cast<FunVal*>(RAW(func_val)), this, env, status);
+}
+
 // ==================== Base Methods ====================
+PTR(Val) Expr::interp(PTR(Env) env) {
+    EvalStatus status;
+    PTR(Val) v = eval(env, status);
+    if (!v) status.raise();
+    return v;
+}
+
 std::string Expr::to_string() {
     std::stringstream ss;
     this->printExp(ss);
@@ -303,3 +757,71 @@ std::string Expr::to_pretty_string() {
     this->pretty_print(ss, prec_none, initial_pos);
     return ss.str();
 }
+
+void visit_nodes(PTR(Expr) e, const std::function<void(PTR(Expr))> &f) {
+    f(e);
+    if (PTR(AddExpr) add = CAST(AddExpr)(e)) {
+        visit_nodes(add->lhs, f);
+        visit_nodes(add->rhs, f);
+    } else if (PTR(MultExpr) mult = CAST(MultExpr)(e)) {
+        visit_nodes(mult->lhs, f);
+        visit_nodes(mult->rhs, f);
+    } else if (PTR(EqualExpr) eq = CAST(EqualExpr)(e)) {
+        visit_nodes(eq->lhs, f);
+        visit_nodes(eq->rhs, f);
+    } else if (PTR(IfExpr) i = CAST(IfExpr)(e)) {
+        visit_nodes(i->condition, f);
+        visit_nodes(i->then_branch, f);
+        visit_nodes(i->else_branch, f);
+    } else if (PTR(LetExpr) let = CAST(LetExpr)(e)) {
+        visit_nodes(let->rhs, f);
+        visit_nodes(let->body, f);
+    } else if (PTR(LetRecExpr) letrec = CAST(LetRecExpr)(e)) {
+        visit_nodes(letrec->rhs, f);
+        visit_nodes(letrec->body, f);
+    } else if (PTR(FunExpr) fun = CAST(FunExpr)(e)) {
+        visit_nodes(fun->body, f);
+    } else if (PTR(CallExpr) call = CAST(CallExpr)(e)) {
+        visit_nodes(call->func, f);
+        for (PTR(Expr) arg : call->args) visit_nodes(arg, f);
+    }
+}
+
+InlineCacheStats inline_cache_stats(PTR(Expr) e) {
+    InlineCacheStats stats;
+    visit_nodes(e, [&stats](PTR(Expr) node) {
+        if (PTR(CallExpr) call = CAST(CallExpr)(node)) {
+            stats.sites++;
+            stats.hits += call->ic_hits;
+            stats.misses += call->ic_misses;
+        }
+    });
+    return stats;
+}
+
+// A deoptimized node still counts the hits its fused path had before.
+static void add_quick_hits(const QuickState &quick, uint64_t &var_const, uint64_t &const_var, uint64_t &var_var) {
+    quick_t shape = quick.kind == quick_generic ? quick.deoptimized : quick.kind;
+    if (shape == quick_var_const) var_const += quick.hits;
+    else if (shape == quick_const_var) const_var += quick.hits;
+    else if (shape == quick_var_var) var_var += quick.hits;
+}
+
+QuickeningStats quickening_stats(PTR(Expr) e) {
+    QuickeningStats stats;
+    visit_nodes(e, [&stats](PTR(Expr) node) {
+        const QuickState *quick = nullptr;
+        if (PTR(AddExpr) add = CAST(AddExpr)(node)) {
+            quick = &add->quick;
+            add_quick_hits(*quick, stats.add_var_const, stats.add_const_var, stats.add_var_var);
+        } else if (PTR(MultExpr) mult = CAST(MultExpr)(node)) {
+            quick = &mult->quick;
+            add_quick_hits(*quick, stats.mult_var_const, stats.mult_const_var, stats.mult_var_var);
+        } else if (PTR(EqualExpr) eq = CAST(EqualExpr)(node)) {
+            quick = &eq->quick;
+            add_quick_hits(*quick, stats.equal_var_const, stats.equal_const_var, stats.equal_var_var);
+        }
+        if (quick && quick->deoptimized != quick_uninit) stats.deoptimized++;
+    });
+    return stats;
+}
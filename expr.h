@@ -4,9 +4,14 @@
 #include "pointer.h"
 #include "val.h"
 #include "env.h"
+#include "symbol.h"
+#include "eval_status.h"
 #include <string>
 #include <iostream>
 #include <memory>
+#include <atomic>
+#include <functional>
+#include <vector>
 
 typedef enum {
     prec_none,
@@ -15,11 +20,48 @@ typedef enum {
     prec_mult
 } precedence_t;
 
+typedef enum {
+    quick_uninit,
+    quick_generic,
+    quick_var_const,
+    quick_const_var,
+    quick_var_var
+} quick_t;
+
+class VarExpr;
+
+// Quickening state of a binary arithmetic or comparison node. After its
+// first execution a node whose operands are a variable and a constant, or
+// two variables, switches to a fused path (AddVarConst, MultVarVar,
+// EqualVarConst, ...) that looks the variables up directly instead of
+// interpreting both children and allocating a value for the constant. An
+// operand that is not a number deoptimizes the node to the generic path
+// for good. Like the call-site caches, this makes a tree unsafe to
+// evaluate on two threads at once.
+struct QuickState {
+    quick_t kind = quick_uninit;
+    VarExpr *lhs_var = nullptr;
+    VarExpr *rhs_var = nullptr;
+    int64_t constant = 0;
+    uint64_t hits = 0;             ///< Executions of the fused path, counted under its shape.
+    quick_t deoptimized = quick_uninit;  ///< The shape the node fell back from, if it did.
+};
+
 CLASS(Expr) {
 public:
+    SourceSpan span;  ///< Where the parser found the node; not compared by equals.
+    // Whether evaluating the subtree may store its environment in a value:
+    // a closure, a _letrec frame or a lazy thunk. Set by the constructors
+    // of the node classes here; other subclasses must keep it conservative.
+    bool may_capture_env = true;
+
     virtual ~Expr() = default;
     virtual bool equals(PTR(Expr) e) = 0;
-    virtual PTR(Val) interp(PTR(Env) env) = 0;
+    // Evaluates the node. A script error returns nullptr and is described
+    // by status, located at the innermost failing node.
+    virtual PTR(Val) eval(PTR(Env) env, EvalStatus &status) = 0;
+    // Like eval, but throws the error as an EvalError.
+    PTR(Val) interp(PTR(Env) env);
     virtual void printExp(std::ostream &os) = 0;
     virtual void pretty_print(std::ostream &os, precedence_t prec, std::streampos& lastIndent) = 0;
     virtual bool is_simple() const { return false; }
@@ -32,7 +74,7 @@ public:
     int64_t val;
     NumExpr(int64_t val);
     bool equals(PTR(Expr) e) override;
-    PTR(Val) interp(PTR(Env) env) override;
+    PTR(Val) eval(PTR(Env) env, EvalStatus &status) override;
     void printExp(std::ostream &os) override;
     bool is_simple() const override { return true; }
     void pretty_print(std::ostream &os, precedence_t prec, std::streampos& lastIndent) override;
@@ -42,9 +84,10 @@ class AddExpr : public Expr {
 public:
     PTR(Expr) lhs;
     PTR(Expr) rhs;
+    QuickState quick;
     AddExpr(PTR(Expr), PTR(Expr));
     bool equals(PTR(Expr)) override;
-    PTR(Val) interp(PTR(Env) env) override;
+    PTR(Val) eval(PTR(Env) env, EvalStatus &status) override;
     void printExp(std::ostream&) override;
     bool is_simple() const override { return true; }
     void pretty_print(std::ostream&, precedence_t, std::streampos&) override;
@@ -54,9 +97,10 @@ class MultExpr : public Expr {
 public:
     PTR(Expr) lhs;
     PTR(Expr) rhs;
+    QuickState quick;
     MultExpr(PTR(Expr), PTR(Expr));
     bool equals(PTR(Expr)) override;
-    PTR(Val) interp(PTR(Env) env) override;
+    PTR(Val) eval(PTR(Env) env, EvalStatus &status) override;
     void printExp(std::ostream&) override;
     bool is_simple() const override { return true; }
     void pretty_print(std::ostream&, precedence_t, std::streampos&) override;
@@ -64,22 +108,27 @@ public:
 
 class VarExpr : public Expr {
 public:
-    std::string name;
-    VarExpr(const std::string&);
+    Symbol name;
+    VarExpr(Symbol);
     bool equals(PTR(Expr)) override;
-    PTR(Val) interp(PTR(Env) env) override;
+    PTR(Val) eval(PTR(Env) env, EvalStatus &status) override;
     void printExp(std::ostream&) override;
     void pretty_print(std::ostream&, precedence_t, std::streampos&) override;
 };
 
 class LetExpr : public Expr {
 public:
-    std::string var;
+    Symbol var;
     PTR(Expr) rhs;
     PTR(Expr) body;
-    LetExpr(const std::string&, PTR(Expr), PTR(Expr));
+    // The body cannot capture the frame, so it lives on the stack.
+    bool stack_frame = false;
+    // Also, rhs is a _fun that body only calls and whose body captures
+    // nothing, so its closure lives on the stack too.
+    bool local_fun = false;
+    LetExpr(Symbol, PTR(Expr), PTR(Expr));
     bool equals(PTR(Expr)) override;
-    PTR(Val) interp(PTR(Env) env) override;
+    PTR(Val) eval(PTR(Env) env, EvalStatus &status) override;
     void printExp(std::ostream&) override;
     void pretty_print(std::ostream&, precedence_t, std::streampos&) override;
 };
@@ -89,7 +138,7 @@ public:
     bool val;
     BoolExpr(bool);
     bool equals(PTR(Expr)) override;
-    PTR(Val) interp(PTR(Env) env) override;
+    PTR(Val) eval(PTR(Env) env, EvalStatus &status) override;
     void printExp(std::ostream&) override;
     void pretty_print(std::ostream&, precedence_t, std::streampos&) override;
 };
@@ -98,9 +147,10 @@ class EqualExpr : public Expr {
 public:
     PTR(Expr) lhs;
     PTR(Expr) rhs;
+    QuickState quick;
     EqualExpr(PTR(Expr), PTR(Expr));
     bool equals(PTR(Expr)) override;
-    PTR(Val) interp(PTR(Env) env) override;
+    PTR(Val) eval(PTR(Env) env, EvalStatus &status) override;
     void printExp(std::ostream&) override;
     void pretty_print(std::ostream&, precedence_t, std::streampos&) override;
 };
@@ -112,18 +162,40 @@ public:
     PTR(Expr) else_branch;
     IfExpr(PTR(Expr), PTR(Expr), PTR(Expr));
     bool equals(PTR(Expr)) override;
-    PTR(Val) interp(PTR(Env) env) override;
+    PTR(Val) eval(PTR(Env) env, EvalStatus &status) override;
     void printExp(std::ostream&) override;
     void pretty_print(std::ostream&, precedence_t, std::streampos&) override;
 };
 
 class FunExpr : public Expr {
 public:
-    std::string var;
+    std::vector<Symbol> params;
+    PTR(Expr) body;
+    Symbol name;  ///< The _let or _letrec variable first bound to it, if any; not compared by equals.
+    bool stack_frame = false;  ///< The body cannot capture the frame of a call, so calls bind it on the stack.
+    FunExpr(Symbol, PTR(Expr));
+    FunExpr(std::vector<Symbol>, PTR(Expr));
+    // Names the function in profiles (profiler.h) by name and span.
+    uint32_t profile_label();
+    bool equals(PTR(Expr)) override;
+    PTR(Val) eval(PTR(Env) env, EvalStatus &status) override;
+    void printExp(std::ostream&) override;
+    void pretty_print(std::ostream&, precedence_t, std::streampos&) override;
+private:
+    std::atomic<uint32_t> label{0};
+};
+
+// _letrec binds a _fun in an environment that also contains the function
+// itself, so recursive calls reach it directly instead of through
+// self-application.
+class LetRecExpr : public Expr {
+public:
+    Symbol var;
+    PTR(FunExpr) rhs;
     PTR(Expr) body;
-    FunExpr(const std::string&, PTR(Expr));
+    LetRecExpr(Symbol, PTR(FunExpr), PTR(Expr));
     bool equals(PTR(Expr)) override;
-    PTR(Val) interp(PTR(Env) env) override;
+    PTR(Val) eval(PTR(Env) env, EvalStatus &status) override;
     void printExp(std::ostream&) override;
     void pretty_print(std::ostream&, precedence_t, std::streampos&) override;
 };
@@ -131,13 +203,109 @@ public:
 class CallExpr : public Expr {
 public:
     PTR(Expr) func;
-    PTR(Expr) arg;
+    std::vector<PTR(Expr)> args;
+
+    // In f(a)(b)(c) the outermost call evaluates the whole chain, so that a
+    // curried _fun applied to all of its argument lists can skip the
+    // intermediate closures. inner_call is func when func is the next call
+    // of the chain, and chain_length counts the calls including this one.
+    CallExpr *inner_call = nullptr;
+    size_t chain_length = 1;
+
+    // Monomorphic inline cache: the closure this site called last. A hit is
+    // an identity compare that skips the FunVal type check. The weak
+    // reference tells a live closure from a new object at a reused address.
+    // Updating it makes a tree unsafe to evaluate on two threads at once.
+    FunVal *ic_callee = nullptr;
+    WEAK(Val) ic_callee_ref;
+    uint64_t ic_hits = 0;
+    uint64_t ic_misses = 0;
+
     CallExpr(PTR(Expr), PTR(Expr));
+    CallExpr(PTR(Expr), std::vector<PTR(Expr)>);
     bool equals(PTR(Expr)) override;
-    PTR(Val) interp(PTR(Env) env) override;
+    PTR(Val) eval(PTR(Env) env, EvalStatus &status) override;
     void printExp(std::ostream&) override;
     bool is_simple() const override { return true; }
     void pretty_print(std::ostream&, precedence_t, std::streampos&) override;
+
+protected:
+    PTR(Val) eval_chain(PTR(Env) env, EvalStatus &status);
 };
 
+// ==================== Type-specialized nodes ====================
+// Created by specialize_types() where inference has proven the operand
+// types, so eval skips the runtime type checks. They print and compare
+// exactly like the generic node they extend.
+
+class AddIntExpr : public AddExpr {
+public:
+    using AddExpr::AddExpr;
+    PTR(Val) eval(PTR(Env) env, EvalStatus &status) override;
+};
+
+class MultIntExpr : public MultExpr {
+public:
+    using MultExpr::MultExpr;
+    PTR(Val) eval(PTR(Env) env, EvalStatus &status) override;
+};
+
+class EqualIntExpr : public EqualExpr {
+public:
+    using EqualExpr::EqualExpr;
+    PTR(Val) eval(PTR(Env) env, EvalStatus &status) override;
+};
+
+class EqualBoolExpr : public EqualExpr {
+public:
+    using EqualExpr::EqualExpr;
+    PTR(Val) eval(PTR(Env) env, EvalStatus &status) override;
+};
+
+class IfBoolExpr : public IfExpr {
+public:
+    using IfExpr::IfExpr;
+    PTR(Val) eval(PTR(Env) env, EvalStatus &status) override;
+};
+
+class CallFunExpr : public CallExpr {
+public:
+    using CallExpr::CallExpr;
+    PTR(Val) eval(PTR(Env) env, EvalStatus &status) override;
+};
+
+/**
+ * @brief Inline cache counters summed over the call sites of a tree.
+ */
+struct InlineCacheStats {
+    uint64_t sites = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+InlineCacheStats inline_cache_stats(PTR(Expr) e);
+
+/**
+ * @brief Executions of each quickened node shape, summed over a tree.
+ */
+struct QuickeningStats {
+    uint64_t add_var_const = 0;
+    uint64_t add_const_var = 0;
+    uint64_t add_var_var = 0;
+    uint64_t mult_var_const = 0;
+    uint64_t mult_const_var = 0;
+    uint64_t mult_var_var = 0;
+    uint64_t equal_var_const = 0;
+    uint64_t equal_const_var = 0;
+    uint64_t equal_var_var = 0;
+    uint64_t deoptimized = 0;  ///< Nodes that fell back to the generic path.
+};
+
+QuickeningStats quickening_stats(PTR(Expr) e);
+
+/**
+ * @brief Calls f on every node of a tree in preorder.
+ */
+void visit_nodes(PTR(Expr) e, const std::function<void(PTR(Expr))> &f);
+
 #endif
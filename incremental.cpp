@@ -0,0 +1,233 @@
+#include "incremental.h"
+#include "env.h"
+#include <set>
+#include <vector>
+
+namespace {
+
+// Stands in for a closed group during evaluation and remembers its value.
+// Only numbers and booleans are kept: a function value would also pin the
+// environment it was created in.
+class MemoExpr : public Expr {
+public:
+    PTR(Expr) inner;
+    PTR(Val) cached;
+    size_t *reused;
+
+    MemoExpr(PTR(Expr) inner, size_t *reused) : inner(inner), reused(reused) {
+        span = inner->span;
+        may_capture_env = inner->may_capture_env;
+    }
+
+    bool equals(PTR(Expr) e) override { return inner->equals(e); }
+
+    PTR(Val) eval(PTR(Env) env, EvalStatus &status) override {
+        if (cached) {
+            (*reused)++;
+            return cached;
+        }
+        PTR(Val) v = inner->eval(env, status);
+        if (CAST(NumVal)(v) || CAST(BoolVal)(v)) cached = v;
+        return v;
+    }
+
+    void printExp(std::ostream &os) override { inner->printExp(os); }
+    bool is_simple() const override { return inner->is_simple(); }
+    void pretty_print(std::ostream &os, precedence_t prec, std::streampos &lastIndent) override {
+        inner->pretty_print(os, prec, lastIndent);
+    }
+};
+
+bool is_closed(PTR(Expr) e, std::vector<Symbol> &bound) {
+    if (PTR(VarExpr) v = CAST(VarExpr)(e)) {
+        for (Symbol name : bound) {
+            if (name == v->name) return true;
+        }
+        return false;
+    }
+    if (PTR(AddExpr) add = CAST(AddExpr)(e)) return is_closed(add->lhs, bound) && is_closed(add->rhs, bound);
+    if (PTR(MultExpr) mult = CAST(MultExpr)(e)) return is_closed(mult->lhs, bound) && is_closed(mult->rhs, bound);
+    if (PTR(EqualExpr) eq = CAST(EqualExpr)(e)) return is_closed(eq->lhs, bound) && is_closed(eq->rhs, bound);
+    if (PTR(IfExpr) i = CAST(IfExpr)(e)) {
+        return is_closed(i->condition, bound) && is_closed(i->then_branch, bound) &&
+               is_closed(i->else_branch, bound);
+    }
+    if (PTR(CallExpr) call = CAST(CallExpr)(e)) {
+        if (!is_closed(call->func, bound)) return false;
+        for (PTR(Expr) arg : call->args) {
+            if (!is_closed(arg, bound)) return false;
+        }
+        return true;
+    }
+    if (PTR(LetExpr) let = CAST(LetExpr)(e)) {
+        if (!is_closed(let->rhs, bound)) return false;
+        bound.push_back(let->var);
+        bool closed = is_closed(let->body, bound);
+        bound.pop_back();
+        return closed;
+    }
+    if (PTR(LetRecExpr) rec = CAST(LetRecExpr)(e)) {
+        bound.push_back(rec->var);
+        bool closed = is_closed(rec->rhs, bound) && is_closed(rec->body, bound);
+        bound.pop_back();
+        return closed;
+    }
+    if (PTR(FunExpr) f = CAST(FunExpr)(e)) {
+        bound.insert(bound.end(), f->params.begin(), f->params.end());
+        bool closed = is_closed(f->body, bound);
+        bound.resize(bound.size() - f->params.size());
+        return closed;
+    }
+    return true;
+}
+
+bool is_leaf(PTR(Expr) e) {
+    return CAST(NumExpr)(e) || CAST(BoolExpr)(e) || CAST(VarExpr)(e) || CAST(FunExpr)(e);
+}
+
+// Copies the spans of a group that moved in the source onto the tree built
+// for it by wrap(). Subtrees the two share were already moved by the parser.
+void sync_spans(PTR(Expr) original, PTR(Expr) built) {
+    if (original == built) return;
+    built->span = original->span;
+    if (PTR(MemoExpr) memo = CAST(MemoExpr)(built)) {
+        sync_spans(original, memo->inner);
+    } else if (PTR(AddExpr) add = CAST(AddExpr)(original)) {
+        PTR(AddExpr) copy = STATIC_CAST(AddExpr)(built);
+        sync_spans(add->lhs, copy->lhs);
+        sync_spans(add->rhs, copy->rhs);
+    } else if (PTR(MultExpr) mult = CAST(MultExpr)(original)) {
+        PTR(MultExpr) copy = STATIC_CAST(MultExpr)(built);
+        sync_spans(mult->lhs, copy->lhs);
+        sync_spans(mult->rhs, copy->rhs);
+    } else if (PTR(EqualExpr) eq = CAST(EqualExpr)(original)) {
+        PTR(EqualExpr) copy = STATIC_CAST(EqualExpr)(built);
+        sync_spans(eq->lhs, copy->lhs);
+        sync_spans(eq->rhs, copy->rhs);
+    } else if (PTR(IfExpr) i = CAST(IfExpr)(original)) {
+        PTR(IfExpr) copy = STATIC_CAST(IfExpr)(built);
+        sync_spans(i->condition, copy->condition);
+        sync_spans(i->then_branch, copy->then_branch);
+        sync_spans(i->else_branch, copy->else_branch);
+    } else if (PTR(LetExpr) let = CAST(LetExpr)(original)) {
+        PTR(LetExpr) copy = STATIC_CAST(LetExpr)(built);
+        sync_spans(let->rhs, copy->rhs);
+        sync_spans(let->body, copy->body);
+    } else if (PTR(LetRecExpr) rec = CAST(LetRecExpr)(original)) {
+        PTR(LetRecExpr) copy = STATIC_CAST(LetRecExpr)(built);
+        sync_spans(rec->rhs, copy->rhs);
+        sync_spans(rec->body, copy->body);
+    } else if (PTR(FunExpr) f = CAST(FunExpr)(original)) {
+        sync_spans(f->body, STATIC_CAST(FunExpr)(built)->body);
+    } else if (PTR(CallExpr) call = CAST(CallExpr)(original)) {
+        PTR(CallExpr) copy = STATIC_CAST(CallExpr)(built);
+        sync_spans(call->func, copy->func);
+        for (size_t j = 0; j < call->args.size(); j++) sync_spans(call->args[j], copy->args[j]);
+    }
+}
+
+} // namespace
+
+PTR(Expr) IncrementalSession::parse(const std::string &source) {
+    if (last_expr && source == last_source) return last_expr;
+
+    PTR(Expr) e = parse_str_incremental(source, memo);
+    last_source = source;
+    last_expr = e;
+    last_val = nullptr;
+
+    group_roots.clear();
+    for (auto &group : memo.groups) group_roots.insert(group.second.exprs.begin(), group.second.exprs.end());
+    for (auto it = wrapped.begin(); it != wrapped.end();) {
+        if (group_roots.count(it->first)) ++it;
+        else it = wrapped.erase(it);
+    }
+    return e;
+}
+
+PTR(Val) IncrementalSession::interp(const std::string &source) {
+    PTR(Expr) e = parse(source);
+    if (last_val) {
+        values_reused++;
+        return last_val;
+    }
+
+    PTR(Val) v = wrap(e)->interp(globals);
+    if (CAST(NumVal)(v) || CAST(BoolVal)(v)) last_val = v;
+    return v;
+}
+
+void IncrementalSession::reset() {
+    memo = ParseMemo();
+    values_reused = 0;
+    last_source.clear();
+    last_expr = nullptr;
+    last_val = nullptr;
+    group_roots.clear();
+    wrapped.clear();
+}
+
+// Builds the tree that is actually evaluated: closed groups are wrapped in a
+// MemoExpr that is kept across edits, and only the nodes on a path to a
+// wrapper are copied. Keys hold the original group so its address cannot be
+// reused by a later parse while the entry exists.
+PTR(Expr) IncrementalSession::wrap(PTR(Expr) e) {
+    bool is_group = group_roots.count(e) != 0;
+    if (is_group) {
+        auto it = wrapped.find(e);
+        if (it != wrapped.end()) {
+            if (it->second->span.begin != e->span.begin) sync_spans(e, it->second);
+            return it->second;
+        }
+    }
+
+    PTR(Expr) rebuilt = e;
+    if (PTR(AddExpr) add = CAST(AddExpr)(e)) {
+        PTR(Expr) lhs = wrap(add->lhs);
+        PTR(Expr) rhs = wrap(add->rhs);
+        if (lhs != add->lhs || rhs != add->rhs) rebuilt = NEW(AddExpr)(lhs, rhs);
+    } else if (PTR(MultExpr) mult = CAST(MultExpr)(e)) {
+        PTR(Expr) lhs = wrap(mult->lhs);
+        PTR(Expr) rhs = wrap(mult->rhs);
+        if (lhs != mult->lhs || rhs != mult->rhs) rebuilt = NEW(MultExpr)(lhs, rhs);
+    } else if (PTR(EqualExpr) eq = CAST(EqualExpr)(e)) {
+        PTR(Expr) lhs = wrap(eq->lhs);
+        PTR(Expr) rhs = wrap(eq->rhs);
+        if (lhs != eq->lhs || rhs != eq->rhs) rebuilt = NEW(EqualExpr)(lhs, rhs);
+    } else if (PTR(IfExpr) i = CAST(IfExpr)(e)) {
+        PTR(Expr) c = wrap(i->condition);
+        PTR(Expr) t = wrap(i->then_branch);
+        PTR(Expr) f = wrap(i->else_branch);
+        if (c != i->condition || t != i->then_branch || f != i->else_branch) rebuilt = NEW(IfExpr)(c, t, f);
+    } else if (PTR(LetExpr) let = CAST(LetExpr)(e)) {
+        PTR(Expr) rhs = wrap(let->rhs);
+        PTR(Expr) body = wrap(let->body);
+        if (rhs != let->rhs || body != let->body) rebuilt = NEW(LetExpr)(let->var, rhs, body);
+    } else if (PTR(LetRecExpr) rec = CAST(LetRecExpr)(e)) {
+        // A _fun is a leaf, so wrap() never replaces it with a MemoExpr.
+        PTR(Expr) rhs = wrap(rec->rhs);
+        PTR(Expr) body = wrap(rec->body);
+        if (rhs != rec->rhs || body != rec->body) rebuilt = NEW(LetRecExpr)(rec->var, STATIC_CAST(FunExpr)(rhs), body);
+    } else if (PTR(FunExpr) f = CAST(FunExpr)(e)) {
+        PTR(Expr) body = wrap(f->body);
+        if (body != f->body) rebuilt = NEW(FunExpr)(f->params, body);
+    } else if (PTR(CallExpr) call = CAST(CallExpr)(e)) {
+        PTR(Expr) func = wrap(call->func);
+        bool changed = func != call->func;
+        std::vector<PTR(Expr)> args;
+        for (PTR(Expr) arg : call->args) {
+            args.push_back(wrap(arg));
+            changed = changed || args.back() != arg;
+        }
+        if (changed) rebuilt = NEW(CallExpr)(func, args);
+    }
+    rebuilt->span = e->span;
+
+    if (!is_group) return rebuilt;
+
+    std::vector<Symbol> bound;
+    PTR(Expr) result = rebuilt;
+    if (!is_leaf(e) && is_closed(e, bound)) result = NEW(MemoExpr)(rebuilt, &values_reused);
+    wrapped[e] = result;
+    return result;
+}
@@ -0,0 +1,58 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include "parse.h"
+#include "expr.h"
+#include "val.h"
+#include "env.h"
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+/**
+ * @file incremental.h
+ * @brief Re-parsing and re-evaluation of a script that is being edited.
+ *
+ * A session keeps the parenthesized groups of the previous parse and the
+ * values computed for the closed ones (groups without free variables).
+ * After an edit only the changed text is parsed again, and unchanged closed
+ * groups that evaluated to a number or boolean return their cached value.
+ */
+class IncrementalSession {
+public:
+    /**
+     * @brief Parses the current script text.
+     * @param source The full script text.
+     * @return The parsed expression, sharing unchanged groups with earlier parses.
+     * @throws std::runtime_error If the input string is invalid.
+     */
+    PTR(Expr) parse(const std::string& source);
+
+    /**
+     * @brief Parses and evaluates the current script text.
+     * @param source The full script text.
+     * @return The value of the script.
+     * @throws std::runtime_error If parsing or evaluation fails.
+     */
+    PTR(Val) interp(const std::string& source);
+
+    /** @brief Drops all remembered groups and values. */
+    void reset();
+
+    ParseMemo memo;
+    size_t values_reused = 0;
+
+    /** @brief Environment scripts are evaluated in, e.g. one holding native functions; kept by reset(). */
+    PTR(Env) globals = Env::empty;
+
+private:
+    PTR(Expr) wrap(PTR(Expr) e);
+
+    std::string last_source;
+    PTR(Expr) last_expr;
+    PTR(Val) last_val;
+    std::unordered_set<PTR(Expr)> group_roots;
+    std::unordered_map<PTR(Expr), PTR(Expr)> wrapped;
+};
+
+#endif // INCREMENTAL_H
@@ -0,0 +1,356 @@
+#include "lazy.h"
+#include "env.h"
+#include "eval_context.h"
+#include "val.h"
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+// An unevaluated binding. It is only ever stored in an environment: the
+// variable that looks it up forces it, so values passed on are never
+// thunks. The expression and its environment are dropped once the value
+// is known.
+class ThunkVal : public Val {
+public:
+    PTR(Expr) expr;
+    PTR(Env) env;
+    PTR(Val) value;
+
+    ThunkVal(PTR(Expr) expr, PTR(Env) env) : expr(expr), env(env) {}
+
+    PTR(Val) force(EvalStatus &status) {
+        if (value) return value;
+        EvalCallGuard depth;
+        PTR(Val) v = expr->eval(env, status);
+        if (v) {
+            value = v;
+            expr = nullptr;
+            env = nullptr;
+        }
+        return v;
+    }
+
+    PTR(Val) force() {
+        EvalStatus status;
+        PTR(Val) v = force(status);
+        if (!v) status.raise();
+        return v;
+    }
+
+    PTR(Val) try_add_to(PTR(Val) other_val, EvalStatus &status) override {
+        PTR(Val) v = force(status);
+        return v ? v->try_add_to(other_val, status) : nullptr;
+    }
+    PTR(Val) try_mult_with(PTR(Val) other_val, EvalStatus &status) override {
+        PTR(Val) v = force(status);
+        return v ? v->try_mult_with(other_val, status) : nullptr;
+    }
+    bool equals(PTR(Val) other_val) override { return force()->equals(other_val); }
+    PTR(Expr) to_expr() override { return force()->to_expr(); }
+    std::string to_string() override { return force()->to_string(); }
+    bool is_true() override { return force()->is_true(); }
+};
+
+// What a lazy binding or argument holds: a variable is bound to whatever
+// its name is bound to, thunk or not, without forcing it; anything else
+// becomes a thunk. A free variable also becomes a thunk, so that its error
+// surfaces only if the binding is used.
+PTR(Val) delay(PTR(Expr) e, PTR(Env) env) {
+    if (PTR(VarExpr) var = CAST(VarExpr)(e)) {
+        if (PTR(Val) bound = env->find(var->name)) return bound;
+    }
+    eval_allocated(sizeof(ThunkVal));
+    return NEW(ThunkVal)(e, env);
+}
+
+// A variable that may be bound to a thunk.
+class LazyVarExpr : public VarExpr {
+public:
+    LazyVarExpr(Symbol name) : VarExpr(name) {}
+
+    PTR(Val) eval(PTR(Env) env, EvalStatus &status) override {
+        PTR(Val) v = VarExpr::eval(env, status);
+        if (!v) return nullptr;
+        ThunkVal *thunk = dynamic_cast<ThunkVal*>(RAW(v));
+        return thunk ? thunk->force(status) : v;
+    }
+};
+
+// A _let that binds its right-hand side unevaluated.
+class LazyLetExpr : public LetExpr {
+public:
+    LazyLetExpr(Symbol var, PTR(Expr) rhs, PTR(Expr) body) : LetExpr(var, rhs, body) {
+        may_capture_env = true;
+    }
+
+    PTR(Val) eval(PTR(Env) env, EvalStatus &status) override {
+        PTR(Val) rhs_val = delay(rhs, env);
+        eval_step();
+        eval_allocated(sizeof(ExtendedEnv));
+        PTR(Env) new_env = NEW(ExtendedEnv)(var, rhs_val, env);
+        return body->eval(new_env, status);
+    }
+};
+
+// A call that passes its arguments unevaluated, except those marked
+// strict. Native functions need values, so their arguments are evaluated
+// as in an eager call.
+class LazyCallExpr : public CallExpr {
+public:
+    std::vector<bool> strict;
+
+    LazyCallExpr(PTR(Expr) func, std::vector<PTR(Expr)> args, std::vector<bool> strict)
+        : CallExpr(func, std::move(args)), strict(std::move(strict)) {
+        may_capture_env = true;
+    }
+
+    PTR(Val) eval(PTR(Env) env, EvalStatus &status) override {
+        PTR(Val) func_val = func->eval(env, status);
+        if (!func_val) return nullptr;
+        PTR(FunVal) fun = CAST(FunVal)(func_val);
+        if (!fun && !CAST(NativeFunVal)(func_val)) return fail(status, eval_not_function, "Cannot call non-function value");
+
+        std::vector<PTR(Val)> arg_vals;
+        arg_vals.reserve(args.size());
+        for (size_t i = 0; i < args.size(); i++) {
+            if (fun && !strict[i]) {
+                arg_vals.push_back(delay(args[i], env));
+                continue;
+            }
+            PTR(Val) v = args[i]->eval(env, status);
+            if (!v) return nullptr;
+            arg_vals.push_back(v);
+        }
+
+        PTR(Val) v = fun ? fun->call(std::move(arg_vals), status)
+                         : CAST(NativeFunVal)(func_val)->call(arg_vals, status);
+        if (!v) status.locate(span);
+        return v;
+    }
+
+private:
+    PTR(Val) fail(EvalStatus &status, eval_error_t code, const char *detail) {
+        status.fail(code, detail);
+        status.locate(span);
+        return nullptr;
+    }
+};
+
+// A name in scope while rewriting. A known binding holds a value, never a
+// thunk; fun is the _fun it is bound to, if any.
+struct Binding {
+    Symbol name;
+    bool known;
+    FunExpr *fun;
+};
+typedef std::vector<Binding> Scope;
+
+typedef enum {
+    walk_done,     // Evaluated completely without failing or forcing a thunk.
+    walk_forced,   // Looked up a possible thunk first; index is its binding.
+    walk_blocked   // May fail, loop or skip code before forcing any thunk.
+} walk_t;
+
+bool is_cheap(PTR(Expr) e) {
+    return CAST(NumExpr)(e) || CAST(BoolExpr)(e) || CAST(FunExpr)(e);
+}
+
+// Finds the binding that evaluating e in lazy mode would force first,
+// before anything that can fail, loop or be skipped. It reads the original
+// tree and treats every _let with a costly right-hand side as lazy; a _let
+// that the rewrite keeps eager would evaluate its right-hand side earlier,
+// and the walk then reports walk_blocked for it, which is conservative.
+walk_t first_forced(PTR(Expr) e, Scope &scope, size_t &index) {
+    if (CAST(NumExpr)(e) || CAST(BoolExpr)(e) || CAST(FunExpr)(e)) return walk_done;
+    if (PTR(VarExpr) var = CAST(VarExpr)(e)) {
+        for (size_t i = scope.size(); i-- > 0;) {
+            if (scope[i].name != var->name) continue;
+            if (scope[i].known) return walk_done;
+            index = i;
+            return walk_forced;
+        }
+        return walk_blocked;
+    }
+    walk_t r;
+    if (PTR(AddExpr) add = CAST(AddExpr)(e)) {
+        if ((r = first_forced(add->lhs, scope, index)) != walk_done) return r;
+        if ((r = first_forced(add->rhs, scope, index)) != walk_done) return r;
+        return walk_blocked;
+    }
+    if (PTR(MultExpr) mult = CAST(MultExpr)(e)) {
+        if ((r = first_forced(mult->lhs, scope, index)) != walk_done) return r;
+        if ((r = first_forced(mult->rhs, scope, index)) != walk_done) return r;
+        return walk_blocked;
+    }
+    if (PTR(EqualExpr) eq = CAST(EqualExpr)(e)) {
+        if ((r = first_forced(eq->lhs, scope, index)) != walk_done) return r;
+        return first_forced(eq->rhs, scope, index);
+    }
+    if (PTR(IfExpr) i = CAST(IfExpr)(e)) {
+        if ((r = first_forced(i->condition, scope, index)) != walk_done) return r;
+        return walk_blocked;
+    }
+    if (PTR(CallExpr) call = CAST(CallExpr)(e)) {
+        if ((r = first_forced(call->func, scope, index)) != walk_done) return r;
+        return walk_blocked;
+    }
+
+    size_t outer = scope.size();
+    PTR(Expr) body;
+    if (PTR(LetExpr) let = CAST(LetExpr)(e)) {
+        bool cheap = is_cheap(let->rhs);
+        scope.push_back({let->var, cheap, cheap ? dynamic_cast<FunExpr*>(RAW(let->rhs)) : nullptr});
+        body = let->body;
+    } else if (PTR(LetRecExpr) rec = CAST(LetRecExpr)(e)) {
+        scope.push_back({rec->var, true, RAW(rec->rhs)});
+        body = rec->body;
+    } else {
+        return walk_blocked;
+    }
+    r = first_forced(body, scope, index);
+    scope.resize(outer);
+    // Forcing a binding made inside e may fail.
+    return r == walk_forced && index >= outer ? walk_blocked : r;
+}
+
+class Lazifier {
+public:
+    LazyResult result;
+
+    PTR(Expr) rewrite(PTR(Expr) e) {
+        PTR(Expr) copy = rewrite_node(e);
+        copy->span = e->span;
+        return copy;
+    }
+
+private:
+    Scope scope;
+    std::unordered_map<FunExpr*, long> strict_params;
+
+    const Binding *resolve(Symbol name) const {
+        for (size_t i = scope.size(); i-- > 0;) {
+            if (scope[i].name == name) return &scope[i];
+        }
+        return nullptr;
+    }
+
+    // The parameter that fun's body forces first, or -1.
+    long strict_param(FunExpr *fun) {
+        auto it = strict_params.find(fun);
+        if (it != strict_params.end()) return it->second;
+        Scope params;
+        for (Symbol param : fun->params) params.push_back({param, false, nullptr});
+        size_t index = 0;
+        long param = first_forced(fun->body, params, index) == walk_forced ? static_cast<long>(index) : -1;
+        strict_params[fun] = param;
+        return param;
+    }
+
+    PTR(Expr) rewrite_node(PTR(Expr) e) {
+        if (CAST(NumExpr)(e) || CAST(BoolExpr)(e)) return e;
+        if (PTR(VarExpr) var = CAST(VarExpr)(e)) {
+            const Binding *b = resolve(var->name);
+            if (b && !b->known) return NEW(LazyVarExpr)(var->name);
+            return NEW(VarExpr)(var->name);
+        }
+        // Type-specialized nodes keep their kind: their operands evaluate
+        // to forced values, so the proven types still hold.
+        if (PTR(AddExpr) add = CAST(AddExpr)(e)) {
+            PTR(Expr) lhs = rewrite(add->lhs);
+            PTR(Expr) rhs = rewrite(add->rhs);
+            if (CAST(AddIntExpr)(e)) return NEW(AddIntExpr)(lhs, rhs);
+            return NEW(AddExpr)(lhs, rhs);
+        }
+        if (PTR(MultExpr) mult = CAST(MultExpr)(e)) {
+            PTR(Expr) lhs = rewrite(mult->lhs);
+            PTR(Expr) rhs = rewrite(mult->rhs);
+            if (CAST(MultIntExpr)(e)) return NEW(MultIntExpr)(lhs, rhs);
+            return NEW(MultExpr)(lhs, rhs);
+        }
+        if (PTR(EqualExpr) eq = CAST(EqualExpr)(e)) {
+            PTR(Expr) lhs = rewrite(eq->lhs);
+            PTR(Expr) rhs = rewrite(eq->rhs);
+            if (CAST(EqualIntExpr)(e)) return NEW(EqualIntExpr)(lhs, rhs);
+            if (CAST(EqualBoolExpr)(e)) return NEW(EqualBoolExpr)(lhs, rhs);
+            return NEW(EqualExpr)(lhs, rhs);
+        }
+        if (PTR(IfExpr) i = CAST(IfExpr)(e)) {
+            PTR(Expr) condition = rewrite(i->condition);
+            PTR(Expr) then_branch = rewrite(i->then_branch);
+            PTR(Expr) else_branch = rewrite(i->else_branch);
+            if (CAST(IfBoolExpr)(e)) return NEW(IfBoolExpr)(condition, then_branch, else_branch);
+            return NEW(IfExpr)(condition, then_branch, else_branch);
+        }
+        if (PTR(FunExpr) f = CAST(FunExpr)(e)) {
+            size_t outer = scope.size();
+            for (Symbol param : f->params) scope.push_back({param, false, nullptr});
+            PTR(Expr) body = rewrite(f->body);
+            scope.resize(outer);
+            return NEW(FunExpr)(f->params, body);
+        }
+        if (PTR(LetExpr) let = CAST(LetExpr)(e)) return rewrite_let(let);
+        if (PTR(LetRecExpr) rec = CAST(LetRecExpr)(e)) {
+            scope.push_back({rec->var, true, RAW(rec->rhs)});
+            PTR(Expr) rhs = rewrite(rec->rhs);
+            PTR(Expr) body = rewrite(rec->body);
+            scope.pop_back();
+            return NEW(LetRecExpr)(rec->var, STATIC_CAST(FunExpr)(rhs), body);
+        }
+        if (PTR(CallExpr) call = CAST(CallExpr)(e)) return rewrite_call(call);
+        return e;
+    }
+
+    PTR(Expr) rewrite_let(PTR(LetExpr) let) {
+        PTR(Expr) rhs = rewrite(let->rhs);
+        bool eager = is_cheap(let->rhs);
+        scope.push_back({let->var, eager, eager ? dynamic_cast<FunExpr*>(RAW(let->rhs)) : nullptr});
+        if (!eager) {
+            size_t index = 0;
+            eager = first_forced(let->body, scope, index) == walk_forced && index == scope.size() - 1;
+            scope.back().known = eager;
+        }
+        PTR(Expr) body = rewrite(let->body);
+        scope.pop_back();
+        if (eager) {
+            result.strict_bindings++;
+            return NEW(LetExpr)(let->var, rhs, body);
+        }
+        result.lazy_bindings++;
+        return NEW(LazyLetExpr)(let->var, rhs, body);
+    }
+
+    PTR(Expr) rewrite_call(PTR(CallExpr) call) {
+        // A known _fun of matching arity forces one parameter first; its
+        // argument is evaluated eagerly.
+        long forced = -1;
+        if (PTR(VarExpr) callee = CAST(VarExpr)(call->func)) {
+            const Binding *b = resolve(callee->name);
+            if (b && b->fun && b->fun->params.size() == call->args.size()) forced = strict_param(b->fun);
+        }
+        PTR(Expr) func = rewrite(call->func);
+        std::vector<PTR(Expr)> args;
+        std::vector<bool> strict;
+        for (size_t i = 0; i < call->args.size(); i++) {
+            PTR(Expr) arg = call->args[i];
+            bool eager = static_cast<long>(i) == forced || is_cheap(arg);
+            if (PTR(VarExpr) var = CAST(VarExpr)(arg)) {
+                const Binding *b = resolve(var->name);
+                eager = eager || (b && b->known);
+            }
+            if (eager) result.strict_args++;
+            else result.lazy_args++;
+            args.push_back(rewrite(arg));
+            strict.push_back(eager);
+        }
+        return NEW(LazyCallExpr)(func, std::move(args), std::move(strict));
+    }
+};
+
+} // namespace
+
+LazyResult make_lazy(PTR(Expr) e) {
+    Lazifier lazifier;
+    lazifier.result.expr = lazifier.rewrite(e);
+    return lazifier.result;
+}
@@ -0,0 +1,52 @@
+#ifndef LAZY_H
+#define LAZY_H
+
+#include "expr.h"
+#include <cstddef>
+
+/**
+ * @file lazy.h
+ * @brief Opt-in call-by-need evaluation of _let bindings and call arguments.
+ *
+ * make_lazy() rewrites a tree so that a _let binds, and a call passes, an
+ * unevaluated thunk of its right-hand side or argument. A thunk is
+ * evaluated the first time a variable bound to it is looked up, and its
+ * value is kept for later lookups. A binding that is never used, for
+ * example one only used in an _if branch that is not taken, is never
+ * evaluated, and neither are its errors.
+ *
+ * A strictness analysis keeps eager evaluation where it gives the same
+ * results, errors included, and is cheaper than a thunk:
+ * - numbers, booleans and _funs, which cannot fail, are bound directly;
+ * - a variable is bound to the binding it names without forcing it;
+ * - a _let whose body looks up the variable before anything that can
+ *   fail, loop or be skipped is evaluated eagerly;
+ * - a call of a _let or _letrec bound function evaluates eagerly the
+ *   argument whose parameter the body looks up first in the same sense.
+ *
+ * Apply specialize_types() before make_lazy(), not after. The lazy tree
+ * keeps the specialized arithmetic, comparisons and conditionals, because
+ * their operands still evaluate to values of the proven types; calls
+ * become lazy calls, which check their callee again.
+ *
+ * Forcing a thunk counts as a call for EvalLimits::max_depth, because long
+ * chains of thunks, such as an accumulator that is only read at the end,
+ * force each other recursively.
+ */
+
+struct LazyResult {
+    PTR(Expr) expr;
+    size_t lazy_bindings = 0;    ///< _let bindings that bind a thunk.
+    size_t strict_bindings = 0;  ///< _let bindings still evaluated eagerly.
+    size_t lazy_args = 0;        ///< Call arguments passed as thunks or aliases.
+    size_t strict_args = 0;      ///< Call arguments still evaluated eagerly.
+};
+
+/**
+ * @brief Rewrites a tree for call-by-need evaluation.
+ * @param e The expression; it is not modified.
+ * @return The lazy tree and how many bindings and arguments were made lazy.
+ */
+LazyResult make_lazy(PTR(Expr) e);
+
+#endif // LAZY_H
@@ -0,0 +1,218 @@
+#include "machine.h"
+#include "eval_context.h"
+#include <iterator>
+
+PoolMachine::PoolMachine(const AstPool *pool, NodeId root, PTR(Env) env, Profiler *profiler)
+    : pool(pool->pin()), node(root), env(env), profiler(profiler) {}
+
+bool PoolMachine::run(uint64_t budget) {
+    Profiler::Scope sampling(profiler);
+    try {
+        for (; !done && budget > 0; budget--) {
+            count++;
+            if (!returning) eval_node();
+            else if (frames.empty()) done = true;
+            else return_value();
+        }
+    } catch (...) {
+        unwind_profile();
+        throw;
+    }
+    return done;
+}
+
+// Pops the frames of calls that will not return, so that the profiler
+// can go on to sample other evaluations.
+void PoolMachine::unwind_profile() {
+    for (; profiled > 0; profiled--) profiler->pop();
+}
+
+// The innermost node that fails locates the error, as in AstPool::eval,
+// and the whole evaluation ends there.
+void PoolMachine::fail_at(NodeId n) {
+    eval_status.locate(pool->spans[n]);
+    done = true;
+    value = nullptr;
+    env = nullptr;
+    unwind_profile();
+    frames.clear();
+    values.clear();
+}
+
+// Evaluates node: leaves either a value to return or a frame to come back
+// to and a child to evaluate next.
+void PoolMachine::eval_node() {
+    const AstPool &p = *pool;
+    NodeId n = node;
+    switch (p.kinds[n]) {
+        case pool_num:
+            value = NEW(NumVal)(p.literals[p.a[n]]);
+            break;
+        case pool_bool:
+            value = NEW(BoolVal)(p.a[n] != 0);
+            break;
+        case pool_var:
+            value = env->find(p.symbols[p.a[n]]);
+            if (!value) {
+                eval_status.fail_free_variable(p.symbols[p.a[n]]);
+                fail_at(n);
+                return;
+            }
+            break;
+        case pool_add:
+        case pool_mult:
+        case pool_equal:
+            frames.push_back({k_operand, n, 0, env});
+            node = p.a[n];
+            return;
+        case pool_if:
+            frames.push_back({k_if, n, 0, env});
+            node = p.a[n];
+            return;
+        case pool_let:
+            frames.push_back({k_let, n, 0, env});
+            node = p.b[n];
+            return;
+        case pool_letrec:
+            eval_step();
+            env = p.bind_rec(n, env, pool);
+            node = p.c[n];
+            return;
+        case pool_fun:
+            eval_allocated(sizeof(PoolFunVal));
+            value = NEW(PoolFunVal)(pool, n, env);
+            break;
+        case pool_call:
+            frames.push_back({k_call, n, 0, env});
+            node = p.a[n];
+            return;
+    }
+    returning = true;
+    env = nullptr;
+}
+
+// Hands value to the innermost frame.
+void PoolMachine::return_value() {
+    const AstPool &p = *pool;
+    Frame &f = frames.back();
+    NodeId n = f.n;
+    switch (f.kind) {
+        case k_operand:
+            values.push_back(std::move(value));
+            f.kind = k_binary;
+            env = std::move(f.env);
+            node = p.b[n];
+            returning = false;
+            return;
+        case k_binary: {
+            PTR(Val) lhs_val = std::move(values.back());
+            values.pop_back();
+            frames.pop_back();
+            if (p.kinds[n] == pool_equal) {
+                value = NEW(BoolVal)(lhs_val->equals(value));
+                return;
+            }
+            value = p.kinds[n] == pool_add ? lhs_val->try_add_to(value, eval_status)
+                                           : lhs_val->try_mult_with(value, eval_status);
+            if (!value) fail_at(n);
+            return;
+        }
+        case k_if: {
+            PTR(BoolVal) cond_val = CAST(BoolVal)(value);
+            if (!cond_val) {
+                eval_status.fail(eval_type_error, "Condition must be boolean");
+                fail_at(n);
+                return;
+            }
+            env = std::move(f.env);
+            frames.pop_back();
+            node = cond_val->val ? p.b[n] : p.c[n];
+            value = nullptr;
+            returning = false;
+            return;
+        }
+        case k_let:
+            eval_step();
+            eval_allocated(sizeof(ExtendedEnv));
+            env = NEW(ExtendedEnv)(p.symbols[p.a[n]], value, f.env);
+            frames.pop_back();
+            node = p.c[n];
+            value = nullptr;
+            returning = false;
+            return;
+        case k_call:
+            // A callee that cannot be called fails before its arguments run.
+            if (f.i == 0 && !CAST(PoolFunVal)(value) && !CAST(FunVal)(value) && !CAST(NativeFunVal)(value)) {
+                eval_status.fail(eval_not_function, "Cannot call non-function value");
+                fail_at(n);
+                return;
+            }
+            values.push_back(std::move(value));
+            if (f.i < p.c[n]) {
+                node = p.args[p.b[n] + f.i];
+                f.i++;
+                // The last argument takes the frame's environment.
+                if (f.i < p.c[n]) env = f.env;
+                else env = std::move(f.env);
+                returning = false;
+                return;
+            }
+            apply(n);
+            return;
+        case k_return:
+            // i records whether the call was counted in the context's depth.
+            if (f.i) {
+                if (EvalContext *ctx = EvalContext::current()) ctx->leave_call();
+            }
+            if (profiler) {
+                profiler->pop();
+                profiled--;
+            }
+            frames.pop_back();
+            return;
+    }
+}
+
+// Calls the callee of n with its arguments, which are on top of values.
+// Closures of this pool continue in the machine; anything else is called
+// directly.
+void PoolMachine::apply(NodeId n) {
+    frames.pop_back();
+    uint32_t arg_count = pool->c[n];
+    std::vector<PTR(Val)> arg_vals(std::make_move_iterator(values.end() - arg_count),
+                                   std::make_move_iterator(values.end()));
+    values.resize(values.size() - arg_count);
+    PTR(Val) callee = std::move(values.back());
+    values.pop_back();
+
+    PTR(PoolFunVal) pool_fun = CAST(PoolFunVal)(callee);
+    if (pool_fun && pool_fun->pool == pool) {
+        PTR(Env) frame = pool_fun->bind(std::move(arg_vals), eval_status);
+        if (!frame) {
+            fail_at(n);
+            return;
+        }
+        eval_step();
+        EvalContext *ctx = EvalContext::current();
+        if (ctx) ctx->enter_call();
+        frames.push_back({k_return, n, ctx ? 1u : 0u, nullptr});
+        if (profiler) {
+            profiler->push(pool_fun->profile_label());
+            profiled++;
+        }
+        env = frame;
+        node = pool->c[pool_fun->fun];
+        value = nullptr;
+        returning = false;
+        return;
+    }
+
+    if (pool_fun) {
+        value = pool_fun->call(std::move(arg_vals), eval_status);
+    } else if (PTR(FunVal) fun = CAST(FunVal)(callee)) {
+        value = fun->call(std::move(arg_vals), eval_status);
+    } else {
+        value = STATIC_CAST(NativeFunVal)(callee)->call(arg_vals, eval_status);
+    }
+    if (!value) fail_at(n);
+}
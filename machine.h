@@ -0,0 +1,104 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+
+#include "ast_pool.h"
+#include "env.h"
+#include "eval_status.h"
+#include "profiler.h"
+#include "val.h"
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/**
+ * @file machine.h
+ * @brief Resumable evaluation of an AstPool tree.
+ *
+ * AstPool::eval recurses on the C++ stack, so an evaluation can only stop
+ * by finishing or throwing. A PoolMachine keeps the same evaluation in
+ * explicit state instead: the node being evaluated or the value being
+ * returned, a stack of continuation frames and a stack of intermediate
+ * values. run() makes a bounded number of transitions and returns, and the
+ * next call picks up where it stopped, possibly on another thread.
+ *
+ * Results, errors and their spans match AstPool::eval, and the machine
+ * reports steps, allocations and call depth to the bound EvalContext at
+ * the same points. Calls to closures of other pools, Expr closures and
+ * natives run to completion within one transition. Because the machine
+ * does not recurse, deep MSDscript recursion no longer needs a large
+ * thread stack.
+ *
+ * A machine profiles into the Profiler it was created with, whichever
+ * thread runs it. Its calls stay on that profiler's stack between runs, so
+ * the profiler must not sample any other evaluation until the machine has
+ * finished.
+ */
+class PoolMachine {
+public:
+    /**
+     * @brief Prepares to evaluate the tree rooted at root in env; nothing runs yet.
+     * @param profiler Bound while the machine runs; by default the one bound to the creating thread.
+     */
+    PoolMachine(const AstPool *pool, NodeId root, PTR(Env) env, Profiler *profiler = Profiler::current());
+
+    /**
+     * @brief Makes at most budget transitions.
+     * @return True once the evaluation has finished, with a value or an error.
+     * @throws EvalCancelled, EvalLimitExceeded From the bound EvalContext;
+     * the machine cannot be resumed afterwards.
+     */
+    bool run(uint64_t budget);
+
+    bool finished() const { return done; }
+
+    /** @brief The value, or nullptr if the evaluation failed or has not finished. */
+    PTR(Val) result() const { return value; }
+
+    /** @brief Describes the error of a failed evaluation. */
+    const EvalStatus &status() const { return eval_status; }
+
+    /** @brief Transitions made so far. */
+    uint64_t transitions() const { return count; }
+
+private:
+    typedef enum {
+        k_operand,  ///< The left operand of n is known; evaluate the right one.
+        k_binary,   ///< Both operands of n are known; apply the operator.
+        k_if,       ///< The condition of n is known.
+        k_let,      ///< The right-hand side of n is known; bind it.
+        k_call,     ///< The callee and the first i arguments of n are known.
+        k_return    ///< A closure body has returned.
+    } frame_t;
+
+    struct Frame {
+        frame_t kind;
+        NodeId n;
+        uint32_t i;
+        PTR(Env) env;
+    };
+
+    void eval_node();
+    void return_value();
+    void apply(NodeId n);
+    void fail_at(NodeId n);
+    void unwind_profile();
+
+    std::shared_ptr<const AstPool> pool;  // Pinned for this machine (AstPool::pin).
+    std::vector<Frame> frames;
+    std::vector<PTR(Val)> values;
+
+    // Either node is to be evaluated in env, or value is being returned.
+    bool returning = false;
+    NodeId node;
+    PTR(Env) env;
+    PTR(Val) value;
+
+    bool done = false;
+    uint64_t count = 0;
+    EvalStatus eval_status;
+
+    Profiler *profiler;
+    uint32_t profiled = 0;  // Frames pushed for calls that have not returned.
+};
+
+#endif // MACHINE_H
@@ -1,7 +1,107 @@
 #include <QApplication>
 #include "mainwidget.h"
+#include "server.h"
+#include "parse.h"
+#include "expr.h"
+#include "val.h"
+#include "native.h"
+#include "profiler.h"
+#include "selftest.h"
+#include <QThread>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+// Same stack size and depth limit as the GUI worker, see mainwidget.cpp.
+static const uint PROFILE_STACK_SIZE = 256 * 1024 * 1024;
+static const uint32_t PROFILE_MAX_DEPTH = 100000;
+
+static EvalServer *running_server = nullptr;
+
+static void stop_server(int) {
+    if (running_server) running_server->stop();
+}
+
+// msdscript --server <socket path> [parse cache dir]: serve evaluations
+// over a Unix socket without starting the GUI.
+static int run_server(const char *path, const char *cache_dir) {
+    EvalServer server(path, ServerLimits(), 0, cache_dir ? cache_dir : "");
+    running_server = &server;
+    signal(SIGINT, stop_server);
+    signal(SIGTERM, stop_server);
+    try {
+        server.run();
+    } catch (std::exception &err) {
+        std::cerr << err.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// msdscript --profile <output> <script file>: evaluate a script without
+// the GUI, print its value and write its sampled MSDscript call stacks to
+// output in collapsed form.
+static int run_profile(const char *output, const char *script) {
+    std::ifstream in(script);
+    if (!in) {
+        std::cerr << "cannot read " << script << std::endl;
+        return 1;
+    }
+    std::stringstream source;
+    source << in.rdbuf();
+    std::ofstream out(output);
+    if (!out) {
+        std::cerr << "cannot write " << output << std::endl;
+        return 1;
+    }
+
+    int status = 0;
+    Profiler profiler;
+    QThread *thread = QThread::create([&] {
+        EvalContext context;
+        context.limits.max_depth = PROFILE_MAX_DEPTH;
+        try {
+            PTR(Expr) e = parse_str(source.str());
+            EvalContext::Scope scope(context);
+            Profiler::Scope sampling(&profiler);
+            std::cout << e->interp(NativeRegistry::with_builtins().environment())->to_string() << std::endl;
+        } catch (std::exception &err) {
+            std::cerr << err.what() << std::endl;
+            status = 1;
+        }
+    });
+    thread->setStackSize(PROFILE_STACK_SIZE);
+    thread->start();
+    thread->wait();
+    delete thread;
+
+    profiler.stop();
+    profiler.write_collapsed(out);
+    std::cerr << profiler.samples() << " samples written to " << output << std::endl;
+    return status;
+}
 
 int main(int argc, char *argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "--server") == 0) {
+        if (argc < 3) {
+            std::cerr << "usage: " << argv[0] << " --server <socket path> [parse cache dir]" << std::endl;
+            return 2;
+        }
+        return run_server(argv[2], argc >= 4 ? argv[3] : nullptr);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--selftest") == 0) {
+        return run_self_test(std::cout) == 0 ? 0 : 1;
+    }
+    if (argc >= 2 && strcmp(argv[1], "--profile") == 0) {
+        if (argc < 4) {
+            std::cerr << "usage: " << argv[0] << " --profile <output> <script file>" << std::endl;
+            return 2;
+        }
+        return run_profile(argv[2], argv[3]);
+    }
+
     QApplication app(argc, argv);
 
     app.setStyle("Fusion");
@@ -3,18 +3,49 @@
 #include "expr.h"
 #include "val.h"
 #include "env.h"
+#include "evalworker.h"
 #include <sstream>
 #include <stdexcept>
 #include <QVBoxLayout>
 #include <QHBoxLayout>
 #include <QLabel>
 #include <QMessageBox>
+#include <QDir>
+#include <QFile>
+
+// Deep MSDscript recursion becomes deep C++ recursion, and default
+// secondary-thread stacks are much smaller than the main thread's.
+static const uint WORKER_STACK_SIZE = 256 * 1024 * 1024;
 
 MainWidget::MainWidget(QWidget *parent) : QWidget(parent) {
     setupLayout();
 
+    worker = new EvalWorker;
+    worker->moveToThread(&workerThread);
+    workerThread.setStackSize(WORKER_STACK_SIZE);
+    connect(&workerThread, &QThread::finished, worker, &QObject::deleteLater);
+    connect(this, &MainWidget::evaluationRequested, worker, &EvalWorker::evaluate);
+    connect(worker, &EvalWorker::finished, this, &MainWidget::handleFinished);
+    connect(worker, &EvalWorker::failed, this, &MainWidget::handleFailed);
+    connect(worker, &EvalWorker::cancelled, this, &MainWidget::handleCancelled);
+    connect(worker, &EvalWorker::allocationsMeasured, this, &MainWidget::handleAllocations);
+    connect(worker, &EvalWorker::profiled, this, &MainWidget::handleProfiled);
+    workerThread.start();
+
     connect(submitButton, &QPushButton::clicked, this, &MainWidget::handleSubmit);
     connect(resetButton, &QPushButton::clicked, this, &MainWidget::handleReset);
+    connect(expressionInput, &QTextEdit::textChanged, this, &MainWidget::handleEdit);
+    connect(liveTimer, &QTimer::timeout, this, &MainWidget::handleLiveTimeout);
+    connect(liveCheck, &QCheckBox::toggled, this, &MainWidget::handleEdit);
+    connect(interpRadio, &QRadioButton::toggled, this, &MainWidget::handleEdit);
+    connect(cancelButton, &QPushButton::clicked, this, &MainWidget::handleCancel);
+    connect(progressTimer, &QTimer::timeout, this, &MainWidget::updateProgress);
+}
+
+MainWidget::~MainWidget() {
+    worker->cancel(nextId);
+    workerThread.quit();
+    workerThread.wait();
 }
 
 void MainWidget::setupLayout() {
@@ -37,6 +68,13 @@ void MainWidget::setupLayout() {
     prettyPrintRadio = new QRadioButton("Pretty Print");
     interpRadio->setChecked(true);
 
+    liveCheck = new QCheckBox("Live");
+    profileCheck = new QCheckBox("Profile");
+    profileCheck->setToolTip("Sample the MSDscript call stack and save it for flame graph tools");
+    liveTimer = new QTimer(this);
+    liveTimer->setSingleShot(true);
+    liveTimer->setInterval(300);
+
     QVBoxLayout *radioLayout = new QVBoxLayout;
     radioLayout->addWidget(interpRadio);
     radioLayout->addWidget(prettyPrintRadio);
@@ -47,6 +85,8 @@ void MainWidget::setupLayout() {
 
     QSpacerItem *spacer = new QSpacerItem(40, 20, QSizePolicy::Expanding, QSizePolicy::Minimum);
     chooseLayout->addSpacerItem(spacer);
+    chooseLayout->addWidget(profileCheck);
+    chooseLayout->addWidget(liveCheck);
 
     submitButton = new QPushButton("Submit");
     resetButton = new QPushButton("Reset");
@@ -54,12 +94,31 @@ void MainWidget::setupLayout() {
     submitButton->setFixedSize(70, 30);
     resetButton->setFixedSize(70, 30);
 
+    cancelButton = new QPushButton("Cancel");
+    cancelButton->setFixedSize(70, 30);
+    cancelButton->setEnabled(false);
+
+    progressBar = new QProgressBar;
+    progressBar->setRange(0, 1);
+    progressBar->setTextVisible(false);
+    progressBar->setFixedHeight(12);
+    statusLabel = new QLabel;
+
+    progressTimer = new QTimer(this);
+    progressTimer->setInterval(100);
+
+    QHBoxLayout *runLayout = new QHBoxLayout;
+    runLayout->addWidget(submitButton);
+    runLayout->addWidget(cancelButton);
+    runLayout->addWidget(progressBar);
+    runLayout->addWidget(statusLabel);
+
     QVBoxLayout *layout = new QVBoxLayout;
     layout->addWidget(titleLabel);
     layout->addWidget(expressionLabel);
     layout->addWidget(expressionInput);
     layout->addLayout(chooseLayout);
-    layout->addWidget(submitButton);
+    layout->addLayout(runLayout);
     layout->addWidget(resultsLabel);
     layout->addWidget(resultsOutput);
     layout->addWidget(resetButton);
@@ -69,30 +128,115 @@ void MainWidget::setupLayout() {
 
 
 void MainWidget::handleSubmit() {
-    QString input = expressionInput->toPlainText();
-    std::string result;
-
-    try {
-        PTR(Expr) e = parse_str(input.toStdString());
-
-        if (interpRadio->isChecked()) {
-            result = e->interp(Env::empty)->to_string();
-        } else {
-            // Pretty-print expression
-            std::stringstream ss;
-            std::streampos dummyIndent = 0;
-            e->pretty_print(ss, prec_none, dummyIndent);
-            result = ss.str();
-        }
-
-        resultsOutput->setText(QString::fromStdString(result));
-    } catch (std::runtime_error &err) {
-        QMessageBox::critical(this, "Error", err.what());
+    runExpression(true);
+}
+
+void MainWidget::handleEdit() {
+    if (liveCheck->isChecked()) liveTimer->start();
+}
+
+void MainWidget::handleLiveTimeout() {
+    runExpression(false);
+}
+
+// Hands the script to the worker thread. A newer request supersedes any
+// evaluation still running, which is cancelled.
+void MainWidget::runExpression(bool interactive) {
+    if (pendingId != 0) worker->cancel(pendingId);
+
+    pendingId = ++nextId;
+    pendingInteractive = interactive;
+    setRunning(true);
+    emit evaluationRequested(pendingId, expressionInput->toPlainText(), !interpRadio->isChecked(),
+                             profileCheck->isChecked());
+}
+
+void MainWidget::handleCancel() {
+    if (pendingId != 0) worker->cancel(pendingId);
+}
+
+void MainWidget::handleFinished(quint64 id, const QString &result) {
+    if (id != pendingId) return;
+    pendingId = 0;
+    setRunning(false);
+    resultsOutput->setText(result);
+}
+
+// Interactive runs report errors in a dialog; live runs triggered while
+// typing show them in the results box instead.
+void MainWidget::handleFailed(quint64 id, const QString &message) {
+    if (id != pendingId) return;
+    pendingId = 0;
+    setRunning(false);
+    if (pendingInteractive) {
+        QMessageBox::critical(this, "Error", message);
+    } else {
+        resultsOutput->setText("Error: " + message);
     }
 }
 
+void MainWidget::handleCancelled(quint64 id) {
+    if (id != pendingId) return;
+    pendingId = 0;
+    setRunning(false);
+    statusLabel->setText("Cancelled");
+}
+
+// Arrives after the outcome of the run, so it extends the status line
+// that setRunning(false) wrote; the details go in its tooltip.
+void MainWidget::handleAllocations(quint64 id, const QString &summary, const QString &details) {
+    if (id != nextId || pendingId != 0) return;
+    statusLabel->setText(statusLabel->text() + ", " + summary);
+    statusLabel->setToolTip(details);
+}
+
+// Like handleAllocations, extends the status line of the finished run.
+// Each profiled run overwrites the same file, ready for flamegraph.pl or
+// speedscope.
+void MainWidget::handleProfiled(quint64 id, const QString &collapsed, quint64 samples) {
+    if (id != nextId || pendingId != 0) return;
+    QString path = QDir::temp().filePath("msdscript-profile.folded");
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text)) {
+        statusLabel->setText(statusLabel->text() + ", cannot write " + path);
+        return;
+    }
+    file.write(collapsed.toUtf8());
+    statusLabel->setText(statusLabel->text() + QString(", %1 samples in %2").arg(samples).arg(path));
+}
+
+void MainWidget::setRunning(bool running) {
+    cancelButton->setEnabled(running);
+    if (running) {
+        statusLabel->setToolTip(QString());
+        elapsed.start();
+        progressBar->setRange(0, 0);
+        progressTimer->start();
+        updateProgress();
+    } else {
+        progressTimer->stop();
+        progressBar->setRange(0, 1);
+        progressBar->setValue(1);
+        statusLabel->setText(QString("Done in %1 s").arg(elapsed.elapsed() / 1000.0, 0, 'f', 2));
+    }
+}
+
+void MainWidget::updateProgress() {
+    statusLabel->setText(QString("Running %1 s, %2 steps")
+                         .arg(elapsed.elapsed() / 1000.0, 0, 'f', 1)
+                         .arg(worker->steps()));
+}
+
 void MainWidget::handleReset() {
+    liveTimer->stop();
+    if (pendingId != 0) {
+        worker->cancel(pendingId);
+        pendingId = 0;
+        setRunning(false);
+    }
+    statusLabel->clear();
     expressionInput->clear();
     resultsOutput->clear();
     interpRadio->setChecked(true);
+    QMetaObject::invokeMethod(worker, &EvalWorker::reset, Qt::QueuedConnection);
 }
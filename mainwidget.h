@@ -6,20 +6,43 @@
 #include <QPushButton>
 #include <QTextEdit>
 #include <QRadioButton>
+#include <QCheckBox>
+#include <QLabel>
+#include <QProgressBar>
+#include <QTimer>
+#include <QThread>
+#include <QElapsedTimer>
 #include <QString>
 
+class EvalWorker;
+
 class MainWidget : public QWidget {
     Q_OBJECT
 
 public:
     explicit MainWidget(QWidget *parent = nullptr);
+    ~MainWidget() override;
+
+signals:
+    void evaluationRequested(quint64 id, const QString &source, bool prettyPrint, bool profile);
 
 private slots:
     void handleSubmit();
     void handleReset();
+    void handleEdit();
+    void handleLiveTimeout();
+    void handleCancel();
+    void handleFinished(quint64 id, const QString &result);
+    void handleFailed(quint64 id, const QString &message);
+    void handleCancelled(quint64 id);
+    void handleAllocations(quint64 id, const QString &summary, const QString &details);
+    void handleProfiled(quint64 id, const QString &collapsed, quint64 samples);
+    void updateProgress();
 
 private:
     void setupLayout();
+    void runExpression(bool interactive);
+    void setRunning(bool running);
 
     QTextEdit *expressionInput;
     QTextEdit *resultsOutput;
@@ -27,6 +50,20 @@ private:
     QRadioButton *prettyPrintRadio;
     QPushButton *submitButton;
     QPushButton *resetButton;
+    QPushButton *cancelButton;
+    QCheckBox *liveCheck;
+    QCheckBox *profileCheck;
+    QTimer *liveTimer;
+    QProgressBar *progressBar;
+    QLabel *statusLabel;
+    QTimer *progressTimer;
+
+    QThread workerThread;
+    EvalWorker *worker;
+    QElapsedTimer elapsed;
+    quint64 nextId = 0;
+    quint64 pendingId = 0;
+    bool pendingInteractive = false;
 };
 
 #endif // MAINWIDGET_H
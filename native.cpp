@@ -0,0 +1,80 @@
+#include "native.h"
+#include <stdexcept>
+
+void NativeRegistry::define(Symbol name, std::vector<native_type_t> params, NativeFunVal::Impl impl) {
+    functions[name] = NEW(NativeFunVal)(name, std::move(params), std::move(impl));
+}
+
+void NativeRegistry::define_int(Symbol name, size_t arity, IntImpl impl) {
+    if (arity > MAX_INT_ARITY) throw std::invalid_argument("Too many parameters for native " + name.name());
+    // The call boundary has already checked that every argument is a NumVal.
+    define(name, std::vector<native_type_t>(arity, native_int), [impl](const std::vector<PTR(Val)> &args) -> PTR(Val) {
+        int64_t unboxed[MAX_INT_ARITY];
+        for (size_t i = 0; i < args.size(); i++) unboxed[i] = static_cast<NumVal*>(RAW(args[i]))->val;
+        return NEW(NumVal)(impl(unboxed));
+    });
+}
+
+PTR(Env) NativeRegistry::environment(PTR(Env) rest) const {
+    return NEW(GlobalEnv)(functions, rest);
+}
+
+PTR(Env) NativeRegistry::private_environment(PTR(Env) rest) const {
+    std::unordered_map<Symbol, PTR(Val)> copies;
+    for (auto &entry : functions) {
+        NativeFunVal *f = static_cast<NativeFunVal*>(RAW(entry.second));
+        copies[entry.first] = NEW(NativeFunVal)(f->name, f->params, f->impl);
+    }
+    return NEW(GlobalEnv)(std::move(copies), rest);
+}
+
+static int64_t native_div(const int64_t *args) {
+    if (args[1] == 0) throw std::runtime_error("Division by zero");
+    if (args[0] == INT64_MIN && args[1] == -1) throw std::runtime_error("Division overflow");
+    return args[0] / args[1];
+}
+
+static int64_t native_mod(const int64_t *args) {
+    if (args[1] == 0) throw std::runtime_error("Division by zero");
+    if (args[1] == -1) return 0;
+    return args[0] % args[1];
+}
+
+static int64_t native_powmod(const int64_t *args) {
+    int64_t exp = args[1];
+    int64_t mod = args[2];
+    if (mod <= 0) throw std::runtime_error("powmod: modulus must be positive");
+    if (exp < 0) throw std::runtime_error("powmod: exponent must not be negative");
+
+    __int128 base = args[0] % mod;
+    if (base < 0) base += mod;
+    __int128 result = 1 % mod;
+    while (exp > 0) {
+        if (exp & 1) result = result * base % mod;
+        base = base * base % mod;
+        exp >>= 1;
+    }
+    return static_cast<int64_t>(result);
+}
+
+// Sum of the integers from lo to hi inclusive, 0 if the range is empty.
+static int64_t native_range_sum(const int64_t *args) {
+    int64_t lo = args[0];
+    int64_t hi = args[1];
+    if (hi < lo) return 0;
+    __int128 count = static_cast<__int128>(hi) - lo + 1;
+    __int128 sum = (static_cast<__int128>(lo) + hi) * count / 2;
+    if (sum > INT64_MAX || sum < INT64_MIN) throw std::runtime_error("Addition overflow");
+    return static_cast<int64_t>(sum);
+}
+
+NativeRegistry NativeRegistry::with_builtins() {
+    NativeRegistry registry;
+    registry.define_int("div", 2, native_div);
+    registry.define_int("mod", 2, native_mod);
+    registry.define_int("min", 2, [](const int64_t *args) { return args[0] < args[1] ? args[0] : args[1]; });
+    registry.define_int("max", 2, [](const int64_t *args) { return args[0] > args[1] ? args[0] : args[1]; });
+    registry.define_int("powmod", 3, native_powmod);
+    registry.define_int("range_sum", 2, native_range_sum);
+    return registry;
+}
@@ -0,0 +1,69 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+#include "env.h"
+#include "val.h"
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @file native.h
+ * @brief Binding C++ functions into the environment scripts run in.
+ *
+ * A registry collects native functions by name; environment() turns them
+ * into a GlobalEnv to pass to interp in place of Env::empty. Scripts call
+ * them like any other function: f(x, y).
+ */
+class NativeRegistry {
+public:
+    typedef std::function<int64_t(const int64_t *args)> IntImpl;
+
+    /**
+     * @brief Defines (or replaces) a native function.
+     * @param name The name scripts call it by.
+     * @param params The type each argument is checked against before impl runs.
+     * @param impl The implementation; receives exactly params.size() values.
+     */
+    void define(Symbol name, std::vector<native_type_t> params, NativeFunVal::Impl impl);
+
+    /**
+     * @brief Defines a function from integers to an integer.
+     * @param name The name scripts call it by.
+     * @param arity Number of arguments, at most MAX_INT_ARITY.
+     * @param impl The implementation; receives the unboxed arguments.
+     * @throws std::invalid_argument If arity exceeds MAX_INT_ARITY.
+     */
+    void define_int(Symbol name, size_t arity, IntImpl impl);
+
+    /**
+     * @brief Builds an environment with every defined function.
+     * @param rest Environment consulted for names that are not defined here.
+     */
+    PTR(Env) environment(PTR(Env) rest = Env::empty) const;
+
+    /**
+     * @brief Like environment(), but with its own copy of every function.
+     *
+     * Nothing in it is shared with other environments, so a thread that
+     * evaluates in it never touches a reference count another thread uses.
+     */
+    PTR(Env) private_environment(PTR(Env) rest) const;
+
+    /** @brief True if a function with this name is defined. */
+    bool defines(Symbol name) const { return functions.count(name) != 0; }
+
+    /**
+     * @brief A registry holding the standard library: div, mod, min, max,
+     * powmod and range_sum.
+     */
+    static NativeRegistry with_builtins();
+
+    static const size_t MAX_INT_ARITY = 8;
+
+private:
+    std::unordered_map<Symbol, PTR(Val)> functions;
+};
+
+#endif // NATIVE_H
@@ -9,6 +9,128 @@
 
 using namespace std;
 
+static thread_local ParseMemo *active_memo = nullptr;
+
+// End offset of the last token read, which is where the spans of the
+// nodes that token completes end.
+static thread_local uint32_t token_end = 0;
+
+// Current offset in the source. Peeking at the end of the input sets
+// eofbit and then failbit, after which tellg() would fail; the parser never
+// tests the stream state, so the bits are cleared first.
+static uint32_t offset(istream &in) {
+    in.clear();
+    return static_cast<uint32_t>(in.tellg());
+}
+
+static void end_token(istream &in) {
+    token_end = offset(in);
+}
+
+// Gives e the span from begin to the end of the last token read.
+static PTR(Expr) spanned(PTR(Expr) e, uint32_t begin) {
+    e->span.begin = begin;
+    e->span.end = token_end;
+    return e;
+}
+
+// Multiplier of the polynomial hash of group texts; odd, so that every
+// power of it is odd and no power is lost modulo 2^64.
+static const uint64_t GROUP_HASH_BASE = 1099511628211ULL;
+
+static uint64_t power(uint64_t base, uint32_t exponent) {
+    uint64_t result = 1;
+    for (; exponent > 0; exponent >>= 1) {
+        if (exponent & 1) result *= base;
+        base *= base;
+    }
+    return result;
+}
+
+// Keys every group of s that closes, in one pass: a group's hash is the
+// difference of two prefix hashes, so nested groups are not read again.
+// The kind is left for the caller.
+static void scan_groups(const string &s, unordered_map<uint32_t, ParseMemo::Key> &closed) {
+    vector<pair<uint32_t, uint64_t>> open;  // Offset of each unclosed "(" and the prefix hash before it.
+    uint64_t prefix = 0;
+    for (uint32_t i = 0; i < s.size(); i++) {
+        char c = s[i];
+        if (c == '(') open.emplace_back(i, prefix);
+        prefix = prefix * GROUP_HASH_BASE + static_cast<unsigned char>(c);
+        if (c == ')' && !open.empty()) {
+            uint32_t start = open.back().first;
+            uint32_t length = i + 1 - start;
+            closed[start] = {0, length, prefix - open.back().second * power(GROUP_HASH_BASE, length)};
+            open.pop_back();
+        }
+    }
+}
+
+// Marks a reused group and every group nested inside it as live in the
+// current generation, so edits inside it later can still reuse them, and
+// moves their recorded offsets by shift into the current script.
+static void refresh_group(ParseMemo::Entry *entry, unsigned generation, int64_t shift,
+                          const shared_ptr<const string> &source) {
+    entry->generation = generation;
+    entry->offset = static_cast<uint32_t>(entry->offset + shift);
+    entry->source = source;
+    for (ParseMemo::Entry *nested : entry->nested) refresh_group(nested, generation, shift, source);
+}
+
+static void shift_spans(const vector<PTR(Expr)> &exprs, int64_t shift) {
+    for (PTR(Expr) e : exprs) {
+        visit_nodes(e, [shift](PTR(Expr) node) {
+            node->span.begin = static_cast<uint32_t>(node->span.begin + shift);
+            node->span.end = static_cast<uint32_t>(node->span.end + shift);
+        });
+    }
+}
+
+// Runs parse_group on the group at the current position, or reuses the
+// subtrees parsed for identical text by an earlier incremental parse.
+template <typename F>
+static vector<PTR(Expr)> memo_group(istream &in, char kind, F parse_group) {
+    if (!active_memo) return parse_group(in);
+
+    uint32_t start = offset(in);
+    auto found = active_memo->closed.find(start);
+    if (found == active_memo->closed.end()) return parse_group(in);
+    ParseMemo::Key key = found->second;
+    key.kind = kind;
+
+    auto it = active_memo->groups.find(key);
+    if (it != active_memo->groups.end()) {
+        ParseMemo::Entry *entry = &it->second;
+        // A second occurrence in this parse gets nodes of its own, and a
+        // different text with the same key is not remembered at all.
+        bool duplicate = entry->generation == active_memo->generation && entry->offset != start;
+        bool same = active_memo->source->compare(start, key.length, *entry->source, entry->offset, key.length) == 0;
+        if (duplicate || !same) return parse_group(in);
+        int64_t shift = static_cast<int64_t>(start) - entry->offset;
+        if (shift != 0) shift_spans(entry->exprs, shift);
+        refresh_group(entry, active_memo->generation, shift, active_memo->source);
+        if (!active_memo->open_groups.empty()) active_memo->open_groups.back().push_back(entry);
+        active_memo->hits++;
+        in.clear();
+        in.seekg(start + key.length);
+        end_token(in);
+        return entry->exprs;
+    }
+
+    active_memo->open_groups.emplace_back();
+    vector<PTR(Expr)> e = parse_group(in);
+    ParseMemo::Entry &entry = active_memo->groups[key];
+    entry.exprs = e;
+    entry.source = active_memo->source;
+    entry.offset = start;
+    entry.generation = active_memo->generation;
+    entry.nested = std::move(active_memo->open_groups.back());
+    active_memo->open_groups.pop_back();
+    if (!active_memo->open_groups.empty()) active_memo->open_groups.back().push_back(&entry);
+    active_memo->misses++;
+    return e;
+}
+
 void consume(istream &in, int expect) {
     if (in.get() != expect) {
         throw runtime_error("consume mismatch");
@@ -23,6 +145,7 @@ void skip_whitespace(istream &in) {
 
 PTR(Expr) parse_num(istream &in) {
     skip_whitespace(in);
+    uint32_t begin = offset(in);
     string num_str;
     bool negative = false;
 
@@ -39,11 +162,13 @@ PTR(Expr) parse_num(istream &in) {
         throw runtime_error("invalid number format");
     }
 
-    return NEW(NumExpr)(stoi(num_str));
+    end_token(in);
+    return spanned(NEW(NumExpr)(stoi(num_str)), begin);
 }
 
 PTR(Expr) parse_var(istream &in) {
     skip_whitespace(in);
+    uint32_t begin = offset(in);
     string var_name;
 
     if (!isalpha(in.peek())) throw runtime_error("Invalid variable name");
@@ -52,7 +177,8 @@ PTR(Expr) parse_var(istream &in) {
         var_name += static_cast<char>(in.get());
     }
 
-    return NEW(VarExpr)(var_name);
+    end_token(in);
+    return spanned(NEW(VarExpr)(var_name), begin);
 }
 
 PTR(Expr) parse_fun(istream &in) {
@@ -65,45 +191,65 @@ PTR(Expr) parse_fun(istream &in) {
     consume(in, '(');
     skip_whitespace(in);
 
-    string var;
-    while (isalnum(in.peek()) || in.peek() == '_') {
-        var += static_cast<char>(in.get());
+    // Comma-separated parameter names, possibly none
+    vector<Symbol> params;
+    if (in.peek() != ')') {
+        while (true) {
+            string var;
+            while (isalnum(in.peek()) || in.peek() == '_') {
+                var += static_cast<char>(in.get());
+            }
+            if (var.empty()) throw runtime_error("Expected parameter name");
+            params.push_back(var);
+
+            skip_whitespace(in);
+            if (in.peek() != ',') break;
+            consume(in, ',');
+            skip_whitespace(in);
+        }
     }
 
-    skip_whitespace(in);
     if (in.peek() != ')') {
         throw runtime_error("Expected ')' after parameter");
     }
     consume(in, ')');
 
     PTR(Expr) body = parse_expr(in);
-    return NEW(FunExpr)(var, body);
+    return NEW(FunExpr)(params, body);
 }
 
 PTR(Expr) parse_keyword(istream &in) {
+    uint32_t begin = offset(in);
     consume(in, '_');
     string keyword;
     while (isalpha(in.peek())) keyword += static_cast<char>(in.get());
+    end_token(in);
 
-    if (keyword == "true") return NEW(BoolExpr)(true);
-    if (keyword == "false") return NEW(BoolExpr)(false);
-    if (keyword == "let") return parse_let(in);
-    if (keyword == "if") return parse_if(in);
-    if (keyword == "fun") return parse_fun(in);
+    if (keyword == "true") return spanned(NEW(BoolExpr)(true), begin);
+    if (keyword == "false") return spanned(NEW(BoolExpr)(false), begin);
+    if (keyword == "let") return spanned(parse_let(in), begin);
+    if (keyword == "letrec") return spanned(parse_letrec(in), begin);
+    if (keyword == "if") return spanned(parse_if(in), begin);
+    if (keyword == "fun") return spanned(parse_fun(in), begin);
 
     throw runtime_error("Unknown keyword: _" + keyword);
 }
 
 PTR(Expr) parse_multicand(istream &in) {
     skip_whitespace(in);
+    uint32_t begin = offset(in);
     int c = in.peek();
     PTR(Expr) e;
 
     if (c == '(') {
-        consume(in, '(');
-        e = parse_expr(in);
-        skip_whitespace(in);
-        consume(in, ')');
+        e = memo_group(in, 'g', [](istream &in) {
+            consume(in, '(');
+            PTR(Expr) inner = parse_expr(in);
+            skip_whitespace(in);
+            consume(in, ')');
+            end_token(in);
+            return vector<PTR(Expr)>{inner};
+        })[0];
     } else if (isdigit(c) || c == '-') {
         e = parse_num(in);
     } else if (isalpha(c)) {
@@ -117,22 +263,36 @@ PTR(Expr) parse_multicand(istream &in) {
     while (true) {
         skip_whitespace(in);
         if (in.peek() != '(') break;
-        consume(in, '(');
-        PTR(Expr) actual_arg = (in.peek() == ')') ? NEW(NumExpr)(0) : parse_expr(in);
-        consume(in, ')');
-        e = NEW(CallExpr)(e, actual_arg);
+        vector<PTR(Expr)> actual_args = memo_group(in, 'a', [](istream &in) {
+            consume(in, '(');
+            skip_whitespace(in);
+            vector<PTR(Expr)> args;
+            if (in.peek() != ')') {
+                args.push_back(parse_expr(in));
+                while (in.peek() == ',') {
+                    consume(in, ',');
+                    args.push_back(parse_expr(in));
+                }
+            }
+            consume(in, ')');
+            end_token(in);
+            return args;
+        });
+        e = spanned(NEW(CallExpr)(e, actual_args), begin);
     }
 
     return e;
 }
 
 PTR(Expr) parse_multend(istream &in) {
+    skip_whitespace(in);
+    uint32_t begin = offset(in);
     PTR(Expr) e = parse_multicand(in);
     while (true) {
         skip_whitespace(in);
         if (in.peek() == '*') {
             consume(in, '*');
-            e = NEW(MultExpr)(e, parse_multicand(in));
+            e = spanned(NEW(MultExpr)(e, parse_multicand(in)), begin);
         } else {
             break;
         }
@@ -141,12 +301,14 @@ PTR(Expr) parse_multend(istream &in) {
 }
 
 PTR(Expr) parse_addend(istream &in) {
+    skip_whitespace(in);
+    uint32_t begin = offset(in);
     PTR(Expr) e = parse_multend(in);
     while (true) {
         skip_whitespace(in);
         if (in.peek() == '+') {
             consume(in, '+');
-            e = NEW(AddExpr)(e, parse_multend(in));
+            e = spanned(NEW(AddExpr)(e, parse_multend(in)), begin);
         } else {
             break;
         }
@@ -155,12 +317,14 @@ PTR(Expr) parse_addend(istream &in) {
 }
 
 PTR(Expr) parse_comparison(istream &in) {
+    skip_whitespace(in);
+    uint32_t begin = offset(in);
     PTR(Expr) e = parse_addend(in);
     skip_whitespace(in);
     if (in.peek() == '=') {
         consume(in, '=');
         if (in.get() != '=') throw runtime_error("Expected ==");
-        return NEW(EqualExpr)(e, parse_comparison(in));
+        return spanned(NEW(EqualExpr)(e, parse_comparison(in)), begin);
     }
     return e;
 }
@@ -176,6 +340,30 @@ PTR(Expr) parse_str(const string &s) {
     return parse_expr(in);
 }
 
+PTR(Expr) parse_str_incremental(const string &s, ParseMemo &memo) {
+    struct ActiveMemo {
+        ParseMemo *saved;
+        explicit ActiveMemo(ParseMemo *m) : saved(active_memo) { active_memo = m; }
+        ~ActiveMemo() { active_memo = saved; }
+    } scope(&memo);
+
+    memo.generation++;
+    memo.open_groups.clear();
+    memo.hits = 0;
+    memo.misses = 0;
+    memo.source = make_shared<const string>(s);
+    memo.closed.clear();
+    scan_groups(s, memo.closed);
+    PTR(Expr) e = parse_str(s);
+    memo.closed.clear();
+
+    for (auto it = memo.groups.begin(); it != memo.groups.end();) {
+        if (it->second.generation != memo.generation) it = memo.groups.erase(it);
+        else ++it;
+    }
+    return e;
+}
+
 PTR(Expr) parse_let(istream &in) {
     skip_whitespace(in);
     string var;
@@ -200,6 +388,32 @@ PTR(Expr) parse_let(istream &in) {
     return NEW(LetExpr)(var, rhs, body);
 }
 
+PTR(Expr) parse_letrec(istream &in) {
+    skip_whitespace(in);
+    string var;
+
+    while (isalnum(in.peek()) || in.peek() == '_') {
+        var += static_cast<char>(in.get());
+    }
+    if (var.empty()) throw runtime_error("Expected variable after _letrec");
+
+    skip_whitespace(in);
+    consume(in, '=');
+
+    // Only a function can refer to itself before it has a value
+    PTR(FunExpr) rhs = CAST(FunExpr)(parse_expr(in));
+    if (!rhs) throw runtime_error("_letrec requires a _fun");
+
+    skip_whitespace(in);
+    consume(in, '_');
+    string in_kw;
+    while (isalpha(in.peek())) in_kw += static_cast<char>(in.get());
+    if (in_kw != "in") throw runtime_error("Expected _in");
+
+    PTR(Expr) body = parse_expr(in);
+    return NEW(LetRecExpr)(var, rhs, body);
+}
+
 PTR(Expr) parse_if(istream &in) {
     PTR(Expr) cond = parse_expr(in);
 
@@ -5,6 +5,9 @@
 #include <stdio.h>
 #include <string>
 #include <istream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 
 /**
  * @file parse.hpp
@@ -62,6 +65,15 @@ PTR(Expr) parse_var(std::istream &in);
  */
 PTR(Expr) parse_let(std::istream &in);
 
+/**
+ * @brief Parses a recursive let expression from an input stream.
+ * @param in The input stream to parse.
+ * @return A pointer to the parsed LetRecExpr expression.
+ * @throws std::runtime_error If the input is not a valid _letrec or its
+ *         right-hand side is not a _fun.
+ */
+PTR(Expr) parse_letrec(std::istream &in);
+
 /**
  * @brief Parses an additive expression (e.g., x + y) from an input stream.
  * @param in The input stream to parse.
@@ -97,4 +109,62 @@ PTR(Expr) parse_comparg(std::istream &in);
 PTR(Expr) parse_fun(std::istream &in);
 PTR(Expr) parse_call(std::istream &in);
 
+/**
+ * @brief Remembers the subtrees parsed for parenthesized groups so that a
+ * later parse of an edited script can reuse every group whose text is unchanged.
+ *
+ * A group's parse depends only on its own text. Groups are keyed by the
+ * length and hash of their text, which one pass over the script computes
+ * for every group, and a hit is confirmed by comparing the text with the
+ * script the entry was parsed from.
+ * A parenthesized expression yields one subtree and a call's argument list
+ * one per argument. Entries not seen during the most recent parse are dropped.
+ * A reused group that moved has its source spans shifted to the new offset;
+ * a text that occurs twice in one parse is parsed again for the second
+ * occurrence, so no node appears at two places of a tree.
+ */
+class ParseMemo {
+public:
+    struct Key {
+        char kind;        ///< 'g' for a parenthesized expression, 'a' for an argument list.
+        uint32_t length;  ///< Of the text, parentheses included.
+        uint64_t hash;
+
+        bool operator==(const Key &other) const {
+            return kind == other.kind && length == other.length && hash == other.hash;
+        }
+        struct Hash {
+            size_t operator()(const Key &k) const { return static_cast<size_t>(k.hash ^ k.kind); }
+        };
+    };
+
+    struct Entry {
+        std::vector<PTR(Expr)> exprs;
+        std::shared_ptr<const std::string> source;  ///< The script of the parse that last used it.
+        uint32_t offset;  ///< Source offset of the group in that script.
+        unsigned generation;
+        std::vector<Entry*> nested;
+    };
+
+    std::unordered_map<Key, Entry, Key::Hash> groups;
+    std::vector<std::vector<Entry*>> open_groups;
+    // The script being parsed, and the key of each group in it that
+    // closes, by the offset of its "(".
+    std::shared_ptr<const std::string> source;
+    std::unordered_map<uint32_t, Key> closed;
+    unsigned generation = 0;
+    size_t hits = 0;
+    size_t misses = 0;
+};
+
+/**
+ * @brief Parses an expression from a string, reusing unchanged groups from a memo.
+ * @param s The input string to parse.
+ * @param memo Groups from previous parses; updated with the groups of this one.
+ * @return A pointer to the parsed expression. Unchanged groups are the same
+ *         Expr objects as in the previous parse.
+ * @throws std::runtime_error If the input string is invalid.
+ */
+PTR(Expr) parse_str_incremental(const std::string &s, ParseMemo &memo);
+
 #endif // PARSE_HPP
@@ -8,16 +8,41 @@
 # define NEW(T)    new T
 # define PTR(T)    T*
 # define CAST(T)   dynamic_cast<T*>
+# define STATIC_CAST(T) static_cast<T*>
 # define CLASS(T)  class T
 # define THIS      this
+# define WEAK(T)   T*
+# define RAW(P)    (P)
+# define EXPIRED(W) false
+# define LOCK(W)   (W)
+# define UNOWNED(T) static_cast<T*>
 
 #else
 
-# define NEW(T)    std::make_shared<T>
+# ifdef MSD_TRACK_ALLOCATIONS
+#  include "alloc_tracking.h"
+#  define NEW(T)   make_tracked<T>
+# else
+#  define NEW(T)   std::make_shared<T>
+# endif
 # define PTR(T)    std::shared_ptr<T>
 # define CAST(T)   std::dynamic_pointer_cast<T>
+# define STATIC_CAST(T) std::static_pointer_cast<T>
 # define CLASS(T)  class T : public std::enable_shared_from_this<T>
 # define THIS      shared_from_this()
+# define WEAK(T)   std::weak_ptr<T>
+# define RAW(P)    (P).get()
+# define EXPIRED(W) (W).expired()
+# define LOCK(W)   (W).lock()
+# define UNOWNED(T) unowned_ptr<T>
+
+// A pointer to an object that its creator keeps alive, such as a local
+// variable. It has no control block, so copying it touches no reference
+// count; nothing may keep a copy past the object's lifetime.
+template <class T>
+std::shared_ptr<T> unowned_ptr(T *p) {
+    return std::shared_ptr<T>(std::shared_ptr<T>(), p);
+}
 
 #endif
 
@@ -0,0 +1,96 @@
+#include "profiler.h"
+#include <sstream>
+#include <unordered_map>
+
+namespace {
+
+std::mutex label_mutex;
+std::unordered_map<std::string, uint32_t> label_ids;
+// Id 0 stands for the frames beyond MAX_PROFILE_DEPTH.
+std::vector<std::string> label_texts{"..."};
+
+std::string label_text(uint32_t label) {
+    std::lock_guard<std::mutex> lock(label_mutex);
+    return label < label_texts.size() ? label_texts[label] : "?";
+}
+
+} // namespace
+
+uint32_t intern_profile_label(const std::string &text) {
+    std::lock_guard<std::mutex> lock(label_mutex);
+    auto it = label_ids.find(text);
+    if (it != label_ids.end()) return it->second;
+    uint32_t label = static_cast<uint32_t>(label_texts.size());
+    label_texts.push_back(text);
+    label_ids.emplace(text, label);
+    return label;
+}
+
+thread_local Profiler *Profiler::bound = nullptr;
+
+Profiler::Scope::Scope(Profiler *profiler) : saved(bound), profiler(profiler) {
+    bound = profiler;
+    if (profiler) was_active = profiler->active.exchange(true, std::memory_order_acq_rel);
+}
+
+Profiler::Scope::~Scope() {
+    if (profiler) profiler->active.store(was_active, std::memory_order_release);
+    bound = saved;
+}
+
+Profiler::Profiler(std::chrono::microseconds interval) : interval(interval) {
+    sampler = std::thread(&Profiler::run, this);
+}
+
+Profiler::~Profiler() {
+    stop();
+}
+
+void Profiler::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (sampler.joinable()) sampler.join();
+}
+
+void Profiler::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!wake.wait_for(lock, interval, [this] { return stopping; })) {
+        if (active.load(std::memory_order_acquire)) sample();
+    }
+}
+
+// Runs on the sampler thread with the mutex held.
+void Profiler::sample() {
+    uint32_t d = depth.load(std::memory_order_acquire);
+    std::vector<uint32_t> stack;
+    stack.reserve(d < MAX_PROFILE_DEPTH ? d : MAX_PROFILE_DEPTH + 1);
+    for (uint32_t i = 0; i < d && i < MAX_PROFILE_DEPTH; i++) {
+        stack.push_back(frames[i].load(std::memory_order_relaxed));
+    }
+    if (d > MAX_PROFILE_DEPTH) stack.push_back(0);
+    counts[stack]++;
+    total++;
+}
+
+uint64_t Profiler::samples() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return total;
+}
+
+std::string Profiler::collapsed() const {
+    std::stringstream ss;
+    write_collapsed(ss);
+    return ss.str();
+}
+
+void Profiler::write_collapsed(std::ostream &os) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &entry : counts) {
+        os << "script";
+        for (uint32_t label : entry.first) os << ";" << label_text(label);
+        os << " " << entry.second << "\n";
+    }
+}
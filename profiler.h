@@ -0,0 +1,144 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @file profiler.h
+ * @brief Sampling profiler over MSDscript functions.
+ *
+ * A C++ profiler only shows the interpreter recursing through its own
+ * nodes. Instead, while a Profiler is bound to the evaluating thread, every
+ * closure and native call pushes a label onto the profiler's shadow stack,
+ * whether it runs as an Expr, from an AstPool or in a PoolMachine.
+ * The label names the function by the _let or _letrec variable it is bound
+ * to, plus its source span. A sampler thread reads that stack at a fixed
+ * interval and counts each distinct stack. collapsed() returns the counts
+ * in the folded format that flamegraph.pl, inferno and speedscope read.
+ *
+ * Without a bound profiler, a call costs one thread-local load.
+ */
+
+/** @brief Frames kept per stack; deeper frames are counted as a single "..." frame. */
+const uint32_t MAX_PROFILE_DEPTH = 512;
+
+/**
+ * @brief Interns a frame label and returns its id, which is never 0.
+ *
+ * Labels live for the life of the process, so ids stay valid after the
+ * function they name is gone. Interning is thread-safe.
+ */
+uint32_t intern_profile_label(const std::string &text);
+
+class Profiler {
+public:
+    /**
+     * @brief Binds a profiler to the current thread until the scope ends.
+     *
+     * Samples are only taken while a scope is active. Scopes nest: the
+     * end of one restores the binding and sampling state it replaced. A
+     * null profiler turns profiling off for the scope.
+     */
+    class Scope {
+    public:
+        explicit Scope(Profiler *profiler);
+        ~Scope();
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    private:
+        Profiler *saved;
+        Profiler *profiler;
+        bool was_active = false;
+    };
+
+    /** @brief Starts sampling every interval. */
+    explicit Profiler(std::chrono::microseconds interval = std::chrono::milliseconds(1));
+    /** @brief Stops sampling; the scope binding it must have ended. */
+    ~Profiler();
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    /** @brief The profiler bound to the calling thread, or nullptr. */
+    static Profiler *current() { return bound; }
+
+    /** @brief Stops the sampler thread; the counts stay readable. */
+    void stop();
+
+    /** @brief Samples taken so far. */
+    uint64_t samples() const;
+
+    /**
+     * @brief One line per distinct stack, "script;outer;inner count".
+     *
+     * Frames run from the outermost call to the innermost, under a "script"
+     * root that also collects samples taken outside any call.
+     */
+    std::string collapsed() const;
+    void write_collapsed(std::ostream &os) const;
+
+    /** @brief Called by the evaluating thread only, through ProfileFrame. */
+    void push(uint32_t label) {
+        uint32_t d = depth.load(std::memory_order_relaxed);
+        if (d < MAX_PROFILE_DEPTH) frames[d].store(label, std::memory_order_relaxed);
+        depth.store(d + 1, std::memory_order_release);
+    }
+
+    void pop() {
+        depth.store(depth.load(std::memory_order_relaxed) - 1, std::memory_order_release);
+    }
+
+private:
+    static thread_local Profiler *bound;
+
+    void run();
+    void sample();
+
+    // Written by the evaluating thread and read by the sampler without a
+    // lock. A sample that races with a call or return may mix the stacks
+    // before and after it; at worst that misplaces one sample.
+    std::atomic<uint32_t> depth{0};
+    std::atomic<uint32_t> frames[MAX_PROFILE_DEPTH] = {};
+    std::atomic<bool> active{false};
+
+    std::chrono::microseconds interval;
+    std::thread sampler;
+
+    // Guards stopping and the counts.
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::map<std::vector<uint32_t>, uint64_t> counts;
+    uint64_t total = 0;
+};
+
+/**
+ * @brief Pushes one call onto the thread's profiler, if any, for its lifetime.
+ *
+ * The callee only has to provide profile_label(), which is only called
+ * while profiling.
+ */
+class ProfileFrame {
+public:
+    template <class Callee>
+    explicit ProfileFrame(Callee *callee) : profiler(Profiler::current()) {
+        if (profiler) profiler->push(callee->profile_label());
+    }
+    ~ProfileFrame() {
+        if (profiler) profiler->pop();
+    }
+    ProfileFrame(const ProfileFrame&) = delete;
+    ProfileFrame& operator=(const ProfileFrame&) = delete;
+private:
+    Profiler *profiler;
+};
+
+#endif // PROFILER_H
@@ -0,0 +1,138 @@
+#include "scheduler.h"
+#include "env.h"
+#include <algorithm>
+
+// The scheduler whose done callback this thread is running, if any.
+static thread_local const Scheduler *calling_back = nullptr;
+
+Scheduler::Task::Task(TaskId id, const Program &program, PTR(Env) env, Callback done, uint64_t stride, Profiler *profiler)
+    : id(id), program(program), machine(&program.pool(), program.root(), env, profiler), done(std::move(done)), stride(stride) {}
+
+Scheduler::Scheduler(const Engine &engine, size_t threads, uint64_t slice)
+    : globals(engine.natives.environment()), slice(slice) {
+    for (size_t i = 0; i < threads; i++) workers.emplace_back(&Scheduler::work, this);
+}
+
+Scheduler::~Scheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    ready_cv.notify_all();
+    for (std::thread &worker : workers) worker.join();
+}
+
+TaskId Scheduler::submit(const Program &program, const Context::Bindings &bindings, Callback done,
+                         uint32_t priority, const EvalLimits &limits, Profiler *profiler) {
+    PTR(Env) env = globals;
+    for (const auto &binding : bindings) env = NEW(ExtendedEnv)(binding.first, binding.second, env);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    TaskId id = next_id++;
+    // Priorities above STRIDE would give a stride of 0, and such a task
+    // would never let another run.
+    uint64_t stride = STRIDE / std::min<uint64_t>(std::max<uint32_t>(priority, 1), STRIDE);
+    std::unique_ptr<Task> task(new Task(id, program, env, std::move(done), stride, profiler));
+    task->context.limits = limits;
+    task->context.reset();
+    task->pass = virtual_time;
+    ready.emplace(std::make_pair(task->pass, id), task.get());
+    tasks.emplace(id, std::move(task));
+    ready_cv.notify_one();
+    return id;
+}
+
+void Scheduler::cancel(TaskId id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = tasks.find(id);
+    if (it != tasks.end()) it->second->context.cancel();
+}
+
+void Scheduler::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    // A callback that waits is not waited for, or two of them would wait
+    // for each other.
+    bool nested = calling_back == this;
+    if (nested) {
+        waiting_callbacks++;
+        idle_cv.notify_all();
+    }
+    idle_cv.wait(lock, [this] { return tasks.empty() && callbacks == waiting_callbacks; });
+    if (nested) waiting_callbacks--;
+}
+
+size_t Scheduler::pending() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return tasks.size();
+}
+
+void Scheduler::work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        ready_cv.wait(lock, [this] { return stopping || !ready.empty(); });
+        if (stopping) return;
+        Task *task = ready.begin()->second;
+        ready.erase(ready.begin());
+        virtual_time = task->pass;
+        lock.unlock();
+
+        bool finished = false;
+        TaskResult result = run_slice(*task, finished);
+
+        lock.lock();
+        if (finished) {
+            // The task leaves the table before done runs, so done may
+            // submit more tasks or wait for the others.
+            auto it = tasks.find(task->id);
+            std::unique_ptr<Task> owned = std::move(it->second);
+            tasks.erase(it);
+            callbacks++;
+            lock.unlock();
+            calling_back = this;
+            owned->done(result);
+            calling_back = nullptr;
+            owned.reset();
+            lock.lock();
+            callbacks--;
+            idle_cv.notify_all();
+        } else {
+            task->pass += task->stride;
+            ready.emplace(std::make_pair(task->pass, task->id), task);
+        }
+    }
+}
+
+// Runs one slice of task on this thread; the result is only meaningful
+// once finished is set.
+TaskResult Scheduler::run_slice(Task &task, bool &finished) {
+    TaskResult result;
+    result.id = task.id;
+    task.slices++;
+    try {
+        EvalContext::Scope scope(task.context);
+        finished = task.machine.run(slice);
+        if (finished) {
+            result.value = task.machine.result();
+            if (!result.value) {
+                result.outcome = task_failed;
+                result.error = task.machine.status().message();
+                result.span = task.machine.status().span;
+            }
+        }
+    } catch (EvalCancelled &err) {
+        finished = true;
+        result.outcome = task_cancelled;
+        result.error = err.what();
+    } catch (EvalLimitExceeded &err) {
+        finished = true;
+        result.outcome = task_limit_exceeded;
+        result.error = err.what();
+    } catch (std::exception &err) {
+        finished = true;
+        result.outcome = task_failed;
+        result.error = err.what();
+    }
+    result.steps = task.context.steps();
+    result.slices = task.slices;
+    return result;
+}
@@ -0,0 +1,147 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "engine.h"
+#include "eval_context.h"
+#include "machine.h"
+#include "profiler.h"
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * @file scheduler.h
+ * @brief Time-sliced evaluation of many scripts on a few threads.
+ *
+ * Each submitted evaluation runs as a PoolMachine. A worker picks a task,
+ * runs it for one slice of machine transitions, and puts it back in the
+ * queue unless it finished. Slices are handed out by stride scheduling:
+ * every task has a pass value that grows by STRIDE / priority each time
+ * it runs, and the task with the lowest pass runs next. Tasks of equal
+ * priority therefore take turns, a task of priority 3 gets three slices
+ * for every one of a priority 1 task, and a new task starts at the pass of
+ * the task that last ran, so it gets its first slice within one round
+ * instead of waiting behind long scripts.
+ *
+ * A slice is measured in PoolMachine::run transitions, not in the
+ * reductions EvalContext counts as steps: a transition visits one node or
+ * returns one value to its parent, so a reduction takes several, and a
+ * call to a native or to a closure the machine cannot step runs whole
+ * within one. How many reductions fit in a slice depends on the script.
+ *
+ * Tasks move between worker threads from one slice to the next, so they
+ * share the engine's natives and the usual reference counting.
+ */
+
+typedef uint64_t TaskId;
+
+typedef enum {
+    task_done,            ///< The script returned a value.
+    task_failed,          ///< A script error; see error and span.
+    task_cancelled,
+    task_limit_exceeded   ///< One of the task's EvalLimits was exceeded.
+} task_outcome_t;
+
+struct TaskResult {
+    TaskId id = 0;
+    task_outcome_t outcome = task_done;
+    PTR(Val) value;         ///< Set when outcome is task_done.
+    std::string error;      ///< The message for every other outcome.
+    SourceSpan span;        ///< Of the failing node, for task_failed.
+    uint64_t steps = 0;     ///< Reductions, as counted by EvalContext.
+    uint32_t slices = 0;    ///< Times a worker ran the task.
+};
+
+class Scheduler {
+public:
+    typedef std::function<void(const TaskResult &result)> Callback;
+
+    /** @brief Machine transitions per slice unless the constructor is given another. */
+    static const uint64_t DEFAULT_SLICE = 10000;
+
+    /** @brief Pass increment of a priority 1 task. */
+    static constexpr uint64_t STRIDE = 1 << 20;
+
+    /**
+     * @brief Starts the worker threads.
+     * @param engine Provides the natives; must outlive the scheduler.
+     * @param threads Number of worker threads.
+     * @param slice Machine transitions a task runs before the next task gets a turn.
+     */
+    Scheduler(const Engine &engine, size_t threads, uint64_t slice = DEFAULT_SLICE);
+
+    /** @brief Stops the workers; tasks that have not finished are dropped without a callback. */
+    ~Scheduler();
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    /**
+     * @brief Queues an evaluation of program.
+     * @param bindings Values of the program's free variables.
+     * @param done Called once on a worker thread when the task ends, whatever the outcome.
+     * @param priority Relative share of slices; 0 counts as 1, and values above STRIDE as STRIDE.
+     * @param limits Limits for the whole task. Its time limit counts from submission, including time spent waiting.
+     * @param profiler Samples the task's calls; it must sample nothing else until the task ends.
+     */
+    TaskId submit(const Program &program, const Context::Bindings &bindings, Callback done,
+                  uint32_t priority = 1, const EvalLimits &limits = EvalLimits(), Profiler *profiler = nullptr);
+
+    /** @brief Cancels a task; it ends with task_cancelled the next time it runs. */
+    void cancel(TaskId id);
+
+    /**
+     * @brief Blocks until every submitted task has ended.
+     *
+     * A task has ended once its done callback has returned. A callback
+     * may itself call wait, as long as other workers are left to finish
+     * the remaining tasks; it then returns without waiting for callbacks
+     * that are also blocked in wait.
+     */
+    void wait();
+
+    /** @brief Tasks submitted that have not ended yet. */
+    size_t pending() const;
+
+private:
+    struct Task {
+        TaskId id;
+        Program program;
+        PoolMachine machine;
+        EvalContext context;
+        Callback done;
+        uint64_t stride;
+        uint64_t pass = 0;
+        uint32_t slices = 0;
+
+        Task(TaskId id, const Program &program, PTR(Env) env, Callback done, uint64_t stride, Profiler *profiler);
+    };
+
+    void work();
+    TaskResult run_slice(Task &task, bool &finished);
+
+    PTR(Env) globals;
+    uint64_t slice;
+    std::vector<std::thread> workers;
+
+    // Guards everything below.
+    mutable std::mutex mutex;
+    std::condition_variable ready_cv;
+    std::condition_variable idle_cv;
+    bool stopping = false;
+    size_t callbacks = 0;          // done callbacks running now
+    size_t waiting_callbacks = 0;  // those of them blocked in wait
+    TaskId next_id = 1;
+    uint64_t virtual_time = 0;
+    std::unordered_map<TaskId, std::unique_ptr<Task>> tasks;
+    std::map<std::pair<uint64_t, TaskId>, Task*> ready;  // By pass, then submission order.
+};
+
+#endif // SCHEDULER_H
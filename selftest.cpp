@@ -0,0 +1,179 @@
+#include "selftest.h"
+#include "cse.h"
+#include "engine.h"
+#include "env.h"
+#include "eval_status.h"
+#include "lazy.h"
+#include "native.h"
+#include "parse.h"
+#include "server.h"
+#include "typecheck.h"
+#include "val.h"
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+typedef PTR(Expr) (*rewrite_t)(PTR(Expr) e);
+
+struct SelfTestCase {
+    const char *name;
+    rewrite_t rewrite;
+    const char *script;
+};
+
+PTR(Expr) cse(PTR(Expr) e) {
+    return eliminate_common_subexpressions(e).expr;
+}
+
+PTR(Expr) lazy(PTR(Expr) e) {
+    return make_lazy(e).expr;
+}
+
+PTR(Expr) types_then_lazy(PTR(Expr) e) {
+    return make_lazy(specialize_types(e)).expr;
+}
+
+const SelfTestCase CASES[] = {
+    {"types", specialize_types, "_let f = _fun (x) x + 1 _in _if f(2) == 3 _then f(4) * 2 _else 0"},
+    // Specialized nodes read the values of thunks once lazy.
+    {"types+lazy", types_then_lazy, "_let a = 2 * 3 _in _let f = _fun (x) x + a _in _if f(a) == 12 _then f(1) * 2 _else 0"},
+    // A binding that is used keeps its error when lazy.
+    {"lazy", lazy, "_let a = 1 + _true _in _let b = 2 _in b * a"},
+    {"lazy", lazy, "_let f = _fun (x) _fun (y) x * y _in _let g = f(3 + 4) _in g(2) + g(_false)"},
+    // A call checks its callee before its arguments, so the repeated
+    // argument must not be hoisted in front of that check.
+    {"cse", cse, "_let f = 5 _in f((1 + _true) + 1) + ((1 + _true) + 1)"},
+    {"cse", cse, "_let f = _fun (x) x _in f((1 + _true) + 1) + ((1 + _true) + 1)"},
+    {"cse", cse, "_let f = _fun (x) x _in f((2 * 3) + 1) + ((2 * 3) + 1)"},
+};
+
+// The value, or the error message; spans are left out because a rewrite
+// may move the node that reports the error.
+std::string outcome(PTR(Expr) e) {
+    EvalStatus status;
+    PTR(Val) v = e->eval(NativeRegistry::with_builtins().environment(), status);
+    return v ? v->to_string() : "error: " + status.message();
+}
+
+// Calls a closure after its Program, and the Context that evaluated it,
+// have moved on; the closure must keep its tree alive.
+std::string call_after_program() {
+    Engine engine;
+    Context ctx(engine);
+    PTR(Val) f;
+    {
+        Program p = engine.compile("_let k = _fun (a) _fun (b) a * b + x _in k(3)");
+        f = ctx.eval(p, {{"x", NEW(NumVal)(1)}});
+        ctx.eval(engine.compile("1 + 1"));
+    }
+    EvalStatus status;
+    PTR(Val) v = CAST(PoolFunVal)(f)->call({NEW(NumVal)(5)}, status);
+    return v ? v->to_string() : "error: " + status.message();
+}
+
+// Sends requests to an EvalServer on a temporary socket, as a client
+// would, and returns the responses, or what went wrong.
+std::string serve(const std::string &requests) {
+    std::string path = "/tmp/msdscript-selftest-" + std::to_string(getpid()) + ".sock";
+    EvalServer server(path, ServerLimits(), 1);
+    std::string error;
+    std::thread serving([&] {
+        try {
+            server.run();
+        } catch (std::exception &err) {
+            error = err.what();
+        }
+    });
+
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    int fd = -1;
+    for (int attempt = 0; attempt < 200 && fd < 0; attempt++) {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            close(fd);
+            fd = -1;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    std::string responses;
+    if (fd >= 0) {
+        if (send(fd, requests.data(), requests.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(requests.size())) {
+            shutdown(fd, SHUT_WR);
+            char buf[4096];
+            ssize_t n;
+            while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) responses.append(buf, static_cast<size_t>(n));
+        }
+        close(fd);
+    }
+    server.stop();
+    serving.join();
+    if (fd < 0) return "cannot connect: " + error;
+    return responses;
+}
+
+const char SERVER_REQUESTS[] =
+    "REG 1 x * x + y\n"
+    "EVAL 2 1 x=3 y=4\n"
+    "EVAL 3 1 x=3 y=4 selftest_unused_name=1\n"
+    "EVAL 4 1 x=3 y-1=4\n"
+    "EVAL 5 1 x=3 y=four\n"
+    "REG 6 +lazy _let z = 1 + _true _in x\n"
+    "EVAL 7 2 x=5\n"
+    "BATCH 8 1 x=1,2,9223372036854775807 y=0,0,1\n"
+    "BATCH 9 2 x=5,6\n"
+    "BATCH 10 1 x=1,2 y=1\n"
+    "DROP 11 1\n"
+    "EVAL 12 1 x=3 y=4\n";
+
+const char SERVER_RESPONSES[] =
+    "OK 1 1\n"
+    "OK 2 13\n"
+    "OK 3 13\n"
+    "ERR 4 Invalid binding name: y-1\n"
+    "ERR 5 Invalid binding value: four\n"
+    "OK 6 2\n"
+    "OK 7 5\n"
+    "OK 8 1,4,!overflow\n"
+    "OK 9 5,6\n"
+    "ERR 10 Columns differ in length\n"
+    "OK 11\n"
+    "ERR 12 Unknown script handle\n";
+
+} // namespace
+
+int run_self_test(std::ostream &out) {
+    int failures = 0;
+    for (const SelfTestCase &c : CASES) {
+        std::string expected = outcome(parse_str(c.script));
+        std::string actual = outcome(c.rewrite(parse_str(c.script)));
+        if (actual == expected) continue;
+        out << c.name << ": " << c.script << "\n  expected " << expected << "\n  got " << actual << std::endl;
+        failures++;
+    }
+
+    // Binding names a script never uses must not reach the symbol table.
+    std::string responses = serve(SERVER_REQUESTS);
+    if (responses != SERVER_RESPONSES || Symbol::lookup("selftest_unused_name") != Symbol()) {
+        out << "server:\n" << SERVER_REQUESTS << "  expected\n" << SERVER_RESPONSES << "  got\n" << responses << std::endl;
+        failures++;
+    }
+
+    std::string closure = call_after_program();
+    if (closure != "16") {
+        out << "closure after its program:\n  expected 16\n  got " << closure << std::endl;
+        failures++;
+    }
+
+    size_t checks = sizeof(CASES) / sizeof(CASES[0]) + 2;
+    out << checks - failures << " of " << checks << " checks passed" << std::endl;
+    return failures;
+}
@@ -0,0 +1,26 @@
+#ifndef SELFTEST_H
+#define SELFTEST_H
+
+#include <ostream>
+
+/**
+ * @file selftest.h
+ * @brief Regression checks for the optional tree rewrites, closures and the server.
+ *
+ * Each case is a script that must give the same value, or fail with the
+ * same error, after a rewrite (cse.h, lazy.h, typecheck.h, or types then
+ * lazy) as when it is evaluated as parsed. A closure returned by an Engine
+ * Program must still run once the Program and its Context have moved on.
+ * A client session against an EvalServer on a temporary socket checks the
+ * responses to REG, EVAL, BATCH and DROP, and that binding names are
+ * validated and not interned.
+ * `msdscript --selftest` runs them without starting the GUI.
+ */
+
+/**
+ * @brief Runs every case and reports each failure on out.
+ * @return The number of failed cases.
+ */
+int run_self_test(std::ostream &out);
+
+#endif // SELFTEST_H
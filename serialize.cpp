@@ -0,0 +1,365 @@
+#include "serialize.h"
+#include "parse.h"
+#include <atomic>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+enum node_tag_t : uint8_t {
+    TAG_NUM = 1,
+    TAG_ADD,
+    TAG_MULT,
+    TAG_VAR,
+    TAG_LET,
+    TAG_BOOL,
+    TAG_EQUAL,
+    TAG_IF,
+    TAG_FUN,
+    TAG_CALL,
+    TAG_LETREC
+};
+
+struct ImageHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t node_count;
+    uint32_t root;
+    uint32_t list_count;
+    uint32_t string_count;
+    uint32_t strings_offset;
+    uint32_t source_size;  // Bytes of source text after the string table.
+    uint64_t source_hash;
+};
+
+// Operand meaning depends on the tag: child node indices, a string table
+// index, the two halves of a 64-bit literal, or the start and length of a
+// run in the list section (parameter names of a _fun, arguments of a call).
+struct NodeRecord {
+    uint8_t tag;
+    uint8_t reserved[3];
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+};
+
+static_assert(sizeof(ImageHeader) == 40, "ImageHeader layout");
+static_assert(sizeof(NodeRecord) == 16, "NodeRecord layout");
+
+const char IMAGE_MAGIC[4] = {'M', 'S', 'D', 'A'};
+
+struct SpanRecord {
+    uint32_t begin;
+    uint32_t end;
+};
+
+static_assert(sizeof(SpanRecord) == 8, "SpanRecord layout");
+
+class Writer {
+public:
+    std::vector<NodeRecord> nodes;
+    std::vector<SpanRecord> spans;
+    std::vector<uint32_t> lists;
+    std::vector<std::string> strings;
+
+    uint32_t add(PTR(Expr) e) {
+        NodeRecord r = {};
+        if (PTR(NumExpr) n = CAST(NumExpr)(e)) {
+            uint64_t bits = static_cast<uint64_t>(n->val);
+            r.tag = TAG_NUM;
+            r.a = static_cast<uint32_t>(bits);
+            r.b = static_cast<uint32_t>(bits >> 32);
+        } else if (PTR(AddExpr) add_e = CAST(AddExpr)(e)) {
+            r.tag = TAG_ADD;
+            r.a = add(add_e->lhs);
+            r.b = add(add_e->rhs);
+        } else if (PTR(MultExpr) mult = CAST(MultExpr)(e)) {
+            r.tag = TAG_MULT;
+            r.a = add(mult->lhs);
+            r.b = add(mult->rhs);
+        } else if (PTR(VarExpr) var = CAST(VarExpr)(e)) {
+            r.tag = TAG_VAR;
+            r.a = intern(var->name);
+        } else if (PTR(LetExpr) let = CAST(LetExpr)(e)) {
+            r.tag = TAG_LET;
+            r.a = intern(let->var);
+            r.b = add(let->rhs);
+            r.c = add(let->body);
+        } else if (PTR(LetRecExpr) rec = CAST(LetRecExpr)(e)) {
+            r.tag = TAG_LETREC;
+            r.a = intern(rec->var);
+            r.b = add(rec->rhs);
+            r.c = add(rec->body);
+        } else if (PTR(BoolExpr) b = CAST(BoolExpr)(e)) {
+            r.tag = TAG_BOOL;
+            r.a = b->val ? 1 : 0;
+        } else if (PTR(EqualExpr) eq = CAST(EqualExpr)(e)) {
+            r.tag = TAG_EQUAL;
+            r.a = add(eq->lhs);
+            r.b = add(eq->rhs);
+        } else if (PTR(IfExpr) i = CAST(IfExpr)(e)) {
+            r.tag = TAG_IF;
+            r.a = add(i->condition);
+            r.b = add(i->then_branch);
+            r.c = add(i->else_branch);
+        } else if (PTR(FunExpr) f = CAST(FunExpr)(e)) {
+            std::vector<uint32_t> params;
+            for (Symbol param : f->params) params.push_back(intern(param));
+            r.tag = TAG_FUN;
+            r.a = add_list(params);
+            r.b = static_cast<uint32_t>(params.size());
+            r.c = add(f->body);
+        } else if (PTR(CallExpr) call = CAST(CallExpr)(e)) {
+            std::vector<uint32_t> args;
+            for (PTR(Expr) arg : call->args) args.push_back(add(arg));
+            r.tag = TAG_CALL;
+            r.a = add(call->func);
+            r.b = add_list(args);
+            r.c = static_cast<uint32_t>(args.size());
+        } else {
+            throw std::runtime_error("Cannot serialize expression");
+        }
+        nodes.push_back(r);
+        spans.push_back({e->span.begin, e->span.end});
+        return static_cast<uint32_t>(nodes.size() - 1);
+    }
+
+private:
+    std::unordered_map<Symbol, uint32_t> string_ids;
+
+    uint32_t add_list(const std::vector<uint32_t> &items) {
+        uint32_t start = static_cast<uint32_t>(lists.size());
+        lists.insert(lists.end(), items.begin(), items.end());
+        return start;
+    }
+
+    uint32_t intern(Symbol s) {
+        auto it = string_ids.find(s);
+        if (it != string_ids.end()) return it->second;
+        uint32_t id = static_cast<uint32_t>(strings.size());
+        strings.push_back(s.name());
+        string_ids.emplace(s, id);
+        return id;
+    }
+};
+
+void append(std::vector<char>& out, const void* p, size_t n) {
+    const char* c = static_cast<const char*>(p);
+    out.insert(out.end(), c, c + n);
+}
+
+} // namespace
+
+uint64_t hash_source(const std::string& source) {
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c : source) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+std::vector<char> serialize_expr(PTR(Expr) e, const std::string& source) {
+    Writer w;
+    uint32_t root = w.add(e);
+
+    ImageHeader h = {};
+    memcpy(h.magic, IMAGE_MAGIC, sizeof(h.magic));
+    h.version = AST_FORMAT_VERSION;
+    h.node_count = static_cast<uint32_t>(w.nodes.size());
+    h.root = root;
+    h.list_count = static_cast<uint32_t>(w.lists.size());
+    h.string_count = static_cast<uint32_t>(w.strings.size());
+    h.strings_offset = static_cast<uint32_t>(sizeof(ImageHeader) + w.nodes.size() * sizeof(NodeRecord) +
+                                             w.lists.size() * sizeof(uint32_t) +
+                                             w.spans.size() * sizeof(SpanRecord));
+    h.source_size = static_cast<uint32_t>(source.size());
+    h.source_hash = hash_source(source);
+
+    std::vector<char> out;
+    append(out, &h, sizeof(h));
+    append(out, w.nodes.data(), w.nodes.size() * sizeof(NodeRecord));
+    append(out, w.lists.data(), w.lists.size() * sizeof(uint32_t));
+    append(out, w.spans.data(), w.spans.size() * sizeof(SpanRecord));
+    for (const std::string& s : w.strings) {
+        uint32_t len = static_cast<uint32_t>(s.size());
+        append(out, &len, sizeof(len));
+        append(out, s.data(), s.size());
+    }
+    append(out, source.data(), source.size());
+    return out;
+}
+
+PTR(Expr) deserialize_expr(const char* data, size_t size, const std::string* source) {
+    ImageHeader h;
+    if (size < sizeof(h)) return nullptr;
+    memcpy(&h, data, sizeof(h));
+    if (memcmp(h.magic, IMAGE_MAGIC, sizeof(h.magic)) != 0) return nullptr;
+    if (h.version != AST_FORMAT_VERSION) return nullptr;
+    // The hash rejects most other sources without reading the text.
+    if (source && (h.source_size != source->size() || h.source_hash != hash_source(*source))) return nullptr;
+    if (h.node_count == 0 || h.root >= h.node_count) return nullptr;
+    uint64_t lists_offset = sizeof(h) + static_cast<uint64_t>(h.node_count) * sizeof(NodeRecord);
+    uint64_t spans_offset = lists_offset + static_cast<uint64_t>(h.list_count) * sizeof(uint32_t);
+    if (h.strings_offset != spans_offset + static_cast<uint64_t>(h.node_count) * sizeof(SpanRecord)) return nullptr;
+    if (h.strings_offset > size) return nullptr;
+
+    std::vector<uint32_t> lists(h.list_count);
+    if (!lists.empty()) memcpy(lists.data(), data + lists_offset, lists.size() * sizeof(uint32_t));
+
+    std::vector<Symbol> strings;
+    strings.reserve(h.string_count);
+    size_t pos = h.strings_offset;
+    for (uint32_t i = 0; i < h.string_count; i++) {
+        uint32_t len;
+        if (size - pos < sizeof(len)) return nullptr;
+        memcpy(&len, data + pos, sizeof(len));
+        pos += sizeof(len);
+        if (size - pos < len) return nullptr;
+        strings.emplace_back(std::string(data + pos, len));
+        pos += len;
+    }
+    if (size - pos != h.source_size) return nullptr;
+    if (source && memcmp(data + pos, source->data(), source->size()) != 0) return nullptr;
+
+    // Records are in post-order, so every child index refers to an
+    // already-built node and a single forward pass suffices.
+    std::vector<PTR(Expr)> built;
+    built.reserve(h.node_count);
+    const char* records = data + sizeof(h);
+    for (uint32_t i = 0; i < h.node_count; i++) {
+        NodeRecord r;
+        memcpy(&r, records + i * sizeof(NodeRecord), sizeof(r));
+        auto child = [&](uint32_t idx) -> PTR(Expr) {
+            return idx < i ? built[idx] : nullptr;
+        };
+        auto str = [&](uint32_t idx) -> const Symbol* {
+            return idx < strings.size() ? &strings[idx] : nullptr;
+        };
+        auto list = [&](uint32_t start, uint32_t count) {
+            return start <= lists.size() && count <= lists.size() - start;
+        };
+
+        PTR(Expr) e;
+        switch (r.tag) {
+            case TAG_NUM:
+                e = NEW(NumExpr)(static_cast<int64_t>((static_cast<uint64_t>(r.b) << 32) | r.a));
+                break;
+            case TAG_BOOL:
+                e = NEW(BoolExpr)(r.a != 0);
+                break;
+            case TAG_ADD:
+                if (child(r.a) && child(r.b)) e = NEW(AddExpr)(child(r.a), child(r.b));
+                break;
+            case TAG_MULT:
+                if (child(r.a) && child(r.b)) e = NEW(MultExpr)(child(r.a), child(r.b));
+                break;
+            case TAG_EQUAL:
+                if (child(r.a) && child(r.b)) e = NEW(EqualExpr)(child(r.a), child(r.b));
+                break;
+            case TAG_VAR:
+                if (str(r.a)) e = NEW(VarExpr)(*str(r.a));
+                break;
+            case TAG_LET:
+                if (str(r.a) && child(r.b) && child(r.c)) e = NEW(LetExpr)(*str(r.a), child(r.b), child(r.c));
+                break;
+            case TAG_LETREC: {
+                PTR(FunExpr) rhs = CAST(FunExpr)(child(r.b));
+                if (str(r.a) && rhs && child(r.c)) e = NEW(LetRecExpr)(*str(r.a), rhs, child(r.c));
+                break;
+            }
+            case TAG_IF:
+                if (child(r.a) && child(r.b) && child(r.c)) e = NEW(IfExpr)(child(r.a), child(r.b), child(r.c));
+                break;
+            case TAG_FUN: {
+                if (!list(r.a, r.b) || !child(r.c)) break;
+                std::vector<Symbol> params;
+                for (uint32_t j = 0; j < r.b; j++) {
+                    if (!str(lists[r.a + j])) return nullptr;
+                    params.push_back(*str(lists[r.a + j]));
+                }
+                e = NEW(FunExpr)(params, child(r.c));
+                break;
+            }
+            case TAG_CALL: {
+                if (!list(r.b, r.c) || !child(r.a)) break;
+                std::vector<PTR(Expr)> args;
+                for (uint32_t j = 0; j < r.c; j++) {
+                    if (!child(lists[r.b + j])) return nullptr;
+                    args.push_back(child(lists[r.b + j]));
+                }
+                e = NEW(CallExpr)(child(r.a), args);
+                break;
+            }
+        }
+        if (!e) return nullptr;
+        SpanRecord span;
+        memcpy(&span, data + spans_offset + i * sizeof(SpanRecord), sizeof(span));
+        e->span.begin = span.begin;
+        e->span.end = span.end;
+        built.push_back(e);
+    }
+    return built[h.root];
+}
+
+bool save_expr_file(const std::string& path, PTR(Expr) e, const std::string& source) {
+    std::vector<char> image = serialize_expr(e, source);
+    // Threads of one process may write the same image at once, as the
+    // server's workers do when clients register the same script.
+    static std::atomic<uint64_t> writes{0};
+    std::string tmp = path + ".tmp" + std::to_string(getpid()) + "." + std::to_string(writes++);
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+        out.write(image.data(), static_cast<std::streamsize>(image.size()));
+        if (!out) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+PTR(Expr) load_expr_file(const std::string& path, const std::string* source) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return nullptr;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return nullptr;
+
+    PTR(Expr) e = deserialize_expr(static_cast<const char*>(map), size, source);
+    munmap(map, size);
+    return e;
+}
+
+PTR(Expr) parse_str_cached(const std::string& s, const std::string& cache_dir) {
+    uint64_t h = hash_source(s);
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.msdast", static_cast<unsigned long long>(h));
+    std::string path = cache_dir + "/" + name;
+
+    if (PTR(Expr) cached = load_expr_file(path, &s)) return cached;
+
+    PTR(Expr) e = parse_str(s);
+    save_expr_file(path, e, s);
+    return e;
+}
@@ -0,0 +1,83 @@
+#ifndef SERIALIZE_H
+#define SERIALIZE_H
+
+#include "expr.h"
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * @file serialize.h
+ * @brief Compact binary format for parsed expression trees.
+ *
+ * An image is a fixed header, a table of fixed-size node records in
+ * post-order (children always precede their parent), a section of
+ * variable-length operand lists, the source span of every node, a string
+ * table and the source text the tree was parsed from.
+ * Because every record has the same size, the loader indexes it directly
+ * out of an mmap'd file instead of tokenizing source text again.
+ */
+
+/** Bumped whenever the node record layout or tag set changes. */
+const uint16_t AST_FORMAT_VERSION = 5;
+
+/**
+ * @brief Hashes script source text for use as a cache key.
+ * @param source The script text.
+ * @return A 64-bit FNV-1a hash of the text.
+ */
+uint64_t hash_source(const std::string& source);
+
+/**
+ * @brief Serializes an expression tree into a binary image.
+ * @param e The expression to serialize.
+ * @param source The source the tree was parsed from, if any; stored with its hash.
+ * @return The image bytes.
+ * @throws std::runtime_error If the tree contains an unsupported node.
+ */
+std::vector<char> serialize_expr(PTR(Expr) e, const std::string& source = std::string());
+
+/**
+ * @brief Rebuilds an expression tree from a binary image.
+ * @param data Start of the image.
+ * @param size Size of the image in bytes.
+ * @param source If set, the source the image must have been written with.
+ * @return The expression, or nullptr if the image is malformed, stale or of another version.
+ */
+PTR(Expr) deserialize_expr(const char* data, size_t size, const std::string* source = nullptr);
+
+/**
+ * @brief Writes the binary image of an expression to a file.
+ * @param path Destination path; written through a temporary file and renamed into place.
+ * @param e The expression to write.
+ * @param source The source the tree was parsed from, if any.
+ * @return True on success.
+ */
+bool save_expr_file(const std::string& path, PTR(Expr) e, const std::string& source = std::string());
+
+/**
+ * @brief Maps a binary image file into memory and loads the expression from it.
+ * @param path The image file.
+ * @param source If set, the source the image must have been written with.
+ * @return The expression, or nullptr if the file is missing or unusable.
+ */
+PTR(Expr) load_expr_file(const std::string& path, const std::string* source = nullptr);
+
+/**
+ * @brief Parses a script through an on-disk cache keyed by its content hash.
+ *
+ * On a hit the tree is loaded from the cached image; on a miss the source is
+ * parsed with parse_str and the image is written for the next run. An image
+ * is only used if the source stored in it equals s, so scripts whose hashes
+ * collide are parsed again rather than given each other's trees. Cache
+ * write failures are ignored.
+ *
+ * @param s The script text.
+ * @param cache_dir Directory holding the cached images.
+ * @return A pointer to the parsed expression.
+ * @throws std::runtime_error If the input string is invalid.
+ */
+PTR(Expr) parse_str_cached(const std::string& s, const std::string& cache_dir);
+
+#endif // SERIALIZE_H
@@ -0,0 +1,585 @@
+#include "server.h"
+#include "batch.h"
+#include "expr.h"
+#include "lazy.h"
+#include "native.h"
+#include "parse.h"
+#include "cse.h"
+#include "serialize.h"
+#include "typecheck.h"
+#include "val.h"
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Deep MSDscript recursion becomes deep C++ recursion; matches the GUI
+// worker so the default depth limit is safe.
+static const size_t WORKER_STACK_SIZE = 256 * 1024 * 1024;
+
+// Bytes read from one connection per poll round, so a fast sender cannot
+// grow its buffer without bound while its requests are still queued.
+static const size_t READ_BUDGET = 256 * 1024;
+
+struct EvalServer::Connection {
+    int fd;
+
+    // Owned by the polling thread.
+    std::string input;
+    bool eof = false;
+
+    // Set once the peer is gone; queued requests are dropped unanswered.
+    std::atomic<bool> closed{false};
+
+    // Guards pending, output and scheduled.
+    std::mutex mutex;
+    std::deque<std::string> pending;
+    std::string output;
+    bool scheduled = false;  // Waiting in ready or running on a worker.
+
+    // Used by one worker at a time.
+    std::unordered_map<uint64_t, PTR(Expr)> scripts;
+    uint64_t next_handle = 1;
+    uint64_t steps = 0;
+    EvalContext context;
+
+    explicit Connection(int fd) : fd(fd) {}
+};
+
+static PTR(Env) builtins() {
+    static PTR(Env) env = NativeRegistry::with_builtins().environment();
+    return env;
+}
+
+static void set_nonblocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// Removes the +flags in front of a REG script and returns their names.
+static std::vector<std::string> take_flags(std::string &script) {
+    std::vector<std::string> flags;
+    size_t pos = script.find_first_not_of(' ');
+    while (pos != std::string::npos && script[pos] == '+') {
+        size_t end = script.find(' ', pos);
+        flags.push_back(script.substr(pos + 1, end == std::string::npos ? std::string::npos : end - pos - 1));
+        pos = end == std::string::npos ? end : script.find_first_not_of(' ', end);
+    }
+    script.erase(0, pos == std::string::npos ? script.size() : pos);
+    return flags;
+}
+
+// Applies the rewrites a REG request asked for, in the order their
+// headers ask for.
+static PTR(Expr) prepare(PTR(Expr) e, const std::vector<std::string> &flags) {
+    bool cse = false, types = false, lazy = false;
+    for (const std::string &flag : flags) {
+        if (flag == "cse") cse = true;
+        else if (flag == "types") types = true;
+        else if (flag == "lazy") lazy = true;
+        else throw std::runtime_error("Unknown flag: +" + flag);
+    }
+    if (cse) e = eliminate_common_subexpressions(e).expr;
+    if (types) e = specialize_types(e);
+    if (lazy) e = make_lazy(e).expr;
+    return e;
+}
+
+static bool is_identifier(const std::string &name) {
+    if (name.empty() || !isalpha(static_cast<unsigned char>(name[0]))) return false;
+    for (char c : name) {
+        if (!isalnum(static_cast<unsigned char>(c)) && c != '_') return false;
+    }
+    return true;
+}
+
+static PTR(Val) parse_binding_value(const std::string &text) {
+    if (text == "_true") return NEW(BoolVal)(true);
+    if (text == "_false") return NEW(BoolVal)(false);
+    size_t used = 0;
+    int64_t n = 0;
+    try {
+        n = std::stoll(text, &used);
+    } catch (std::exception &) {
+        used = 0;
+    }
+    if (used == 0 || used != text.size()) throw std::runtime_error("Invalid binding value: " + text);
+    return NEW(NumVal)(n);
+}
+
+// Splits a name=value binding, returning the value text and the name's
+// symbol. The symbol is looked up rather than interned, because the
+// symbol table never shrinks; a name no script uses is Symbol() and cannot
+// be referenced.
+static Symbol binding_name(const std::string &binding, std::string &value) {
+    size_t eq = binding.find('=');
+    if (eq == 0 || eq == std::string::npos) throw std::runtime_error("Invalid binding: " + binding);
+    std::string name = binding.substr(0, eq);
+    if (!is_identifier(name)) throw std::runtime_error("Invalid binding name: " + name);
+    value = binding.substr(eq + 1);
+    return Symbol::lookup(name);
+}
+
+// Parses the comma-separated integers of a BATCH column.
+static std::vector<int64_t> parse_column(const std::string &text) {
+    std::vector<int64_t> values;
+    size_t pos = 0;
+    while (true) {
+        size_t end = text.find(',', pos);
+        std::string item = text.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+        PTR(NumVal) n = CAST(NumVal)(parse_binding_value(item));
+        if (!n) throw std::runtime_error("Invalid column value: " + item);
+        values.push_back(n->val);
+        if (end == std::string::npos) return values;
+        pos = end + 1;
+    }
+}
+
+EvalServer::EvalServer(const std::string &socket_path, ServerLimits limits, size_t workers, std::string parse_cache_dir)
+    : path(socket_path), limits(limits), worker_count(workers), parse_cache_dir(std::move(parse_cache_dir)) {
+    if (worker_count == 0) worker_count = std::max(1u, std::thread::hardware_concurrency());
+}
+
+EvalServer::~EvalServer() {
+    stop();
+}
+
+void EvalServer::stop() {
+    stopping.store(true);
+    wake();
+}
+
+void EvalServer::wake() {
+    if (wake_pipe[1] >= 0) {
+        char c = 0;
+        ssize_t ignored = write(wake_pipe[1], &c, 1);
+        (void)ignored;
+    }
+}
+
+void *EvalServer::worker_main(void *server) {
+    static_cast<EvalServer*>(server)->worker_loop();
+    return nullptr;
+}
+
+void EvalServer::run() {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) throw std::runtime_error("Socket path too long: " + path);
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    if (pipe(wake_pipe) != 0) throw std::runtime_error(std::string("pipe: ") + strerror(errno));
+    set_nonblocking(wake_pipe[0]);
+    set_nonblocking(wake_pipe[1]);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) throw std::runtime_error(std::string("socket: ") + strerror(errno));
+    unlink(path.c_str());
+    if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+        std::string message = std::string("Cannot listen on ") + path + ": " + strerror(errno);
+        close(listen_fd);
+        listen_fd = -1;
+        throw std::runtime_error(message);
+    }
+    set_nonblocking(listen_fd);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
+    int failed = 0;
+    for (size_t i = 0; i < worker_count && failed == 0; i++) {
+        pthread_t thread;
+        failed = pthread_create(&thread, &attr, worker_main, this);
+        if (failed == 0) workers.push_back(thread);
+    }
+    pthread_attr_destroy(&attr);
+    // Without every worker the server would take requests it never answers.
+    if (failed != 0) {
+        shut_down();
+        throw std::runtime_error(std::string("Cannot start worker threads: ") + strerror(failed));
+    }
+
+    std::vector<pollfd> fds;
+    std::vector<std::shared_ptr<Connection>> polled;
+    while (!stopping.load()) {
+        fds.clear();
+        polled.clear();
+        fds.push_back({wake_pipe[0], POLLIN, 0});
+        fds.push_back({listen_fd, static_cast<short>(accepting() ? POLLIN : 0), 0});
+        for (auto &entry : connections) {
+            std::shared_ptr<Connection> conn = entry.second;
+            short events = 0;
+            {
+                std::lock_guard<std::mutex> lock(conn->mutex);
+                if (!conn->eof && (limits.max_pending == 0 || conn->pending.size() < limits.max_pending)) events |= POLLIN;
+                if (!conn->output.empty()) events |= POLLOUT;
+            }
+            fds.push_back({conn->fd, events, 0});
+            polled.push_back(conn);
+        }
+
+        if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR) break;
+
+        if (fds[0].revents & POLLIN) {
+            char buf[256];
+            while (read(wake_pipe[0], buf, sizeof(buf)) > 0) {}
+        }
+        if (fds[1].revents & POLLIN) accept_client();
+
+        for (size_t i = 0; i < polled.size(); i++) {
+            std::shared_ptr<Connection> conn = polled[i];
+            short revents = fds[i + 2].revents;
+            if (revents & (POLLIN | POLLHUP | POLLERR)) read_client(conn);
+            if (revents & POLLOUT) flush_client(conn);
+        }
+
+        // Queue lines left over while the connection was at its pending
+        // limit, and close connections that are finished.
+        for (auto it = connections.begin(); it != connections.end();) {
+            std::shared_ptr<Connection> conn = it->second;
+            if (!conn->closed) queue_lines(conn);
+            bool done;
+            {
+                std::lock_guard<std::mutex> lock(conn->mutex);
+                done = !conn->scheduled && (conn->closed || (conn->eof && conn->pending.empty() && conn->output.empty()));
+            }
+            if (done) {
+                close(conn->fd);
+                open_connections--;
+                it = connections.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    shut_down();
+}
+
+// Stops the workers and releases everything run() set up.
+void EvalServer::shut_down() {
+    stopping.store(true);
+    for (auto &entry : connections) {
+        entry.second->closed = true;
+        entry.second->context.cancel();
+    }
+    {
+        std::lock_guard<std::mutex> lock(ready_mutex);
+        ready_cv.notify_all();
+    }
+    for (pthread_t thread : workers) pthread_join(thread, nullptr);
+    workers.clear();
+    for (auto &entry : connections) close(entry.second->fd);
+    connections.clear();
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(path.c_str());
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    wake_pipe[0] = wake_pipe[1] = -1;
+}
+
+bool EvalServer::accepting() const {
+    return limits.max_connections == 0 || connections.size() < limits.max_connections;
+}
+
+void EvalServer::accept_client() {
+    while (accepting()) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) return;
+        set_nonblocking(fd);
+        connections[fd] = std::make_shared<Connection>(fd);
+        total_connections++;
+        open_connections++;
+    }
+}
+
+void EvalServer::read_client(const std::shared_ptr<Connection> &conn) {
+    char buf[4096];
+    while (!conn->eof && conn->input.size() < READ_BUDGET) {
+        ssize_t n = recv(conn->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n > 0) {
+            conn->input.append(buf, static_cast<size_t>(n));
+        } else if (n == 0) {
+            conn->eof = true;
+        } else {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                conn->eof = true;
+                conn->closed = true;
+                conn->context.cancel();
+            }
+            break;
+        }
+    }
+    queue_lines(conn);
+}
+
+// Moves complete lines from the input buffer to the pending queue, up to
+// the connection's pending limit; the rest stays buffered.
+void EvalServer::queue_lines(const std::shared_ptr<Connection> &conn) {
+    bool queued = false;
+    size_t start = 0;
+    while (true) {
+        std::lock_guard<std::mutex> lock(conn->mutex);
+        if (limits.max_pending != 0 && conn->pending.size() >= limits.max_pending) break;
+        size_t newline = conn->input.find('\n', start);
+        size_t length = (newline == std::string::npos ? conn->input.size() : newline) - start;
+        if (limits.max_line != 0 && length > limits.max_line) {
+            // The connection is out of sync with the protocol; answer and hang up.
+            conn->output += "ERR - Request too long\n";
+            conn->eof = true;
+            start = conn->input.size();
+            break;
+        }
+        if (newline == std::string::npos) break;
+        std::string line = conn->input.substr(start, length);
+        start = newline + 1;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
+        conn->pending.push_back(line);
+        total_requests++;
+        queued = true;
+    }
+    conn->input.erase(0, start);
+    if (queued) schedule(conn);
+}
+
+bool EvalServer::flush_client(const std::shared_ptr<Connection> &conn) {
+    std::lock_guard<std::mutex> lock(conn->mutex);
+    while (!conn->output.empty()) {
+        ssize_t n = send(conn->fd, conn->output.data(), conn->output.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0) {
+            conn->output.erase(0, static_cast<size_t>(n));
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return true;
+        } else {
+            conn->output.clear();
+            conn->eof = true;
+            conn->closed = true;
+            conn->context.cancel();
+            return false;
+        }
+    }
+    return true;
+}
+
+void EvalServer::schedule(const std::shared_ptr<Connection> &conn) {
+    {
+        std::lock_guard<std::mutex> lock(conn->mutex);
+        if (conn->scheduled) return;
+        conn->scheduled = true;
+    }
+    std::lock_guard<std::mutex> lock(ready_mutex);
+    ready.push_back(conn);
+    ready_cv.notify_one();
+}
+
+// Handles one request per turn and then requeues the connection behind the
+// others, so a client with a long pipeline does not starve the rest.
+void EvalServer::worker_loop() {
+    while (true) {
+        std::shared_ptr<Connection> conn;
+        {
+            std::unique_lock<std::mutex> lock(ready_mutex);
+            ready_cv.wait(lock, [this] { return stopping.load() || !ready.empty(); });
+            if (stopping.load()) return;
+            conn = ready.front();
+            ready.pop_front();
+        }
+
+        std::string line;
+        {
+            std::lock_guard<std::mutex> lock(conn->mutex);
+            line = conn->pending.front();
+            conn->pending.pop_front();
+        }
+        std::string response = conn->closed ? "" : handle(*conn, line);
+
+        bool more;
+        {
+            std::lock_guard<std::mutex> lock(conn->mutex);
+            if (!response.empty() && !conn->closed) conn->output += response + "\n";
+            more = !conn->pending.empty() && !conn->closed;
+            if (!more) {
+                conn->pending.clear();
+                conn->scheduled = false;
+            }
+        }
+        if (more) {
+            std::lock_guard<std::mutex> lock(ready_mutex);
+            ready.push_back(conn);
+            ready_cv.notify_one();
+        }
+        wake();
+    }
+}
+
+std::string EvalServer::handle(Connection &conn, const std::string &line) {
+    std::istringstream in(line);
+    std::string command, id;
+    in >> command >> id;
+    if (id.empty()) {
+        total_errors++;
+        return "ERR - Missing request id";
+    }
+
+    try {
+        if (command == "REG") {
+            if (limits.max_scripts != 0 && conn.scripts.size() >= limits.max_scripts) {
+                throw std::runtime_error("Too many registered scripts");
+            }
+            std::string script;
+            std::getline(in, script);
+            std::vector<std::string> flags = take_flags(script);
+            PTR(Expr) e = parse_cache_dir.empty() ? parse_str(script) : parse_str_cached(script, parse_cache_dir);
+            e = prepare(e, flags);
+            uint64_t handle = conn.next_handle++;
+            conn.scripts[handle] = e;
+            return "OK " + id + " " + std::to_string(handle);
+        }
+        if (command == "EVAL") {
+            PTR(Expr) script = find_script(conn, in);
+            PTR(Env) env = builtins();
+            std::string binding;
+            while (in >> binding) {
+                std::string text;
+                Symbol name = binding_name(binding, text);
+                PTR(Val) value = parse_binding_value(text);
+                if (name != Symbol()) env = NEW(ExtendedEnv)(name, value, env);
+            }
+
+            std::string result;
+            EvalStatus status;
+            if (!evaluate(conn, [&] {
+                PTR(Val) v = script->eval(env, status);
+                if (v) result = v->to_string();
+            })) {
+                return "";
+            }
+            if (!status.ok()) {
+                total_errors++;
+                return "ERR " + id + " " + status.message();
+            }
+            return "OK " + id + " " + result;
+        }
+        if (command == "BATCH") {
+            PTR(Expr) script = find_script(conn, in);
+            std::vector<std::vector<int64_t>> values;
+            std::vector<Symbol> names;
+            std::string binding;
+            while (in >> binding) {
+                std::string text;
+                names.push_back(binding_name(binding, text));
+                values.push_back(parse_column(text));
+                if (values.back().size() != values.front().size()) throw std::runtime_error("Columns differ in length");
+            }
+            if (values.empty()) throw std::runtime_error("Missing column");
+
+            std::vector<BatchColumn> columns;
+            for (size_t i = 0; i < names.size(); i++) {
+                if (names[i] != Symbol()) columns.push_back({names[i], values[i].data()});
+            }
+            size_t rows = values.front().size();
+            BatchResult batch;
+            if (!evaluate(conn, [&] { batch = eval_batch(script, columns, rows, builtins()); })) return "";
+
+            std::string result;
+            for (size_t row = 0; row < rows; row++) {
+                if (row > 0) result += ',';
+                switch (batch.status[row]) {
+                case batch_ok:
+                    if (batch.is_bool[row]) result += batch.values[row] ? "_true" : "_false";
+                    else result += std::to_string(batch.values[row]);
+                    break;
+                case batch_overflow:
+                    result += "!overflow";
+                    break;
+                case batch_type_error:
+                    result += "!type";
+                    break;
+                default:
+                    result += "!error";
+                    break;
+                }
+            }
+            return "OK " + id + " " + result;
+        }
+        if (command == "DROP") {
+            uint64_t handle = 0;
+            in >> handle;
+            if (conn.scripts.erase(handle) == 0) throw std::runtime_error("Unknown script handle");
+            return "OK " + id;
+        }
+        if (command == "STATS") {
+            std::string result = "OK " + id + " " + stats() + " scripts=" + std::to_string(conn.scripts.size()) +
+                                 " connection_steps=" + std::to_string(conn.steps);
+            in >> std::ws;
+            if (in.eof()) return result;
+            PTR(Expr) script = find_script(conn, in);
+            InlineCacheStats calls = inline_cache_stats(script);
+            QuickeningStats quickened = quickening_stats(script);
+            uint64_t quick = quickened.add_var_const + quickened.add_const_var + quickened.add_var_var +
+                             quickened.mult_var_const + quickened.mult_const_var + quickened.mult_var_var +
+                             quickened.equal_var_const + quickened.equal_const_var + quickened.equal_var_var;
+            return result + " call_sites=" + std::to_string(calls.sites) +
+                   " call_hits=" + std::to_string(calls.hits) +
+                   " call_misses=" + std::to_string(calls.misses) +
+                   " quickened=" + std::to_string(quick) +
+                   " deoptimized=" + std::to_string(quickened.deoptimized);
+        }
+        throw std::runtime_error("Unknown command: " + command);
+    } catch (std::exception &err) {
+        total_errors++;
+        return "ERR " + id + " " + err.what();
+    }
+}
+
+PTR(Expr) EvalServer::find_script(Connection &conn, std::istream &in) {
+    uint64_t handle = 0;
+    in >> handle;
+    auto it = conn.scripts.find(handle);
+    if (it == conn.scripts.end()) throw std::runtime_error("Unknown script handle");
+    return it->second;
+}
+
+bool EvalServer::evaluate(Connection &conn, const std::function<void()> &run) {
+    conn.context.limits = limits.eval;
+    if (limits.max_connection_steps != 0) {
+        if (conn.steps >= limits.max_connection_steps) throw std::runtime_error("Connection step budget exhausted");
+        uint64_t remaining = limits.max_connection_steps - conn.steps;
+        if (conn.context.limits.max_steps == 0 || remaining < conn.context.limits.max_steps) {
+            conn.context.limits.max_steps = remaining;
+        }
+    }
+    conn.context.reset();
+    // A disconnect that raced with reset() must still cancel.
+    if (conn.closed) return false;
+
+    total_evals++;
+    try {
+        EvalContext::Scope scope(conn.context);
+        run();
+    } catch (...) {
+        conn.steps += conn.context.steps();
+        total_steps += conn.context.steps();
+        throw;
+    }
+    conn.steps += conn.context.steps();
+    total_steps += conn.context.steps();
+    return true;
+}
+
+std::string EvalServer::stats() {
+    return "connections=" + std::to_string(open_connections.load()) +
+           " accepted=" + std::to_string(total_connections.load()) +
+           " requests=" + std::to_string(total_requests.load()) +
+           " evals=" + std::to_string(total_evals.load()) +
+           " errors=" + std::to_string(total_errors.load()) +
+           " steps=" + std::to_string(total_steps.load());
+}
@@ -0,0 +1,141 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "eval_context.h"
+#include "expr.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <pthread.h>
+
+/**
+ * @file server.h
+ * @brief Long-running evaluator that serves local clients over a Unix socket.
+ *
+ * The protocol is line based. Every request carries an id chosen by the
+ * client, which is echoed in its response as "OK <id> <payload>" or
+ * "ERR <id> <message>". Scripts must fit on one line, so clients replace
+ * newlines with spaces.
+ *
+ *     REG <id> [+flag]* <script>        parse once -> OK <id> <handle>
+ *     EVAL <id> <handle> [name=value]*  evaluate with the bindings -> OK <id> <value>
+ *     BATCH <id> <handle> [name=n,n,...]+
+ *                                       evaluate once per row of the columns -> OK <id> <value>,<value>,...
+ *     DROP <id> <handle>                forget a script -> OK <id>
+ *     STATS <id> [handle]               counters -> OK <id> key=value ...
+ *
+ * Flags in front of a script opt it into rewrites made once at REG:
+ *
+ *     +cse    eliminate_common_subexpressions (cse.h)
+ *     +types  specialize_types (typecheck.h); only a script that type
+ *             checks without its bindings is specialized
+ *     +lazy   make_lazy (lazy.h): bindings and arguments are evaluated
+ *             on first use
+ *
+ * Whatever their order in the request, the rewrites run in the order above.
+ *
+ * Binding names are identifiers and their values are integers, _true or
+ * _false; scripts also see the native builtins. BATCH columns hold
+ * integers and must have the same length; the rows go through eval_batch
+ * (batch.h), and a row that fails reads !overflow, !type or !error
+ * without failing the others. STATS with a handle adds the script's call
+ * site cache and quickening counters (expr.h).
+ *
+ * Clients may pipeline any number of requests without waiting. The
+ * requests of one connection are handled in order by one worker at a
+ * time, because a parsed tree caches state while it runs.
+ * Different connections are evaluated in parallel.
+ */
+
+/**
+ * @brief Limits applied to every connection; 0 means unlimited.
+ */
+struct ServerLimits {
+    size_t max_connections = 64;
+    size_t max_scripts = 256;           ///< Registered scripts per connection.
+    size_t max_line = 64 * 1024;        ///< Bytes per request line.
+    size_t max_pending = 1024;          ///< Queued requests before the connection stops being read.
+    uint64_t max_connection_steps = 0;  ///< Reductions over all evaluations of a connection.
+    EvalLimits eval;                    ///< Limits of each evaluation.
+
+    ServerLimits() {
+        eval.max_millis = 10000;
+        eval.max_depth = 100000;
+        eval.max_bytes = 1024ULL * 1024 * 1024;
+    }
+};
+
+class EvalServer {
+public:
+    /**
+     * @param socket_path Filesystem path of the socket; an existing file there is replaced.
+     * @param limits Per-connection limits.
+     * @param workers Evaluation threads; 0 picks one per core.
+     * @param parse_cache_dir If set, REG parses through parse_str_cached with its images in this directory.
+     */
+    explicit EvalServer(const std::string &socket_path, ServerLimits limits = ServerLimits(), size_t workers = 0,
+                        std::string parse_cache_dir = std::string());
+    ~EvalServer();
+    EvalServer(const EvalServer&) = delete;
+    EvalServer& operator=(const EvalServer&) = delete;
+
+    /**
+     * @brief Serves clients until stop() is called.
+     * @throws std::runtime_error If the socket or the worker threads cannot be created.
+     */
+    void run();
+
+    /** @brief Makes run() return; safe to call from any thread or a signal handler. */
+    void stop();
+
+private:
+    struct Connection;
+
+    bool accepting() const;
+    void accept_client();
+    void read_client(const std::shared_ptr<Connection> &conn);
+    void queue_lines(const std::shared_ptr<Connection> &conn);
+    bool flush_client(const std::shared_ptr<Connection> &conn);
+    void schedule(const std::shared_ptr<Connection> &conn);
+    void worker_loop();
+    std::string handle(Connection &conn, const std::string &line);
+    PTR(Expr) find_script(Connection &conn, std::istream &in);
+    bool evaluate(Connection &conn, const std::function<void()> &run);
+    std::string stats();
+    void wake();
+    void shut_down();
+    static void *worker_main(void *server);
+
+    std::string path;
+    ServerLimits limits;
+    size_t worker_count;
+    std::string parse_cache_dir;
+    int listen_fd = -1;
+    int wake_pipe[2] = {-1, -1};
+    std::atomic<bool> stopping{false};
+
+    std::unordered_map<int, std::shared_ptr<Connection>> connections;
+
+    // Connections with queued requests and no worker yet, oldest first.
+    std::mutex ready_mutex;
+    std::condition_variable ready_cv;
+    std::deque<std::shared_ptr<Connection>> ready;
+    std::vector<pthread_t> workers;
+
+    std::atomic<uint64_t> open_connections{0};
+    std::atomic<uint64_t> total_connections{0};
+    std::atomic<uint64_t> total_requests{0};
+    std::atomic<uint64_t> total_evals{0};
+    std::atomic<uint64_t> total_errors{0};
+    std::atomic<uint64_t> total_steps{0};
+};
+
+#endif // SERVER_H
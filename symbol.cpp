@@ -0,0 +1,57 @@
+#include "symbol.h"
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+namespace {
+
+// Names live in a deque so references handed out by name() survive growth.
+struct SymbolTable {
+    std::mutex lock;
+    std::deque<std::string> names;
+    std::unordered_map<std::string, uint32_t> ids;
+
+    SymbolTable() {
+        names.emplace_back();
+        ids.emplace(std::string(), 0);
+    }
+};
+
+SymbolTable &table() {
+    static SymbolTable instance;
+    return instance;
+}
+
+uint32_t intern(const std::string &name) {
+    SymbolTable &t = table();
+    std::lock_guard<std::mutex> guard(t.lock);
+    auto it = t.ids.find(name);
+    if (it != t.ids.end()) return it->second;
+    uint32_t id = static_cast<uint32_t>(t.names.size());
+    t.names.push_back(name);
+    t.ids.emplace(name, id);
+    return id;
+}
+
+} // namespace
+
+Symbol::Symbol(const std::string &name) : id_(intern(name)) {}
+
+Symbol::Symbol(const char *name) : id_(intern(name)) {}
+
+Symbol Symbol::lookup(const std::string &name) {
+    SymbolTable &t = table();
+    std::lock_guard<std::mutex> guard(t.lock);
+    auto it = t.ids.find(name);
+    return Symbol(it == t.ids.end() ? 0 : it->second);
+}
+
+const std::string &Symbol::name() const {
+    SymbolTable &t = table();
+    std::lock_guard<std::mutex> guard(t.lock);
+    return t.names[id_];
+}
+
+std::ostream &operator<<(std::ostream &os, Symbol s) {
+    return os << s.name();
+}
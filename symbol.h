@@ -0,0 +1,56 @@
+#ifndef SYMBOL_H
+#define SYMBOL_H
+
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+
+/**
+ * @file symbol.h
+ * @brief Interned identifiers.
+ *
+ * Every distinct identifier is stored once in a process-wide table and
+ * referred to by a 32-bit id, so AST nodes, closures and environment frames
+ * hold and compare integers instead of strings. Interning is thread-safe.
+ */
+class Symbol {
+public:
+    /** @brief The symbol for the empty name. */
+    Symbol() : id_(0) {}
+
+    /** @brief Interns a name; implicit so string-taking call sites keep working. */
+    Symbol(const std::string &name);
+    Symbol(const char *name);
+
+    /**
+     * @brief The symbol for name if it has been interned, otherwise the
+     * empty symbol; never adds to the table.
+     */
+    static Symbol lookup(const std::string &name);
+
+    /** @brief The interned name; the reference stays valid for the life of the process. */
+    const std::string &name() const;
+
+    uint32_t id() const { return id_; }
+
+    bool operator==(Symbol other) const { return id_ == other.id_; }
+    bool operator!=(Symbol other) const { return id_ != other.id_; }
+    bool operator<(Symbol other) const { return id_ < other.id_; }
+
+private:
+    explicit Symbol(uint32_t id) : id_(id) {}
+
+    uint32_t id_;
+};
+
+std::ostream &operator<<(std::ostream &os, Symbol s);
+
+namespace std {
+template <>
+struct hash<Symbol> {
+    size_t operator()(Symbol s) const { return s.id(); }
+};
+}
+
+#endif // SYMBOL_H
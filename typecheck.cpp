@@ -0,0 +1,294 @@
+#include "typecheck.h"
+#include <climits>
+#include <map>
+#include <utility>
+#include <vector>
+
+namespace {
+
+typedef enum {
+    type_int,
+    type_bool,
+    type_fun,
+    type_var
+} type_kind_t;
+
+// Type variables at this level have been generalized by a _let and are
+// copied afresh at every use.
+const int GENERIC_LEVEL = INT_MAX;
+
+// A function type takes all of its parameters at once, so a
+// two-parameter _fun and a curried one have different types.
+class Type {
+public:
+    type_kind_t kind;
+    std::vector<PTR(Type)> args;
+    PTR(Type) ret;
+    PTR(Type) instance;
+    int id;
+    int level;
+
+    Type(type_kind_t kind, std::vector<PTR(Type)> args, PTR(Type) ret, int id, int level)
+        : kind(kind), args(std::move(args)), ret(ret), id(id), level(level) {}
+};
+
+PTR(Type) prune(PTR(Type) t) {
+    while (t->kind == type_var && t->instance) t = t->instance;
+    return t;
+}
+
+class Inferencer {
+public:
+    // Operand type of every EqualExpr, in preorder.
+    std::vector<PTR(Type)> equal_types;
+
+    PTR(Type) infer(PTR(Expr) e, int level) {
+        if (CAST(NumExpr)(e)) return int_type;
+        if (CAST(BoolExpr)(e)) return bool_type;
+        if (PTR(AddExpr) add = CAST(AddExpr)(e)) {
+            unify(infer(add->lhs, level), int_type);
+            unify(infer(add->rhs, level), int_type);
+            return int_type;
+        }
+        if (PTR(MultExpr) mult = CAST(MultExpr)(e)) {
+            unify(infer(mult->lhs, level), int_type);
+            unify(infer(mult->rhs, level), int_type);
+            return int_type;
+        }
+        if (PTR(EqualExpr) eq = CAST(EqualExpr)(e)) {
+            size_t slot = equal_types.size();
+            equal_types.push_back(nullptr);
+            PTR(Type) lhs = infer(eq->lhs, level);
+            unify(lhs, infer(eq->rhs, level));
+            equal_types[slot] = lhs;
+            return bool_type;
+        }
+        if (PTR(IfExpr) i = CAST(IfExpr)(e)) {
+            unify(infer(i->condition, level), bool_type);
+            PTR(Type) t = infer(i->then_branch, level);
+            unify(t, infer(i->else_branch, level));
+            return t;
+        }
+        if (PTR(VarExpr) v = CAST(VarExpr)(e)) {
+            for (auto it = env.rbegin(); it != env.rend(); ++it) {
+                if (it->first == v->name) {
+                    std::map<int, PTR(Type)> copies;
+                    return instantiate(it->second, level, copies);
+                }
+            }
+            throw TypeError("Free variable: " + v->name.name());
+        }
+        if (PTR(LetExpr) let = CAST(LetExpr)(e)) {
+            PTR(Type) rhs = infer(let->rhs, level + 1);
+            generalize(rhs, level);
+            env.emplace_back(let->var, rhs);
+            PTR(Type) body = infer(let->body, level);
+            env.pop_back();
+            return body;
+        }
+        if (PTR(LetRecExpr) rec = CAST(LetRecExpr)(e)) {
+            // Monomorphic inside its own definition, generalized for the body.
+            PTR(Type) self = fresh(level + 1);
+            env.emplace_back(rec->var, self);
+            unify(self, infer(rec->rhs, level + 1));
+            env.pop_back();
+            generalize(self, level);
+            env.emplace_back(rec->var, self);
+            PTR(Type) body = infer(rec->body, level);
+            env.pop_back();
+            return body;
+        }
+        if (PTR(FunExpr) f = CAST(FunExpr)(e)) {
+            std::vector<PTR(Type)> params;
+            for (Symbol param : f->params) {
+                params.push_back(fresh(level));
+                env.emplace_back(param, params.back());
+            }
+            PTR(Type) body = infer(f->body, level);
+            env.resize(env.size() - f->params.size());
+            return NEW(Type)(type_fun, params, body, 0, 0);
+        }
+        if (PTR(CallExpr) call = CAST(CallExpr)(e)) {
+            PTR(Type) func = infer(call->func, level);
+            std::vector<PTR(Type)> args;
+            for (PTR(Expr) arg : call->args) args.push_back(infer(arg, level));
+            PTR(Type) ret = fresh(level);
+            unify(func, NEW(Type)(type_fun, args, ret, 0, 0));
+            return ret;
+        }
+        throw TypeError("Cannot infer type of expression");
+    }
+
+    std::string to_string(PTR(Type) t) {
+        t = prune(t);
+        switch (t->kind) {
+            case type_int:
+                return "int";
+            case type_bool:
+                return "bool";
+            case type_fun: {
+                std::string s = "(";
+                for (size_t i = 0; i < t->args.size(); i++) {
+                    if (i > 0) s += ", ";
+                    s += to_string(t->args[i]);
+                }
+                if (t->args.empty()) s += "()";
+                return s + " -> " + to_string(t->ret) + ")";
+            }
+            case type_var:
+                break;
+        }
+        auto it = var_names.find(t->id);
+        if (it == var_names.end()) {
+            std::string name = "'" + std::string(1, static_cast<char>('a' + var_names.size() % 26));
+            if (var_names.size() >= 26) name += std::to_string(var_names.size() / 26);
+            it = var_names.emplace(t->id, name).first;
+        }
+        return it->second;
+    }
+
+private:
+    PTR(Type) int_type = NEW(Type)(type_int, std::vector<PTR(Type)>(), nullptr, 0, 0);
+    PTR(Type) bool_type = NEW(Type)(type_bool, std::vector<PTR(Type)>(), nullptr, 0, 0);
+    std::vector<std::pair<Symbol, PTR(Type)>> env;
+    std::map<int, std::string> var_names;
+    int next_id = 0;
+
+    PTR(Type) fresh(int level) {
+        return NEW(Type)(type_var, std::vector<PTR(Type)>(), nullptr, ++next_id, level);
+    }
+
+    // Fails if v occurs in t, and lowers the levels of t's variables to v's
+    // so they are not generalized past the binding that v belongs to.
+    void occurs_adjust(PTR(Type) v, PTR(Type) t) {
+        t = prune(t);
+        if (t == v) throw TypeError("Recursive type");
+        if (t->kind == type_var) {
+            if (t->level > v->level) t->level = v->level;
+        } else if (t->kind == type_fun) {
+            for (PTR(Type) arg : t->args) occurs_adjust(v, arg);
+            occurs_adjust(v, t->ret);
+        }
+    }
+
+    void unify(PTR(Type) a, PTR(Type) b) {
+        a = prune(a);
+        b = prune(b);
+        if (a == b) return;
+        if (a->kind == type_var) {
+            occurs_adjust(a, b);
+            a->instance = b;
+        } else if (b->kind == type_var) {
+            unify(b, a);
+        } else if (a->kind != b->kind) {
+            throw TypeError("Type mismatch");
+        } else if (a->kind == type_fun) {
+            if (a->args.size() != b->args.size()) throw TypeError("Arity mismatch");
+            for (size_t i = 0; i < a->args.size(); i++) unify(a->args[i], b->args[i]);
+            unify(a->ret, b->ret);
+        }
+    }
+
+    void generalize(PTR(Type) t, int level) {
+        t = prune(t);
+        if (t->kind == type_var) {
+            if (t->level > level) t->level = GENERIC_LEVEL;
+        } else if (t->kind == type_fun) {
+            for (PTR(Type) arg : t->args) generalize(arg, level);
+            generalize(t->ret, level);
+        }
+    }
+
+    PTR(Type) instantiate(PTR(Type) t, int level, std::map<int, PTR(Type)> &copies) {
+        t = prune(t);
+        if (t->kind == type_var) {
+            if (t->level != GENERIC_LEVEL) return t;
+            auto it = copies.find(t->id);
+            if (it != copies.end()) return it->second;
+            PTR(Type) copy = fresh(level);
+            copies.emplace(t->id, copy);
+            return copy;
+        }
+        if (t->kind == type_fun) {
+            std::vector<PTR(Type)> args;
+            for (PTR(Type) arg : t->args) args.push_back(instantiate(arg, level, copies));
+            return NEW(Type)(type_fun, args, instantiate(t->ret, level, copies), 0, 0);
+        }
+        return t;
+    }
+};
+
+// Every node of a well-typed program has proven operand types except
+// equality, which may compare values of a still-polymorphic type.
+PTR(Expr) specialize_node(PTR(Expr) e, const std::vector<PTR(Type)> &equal_types, size_t &next_equal);
+
+PTR(Expr) specialize(PTR(Expr) e, const std::vector<PTR(Type)> &equal_types, size_t &next_equal) {
+    PTR(Expr) specialized = specialize_node(e, equal_types, next_equal);
+    specialized->span = e->span;
+    return specialized;
+}
+
+PTR(Expr) specialize_node(PTR(Expr) e, const std::vector<PTR(Type)> &equal_types, size_t &next_equal) {
+    if (PTR(AddExpr) add = CAST(AddExpr)(e)) {
+        PTR(Expr) lhs = specialize(add->lhs, equal_types, next_equal);
+        PTR(Expr) rhs = specialize(add->rhs, equal_types, next_equal);
+        return NEW(AddIntExpr)(lhs, rhs);
+    }
+    if (PTR(MultExpr) mult = CAST(MultExpr)(e)) {
+        PTR(Expr) lhs = specialize(mult->lhs, equal_types, next_equal);
+        PTR(Expr) rhs = specialize(mult->rhs, equal_types, next_equal);
+        return NEW(MultIntExpr)(lhs, rhs);
+    }
+    if (PTR(EqualExpr) eq = CAST(EqualExpr)(e)) {
+        PTR(Type) t = prune(equal_types[next_equal++]);
+        PTR(Expr) lhs = specialize(eq->lhs, equal_types, next_equal);
+        PTR(Expr) rhs = specialize(eq->rhs, equal_types, next_equal);
+        if (t->kind == type_int) return NEW(EqualIntExpr)(lhs, rhs);
+        if (t->kind == type_bool) return NEW(EqualBoolExpr)(lhs, rhs);
+        return NEW(EqualExpr)(lhs, rhs);
+    }
+    if (PTR(IfExpr) i = CAST(IfExpr)(e)) {
+        PTR(Expr) c = specialize(i->condition, equal_types, next_equal);
+        PTR(Expr) t = specialize(i->then_branch, equal_types, next_equal);
+        PTR(Expr) f = specialize(i->else_branch, equal_types, next_equal);
+        return NEW(IfBoolExpr)(c, t, f);
+    }
+    if (PTR(LetExpr) let = CAST(LetExpr)(e)) {
+        PTR(Expr) rhs = specialize(let->rhs, equal_types, next_equal);
+        PTR(Expr) body = specialize(let->body, equal_types, next_equal);
+        return NEW(LetExpr)(let->var, rhs, body);
+    }
+    if (PTR(LetRecExpr) rec = CAST(LetRecExpr)(e)) {
+        PTR(Expr) rhs = specialize(rec->rhs, equal_types, next_equal);
+        PTR(Expr) body = specialize(rec->body, equal_types, next_equal);
+        return NEW(LetRecExpr)(rec->var, STATIC_CAST(FunExpr)(rhs), body);
+    }
+    if (PTR(FunExpr) f = CAST(FunExpr)(e)) {
+        return NEW(FunExpr)(f->params, specialize(f->body, equal_types, next_equal));
+    }
+    if (PTR(CallExpr) call = CAST(CallExpr)(e)) {
+        PTR(Expr) func = specialize(call->func, equal_types, next_equal);
+        std::vector<PTR(Expr)> args;
+        for (PTR(Expr) arg : call->args) args.push_back(specialize(arg, equal_types, next_equal));
+        return NEW(CallFunExpr)(func, args);
+    }
+    return e;
+}
+
+} // namespace
+
+std::string infer_type(PTR(Expr) e) {
+    Inferencer inferencer;
+    return inferencer.to_string(inferencer.infer(e, 0));
+}
+
+PTR(Expr) specialize_types(PTR(Expr) e) {
+    Inferencer inferencer;
+    try {
+        inferencer.infer(e, 0);
+    } catch (TypeError &) {
+        return e;
+    }
+    size_t next_equal = 0;
+    return specialize(e, inferencer.equal_types, next_equal);
+}
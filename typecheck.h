@@ -0,0 +1,43 @@
+#ifndef TYPECHECK_H
+#define TYPECHECK_H
+
+#include "expr.h"
+#include <stdexcept>
+#include <string>
+
+/**
+ * @file typecheck.h
+ * @brief Hindley–Milner type inference and type-directed specialization.
+ *
+ * Types are int, bool and functions; _let bindings are generalized, so a
+ * bound function may be used at several types. Programs that do not type
+ * check (for example self-application or mixing numbers and booleans) are
+ * still valid MSDscript and keep their dynamic behavior. Native functions
+ * are free variables to the checker, so scripts that call them do too.
+ */
+
+/**
+ * @brief Thrown when an expression has no type.
+ */
+class TypeError : public std::runtime_error {
+public:
+    explicit TypeError(const std::string &message) : std::runtime_error(message) {}
+};
+
+/**
+ * @brief Infers the type of a closed expression.
+ * @param e The expression.
+ * @return The type, written like "int", "bool", "(int -> 'a)" or "(int, bool -> int)".
+ * @throws TypeError If the expression is ill-typed or has free variables.
+ */
+std::string infer_type(PTR(Expr) e);
+
+/**
+ * @brief Rewrites nodes whose operand types are proven into the
+ * specialized variants that skip runtime type checks.
+ * @param e The expression.
+ * @return A specialized copy of e, or e itself if it does not type check.
+ */
+PTR(Expr) specialize_types(PTR(Expr) e);
+
+#endif // TYPECHECK_H
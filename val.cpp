@@ -1,52 +1,93 @@
 #include "val.h"
 #include "expr.h"
+#include "env.h"
+#include "eval_context.h"
+#include "profiler.h"
 #include <limits>
 #include <stdexcept>
 
 NumVal::NumVal(int64_t val) : val(val) {}
 
-PTR(Val) NumVal::add_to(PTR(Val) other_val) {
-    PTR(NumVal) other_num = CAST(NumVal)(other_val);
-    if (!other_num) throw std::runtime_error("Add of non-number");
-
-    if ((other_num->val > 0) && (val > (INT64_MAX - other_num->val))) {
-        throw std::runtime_error("Addition overflow");
-    }
-    if ((other_num->val < 0) && (val < (INT64_MIN - other_num->val))) {
-        throw std::runtime_error("Addition overflow");
-    }
-
-    return NEW(NumVal)(val + other_num->val);
+bool NumVal::try_add(int64_t lhs, int64_t rhs, int64_t &out) {
+    if ((rhs > 0) && (lhs > (INT64_MAX - rhs))) return false;
+    if ((rhs < 0) && (lhs < (INT64_MIN - rhs))) return false;
+    out = lhs + rhs;
+    return true;
 }
 
-PTR(Val) NumVal::mult_with(PTR(Val) other_val) {
-    PTR(NumVal) other_num = CAST(NumVal)(other_val);
-    if (!other_num) throw std::runtime_error("Multiplication of non-number");
-
-    if (val == 0 || other_num->val == 0) return NEW(NumVal)(0);
+bool NumVal::try_mult(int64_t lhs, int64_t rhs, int64_t &out) {
+    out = 0;
+    if (lhs == 0 || rhs == 0) return true;
 
-    if (val > 0) {
-        if (other_num->val > 0) {
-            if (val > (INT64_MAX / other_num->val)) {
-                throw std::runtime_error("Multiplication overflow");
-            }
+    if (lhs > 0) {
+        if (rhs > 0) {
+            if (lhs > (INT64_MAX / rhs)) return false;
         } else {
-            if (other_num->val < (INT64_MIN / val)) {
-                throw std::runtime_error("Multiplication overflow");
-            }
+            if (rhs < (INT64_MIN / lhs)) return false;
         }
     } else {
-        if (other_num->val > 0) {
-            if (val < (INT64_MIN / other_num->val)) {
-                throw std::runtime_error("Multiplication overflow");
-            }
+        if (rhs > 0) {
+            if (lhs < (INT64_MIN / rhs)) return false;
         } else {
-            if (val != 0 && other_num->val < (INT64_MAX / val)) {
-                throw std::runtime_error("Multiplication overflow");
-            }
+            if (lhs != 0 && rhs < (INT64_MAX / lhs)) return false;
         }
     }
-    return NEW(NumVal)(val * other_num->val);
+    out = lhs * rhs;
+    return true;
+}
+
+int64_t NumVal::checked_add(int64_t lhs, int64_t rhs) {
+    int64_t sum;
+    if (!try_add(lhs, rhs, sum)) throw std::runtime_error("Addition overflow");
+    return sum;
+}
+
+int64_t NumVal::checked_mult(int64_t lhs, int64_t rhs) {
+    int64_t product;
+    if (!try_mult(lhs, rhs, product)) throw std::runtime_error("Multiplication overflow");
+    return product;
+}
+
+PTR(Val) Val::add_to(PTR(Val) other_val) {
+    EvalStatus status;
+    PTR(Val) v = try_add_to(other_val, status);
+    if (!v) status.raise();
+    return v;
+}
+
+PTR(Val) Val::mult_with(PTR(Val) other_val) {
+    EvalStatus status;
+    PTR(Val) v = try_mult_with(other_val, status);
+    if (!v) status.raise();
+    return v;
+}
+
+PTR(Val) NumVal::try_add_to(PTR(Val) other_val, EvalStatus &status) {
+    PTR(NumVal) other_num = CAST(NumVal)(other_val);
+    if (!other_num) {
+        status.fail(eval_type_error, "Add of non-number");
+        return nullptr;
+    }
+    int64_t sum;
+    if (!try_add(val, other_num->val, sum)) {
+        status.fail(eval_overflow, "Addition overflow");
+        return nullptr;
+    }
+    return NEW(NumVal)(sum);
+}
+
+PTR(Val) NumVal::try_mult_with(PTR(Val) other_val, EvalStatus &status) {
+    PTR(NumVal) other_num = CAST(NumVal)(other_val);
+    if (!other_num) {
+        status.fail(eval_type_error, "Multiplication of non-number");
+        return nullptr;
+    }
+    int64_t product;
+    if (!try_mult(val, other_num->val, product)) {
+        status.fail(eval_overflow, "Multiplication overflow");
+        return nullptr;
+    }
+    return NEW(NumVal)(product);
 }
 
 bool NumVal::equals(PTR(Val) other_val) {
@@ -68,12 +109,14 @@ bool NumVal::is_true() {
 
 BoolVal::BoolVal(bool val) : val(val) {}
 
-PTR(Val) BoolVal::add_to(PTR(Val)) {
-    throw std::runtime_error("Addition of boolean");
+PTR(Val) BoolVal::try_add_to(PTR(Val), EvalStatus &status) {
+    status.fail(eval_type_error, "Addition of boolean");
+    return nullptr;
 }
 
-PTR(Val) BoolVal::mult_with(PTR(Val)) {
-    throw std::runtime_error("Multiplication of boolean");
+PTR(Val) BoolVal::try_mult_with(PTR(Val), EvalStatus &status) {
+    status.fail(eval_type_error, "Multiplication of boolean");
+    return nullptr;
 }
 
 bool BoolVal::equals(PTR(Val) other) {
@@ -97,26 +140,163 @@ bool Val::is_true() {
     throw std::runtime_error("test of boolean");
 }
 
-FunVal::FunVal(std::string var, PTR(Expr) body, PTR(Env) env)
-    : var(var), body(body), env(env) {}
+FunVal::FunVal(PTR(FunExpr) fun, PTR(Env) env)
+    : fun(fun), env(env) {}
+
+PTR(Val) FunVal::call(PTR(Val) arg_val) {
+    EvalStatus status;
+    PTR(Val) v = call(arg_val, status);
+    if (!v) status.raise();
+    return v;
+}
+
+PTR(Val) FunVal::call(std::vector<PTR(Val)> arg_vals) {
+    EvalStatus status;
+    PTR(Val) v = call(std::move(arg_vals), status);
+    if (!v) status.raise();
+    return v;
+}
+
+PTR(Val) FunVal::call(PTR(Val) arg_val, EvalStatus &status) {
+    if (fun->params.size() != 1) {
+        status.fail_arity(fun->params.size(), 1);
+        return nullptr;
+    }
+    eval_step();
+    EvalCallGuard depth;
+    ProfileFrame profile(RAW(fun));
+    if (fun->stack_frame) {
+        ExtendedEnv frame(fun->params[0], arg_val, env);
+        return fun->body->eval(UNOWNED(Env)(&frame), status);
+    }
+    eval_allocated(sizeof(ExtendedEnv));
+    PTR(Env) new_env = NEW(ExtendedEnv)(fun->params[0], arg_val, env);
+    return fun->body->eval(new_env, status);
+}
+
+PTR(Val) FunVal::call(std::vector<PTR(Val)> arg_vals, EvalStatus &status) {
+    if (fun->stack_frame && arg_vals.size() == fun->params.size() && !arg_vals.empty()) {
+        eval_step();
+        EvalCallGuard depth;
+        ProfileFrame profile(RAW(fun));
+        if (arg_vals.size() == 1) {
+            ExtendedEnv frame(fun->params[0], arg_vals[0], env);
+            return fun->body->eval(UNOWNED(Env)(&frame), status);
+        }
+        FrameEnv frame(fun, std::move(arg_vals), env);
+        return fun->body->eval(UNOWNED(Env)(&frame), status);
+    }
+    PTR(Env) new_env = bind(fun, std::move(arg_vals), env, status);
+    if (!new_env) return nullptr;
+    eval_step();
+    EvalCallGuard depth;
+    ProfileFrame profile(RAW(fun));
+    return fun->body->eval(new_env, status);
+}
+
+// All arguments of a call share one frame; a single parameter keeps the
+// cheaper ExtendedEnv shape and a call with no parameters binds nothing.
+PTR(Env) FunVal::bind(PTR(FunExpr) fun, std::vector<PTR(Val)> arg_vals, PTR(Env) env, EvalStatus &status) {
+    size_t count = fun->params.size();
+    if (arg_vals.size() != count) {
+        status.fail_arity(count, arg_vals.size());
+        return nullptr;
+    }
+    if (count == 0) return env;
+    if (count == 1) {
+        eval_allocated(sizeof(ExtendedEnv));
+        return NEW(ExtendedEnv)(fun->params[0], arg_vals[0], env);
+    }
+    eval_allocated(sizeof(FrameEnv) + count * sizeof(PTR(Val)));
+    return NEW(FrameEnv)(fun, std::move(arg_vals), env);
+}
 
-PTR(Val) FunVal::add_to(PTR(Val)) {
-    throw std::runtime_error("Cannot add functions");
+PTR(Val) FunVal::try_add_to(PTR(Val), EvalStatus &status) {
+    status.fail(eval_type_error, "Cannot add functions");
+    return nullptr;
 }
 
-PTR(Val) FunVal::mult_with(PTR(Val)) {
-    throw std::runtime_error("Cannot multiply functions");
+PTR(Val) FunVal::try_mult_with(PTR(Val), EvalStatus &status) {
+    status.fail(eval_type_error, "Cannot multiply functions");
+    return nullptr;
 }
 
 bool FunVal::equals(PTR(Val) other) {
     PTR(FunVal) f = CAST(FunVal)(other);
-    return f && var == f->var && body->equals(f->body) && env == f->env;
+    return f && fun->equals(f->fun) && env == f->env;
 }
 
 PTR(Expr) FunVal::to_expr() {
-    return NEW(FunExpr)(var, body);
+    return fun;
 }
 
 std::string FunVal::to_string() {
     return "[function]";
 }
+
+NativeFunVal::NativeFunVal(Symbol name, std::vector<native_type_t> params, Impl impl)
+    : name(name), params(std::move(params)), impl(std::move(impl)) {}
+
+PTR(Val) NativeFunVal::call(const std::vector<PTR(Val)> &arg_vals) {
+    EvalStatus status;
+    PTR(Val) v = call(arg_vals, status);
+    if (!v) status.raise();
+    return v;
+}
+
+PTR(Val) NativeFunVal::call(const std::vector<PTR(Val)> &arg_vals, EvalStatus &status) {
+    if (arg_vals.size() != params.size()) {
+        status.fail_arity(params.size(), arg_vals.size());
+        return nullptr;
+    }
+    for (size_t i = 0; i < params.size(); i++) {
+        if ((params[i] == native_int && !CAST(NumVal)(arg_vals[i])) ||
+            (params[i] == native_bool && !CAST(BoolVal)(arg_vals[i]))) {
+            status.fail_native_argument(name, i + 1, params[i] == native_int ? "a number" : "a boolean");
+            return nullptr;
+        }
+    }
+    eval_step();
+    ProfileFrame profile(this);
+    try {
+        return impl(arg_vals);
+    } catch (EvalCancelled &) {
+        throw;
+    } catch (EvalLimitExceeded &) {
+        throw;
+    } catch (std::runtime_error &err) {
+        status.fail_native(err.what());
+        return nullptr;
+    }
+}
+
+uint32_t NativeFunVal::profile_label() {
+    uint32_t l = label.load(std::memory_order_relaxed);
+    if (l == 0) {
+        l = intern_profile_label(name.name());
+        label.store(l, std::memory_order_relaxed);
+    }
+    return l;
+}
+
+PTR(Val) NativeFunVal::try_add_to(PTR(Val), EvalStatus &status) {
+    status.fail(eval_type_error, "Cannot add functions");
+    return nullptr;
+}
+
+PTR(Val) NativeFunVal::try_mult_with(PTR(Val), EvalStatus &status) {
+    status.fail(eval_type_error, "Cannot multiply functions");
+    return nullptr;
+}
+
+bool NativeFunVal::equals(PTR(Val) other) {
+    return RAW(other) == this;
+}
+
+PTR(Expr) NativeFunVal::to_expr() {
+    return NEW(VarExpr)(name);
+}
+
+std::string NativeFunVal::to_string() {
+    return "[function]";
+}
@@ -2,16 +2,25 @@
 #define VAL_H
 
 #include "pointer.h"
+#include "symbol.h"
+#include "eval_status.h"
+#include <atomic>
+#include <functional>
 #include <string>
+#include <vector>
 
 class Expr;
+class FunExpr;
 class Env;
 
 CLASS(Val) {
 public:
     virtual ~Val() = default;
-    virtual PTR(Val) add_to(PTR(Val) other_val) = 0;
-    virtual PTR(Val) mult_with(PTR(Val) other_val) = 0;
+    // Return nullptr and fill in status instead of throwing on an error.
+    virtual PTR(Val) try_add_to(PTR(Val) other_val, EvalStatus &status) = 0;
+    virtual PTR(Val) try_mult_with(PTR(Val) other_val, EvalStatus &status) = 0;
+    PTR(Val) add_to(PTR(Val) other_val);
+    PTR(Val) mult_with(PTR(Val) other_val);
     virtual bool equals(PTR(Val) other_val) = 0;
     virtual PTR(Expr) to_expr() = 0;
     virtual std::string to_string() = 0;
@@ -22,8 +31,13 @@ class NumVal : public Val {
 public:
     int64_t val;
     NumVal(int64_t val);
-    PTR(Val) add_to(PTR(Val) other_val) override;
-    PTR(Val) mult_with(PTR(Val) other_val) override;
+    static int64_t checked_add(int64_t lhs, int64_t rhs);
+    static int64_t checked_mult(int64_t lhs, int64_t rhs);
+    // Store the result in out; false on overflow.
+    static bool try_add(int64_t lhs, int64_t rhs, int64_t &out);
+    static bool try_mult(int64_t lhs, int64_t rhs, int64_t &out);
+    PTR(Val) try_add_to(PTR(Val) other_val, EvalStatus &status) override;
+    PTR(Val) try_mult_with(PTR(Val) other_val, EvalStatus &status) override;
     bool equals(PTR(Val) other_val) override;
     PTR(Expr) to_expr() override;
     std::string to_string() override;
@@ -34,8 +48,8 @@ class BoolVal : public Val {
 public:
     bool val;
     BoolVal(bool val);
-    PTR(Val) add_to(PTR(Val) other_val) override;
-    PTR(Val) mult_with(PTR(Val) other_val) override;
+    PTR(Val) try_add_to(PTR(Val) other_val, EvalStatus &status) override;
+    PTR(Val) try_mult_with(PTR(Val) other_val, EvalStatus &status) override;
     bool equals(PTR(Val) other_val) override;
     PTR(Expr) to_expr() override;
     std::string to_string() override;
@@ -44,15 +58,50 @@ public:
 
 class FunVal : public Val {
 public:
-    std::string var;
-    PTR(Expr) body;
+    PTR(FunExpr) fun;
     PTR(Env) env;
-    FunVal(std::string var, PTR(Expr) body, PTR(Env) env);
-    PTR(Val) add_to(PTR(Val) other_val) override;
-    PTR(Val) mult_with(PTR(Val) other_val) override;
+    FunVal(PTR(FunExpr) fun, PTR(Env) env);
+    PTR(Val) call(PTR(Val) arg_val);
+    PTR(Val) call(std::vector<PTR(Val)> arg_vals);
+    PTR(Val) call(PTR(Val) arg_val, EvalStatus &status);
+    PTR(Val) call(std::vector<PTR(Val)> arg_vals, EvalStatus &status);
+    // Returns nullptr on an arity mismatch.
+    static PTR(Env) bind(PTR(FunExpr) fun, std::vector<PTR(Val)> arg_vals, PTR(Env) env, EvalStatus &status);
+    PTR(Val) try_add_to(PTR(Val) other_val, EvalStatus &status) override;
+    PTR(Val) try_mult_with(PTR(Val) other_val, EvalStatus &status) override;
     bool equals(PTR(Val) other_val) override;
     PTR(Expr) to_expr() override;
     std::string to_string() override;
 };
 
+typedef enum {
+    native_any,
+    native_int,
+    native_bool
+} native_type_t;
+
+// A function implemented in C++. CallExpr checks the argument count and
+// the declared parameter types before handing the values to impl. An impl
+// reports errors by throwing std::runtime_error; the call turns it into an
+// eval_native_error.
+class NativeFunVal : public Val {
+public:
+    typedef std::function<PTR(Val)(const std::vector<PTR(Val)> &args)> Impl;
+
+    Symbol name;
+    std::vector<native_type_t> params;
+    Impl impl;
+    NativeFunVal(Symbol name, std::vector<native_type_t> params, Impl impl);
+    PTR(Val) call(const std::vector<PTR(Val)> &arg_vals);
+    PTR(Val) call(const std::vector<PTR(Val)> &arg_vals, EvalStatus &status);
+    uint32_t profile_label();
+    PTR(Val) try_add_to(PTR(Val) other_val, EvalStatus &status) override;
+    PTR(Val) try_mult_with(PTR(Val) other_val, EvalStatus &status) override;
+    bool equals(PTR(Val) other_val) override;
+    PTR(Expr) to_expr() override;
+    std::string to_string() override;
+private:
+    std::atomic<uint32_t> label{0};
+};
+
 #endif